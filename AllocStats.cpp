@@ -0,0 +1,175 @@
+// AllocStats.cpp
+#include "AllocStats.h"
+#include "Console.h"
+#include <esp_heap_caps.h>
+#include <new>
+#include <stdlib.h>
+
+volatile uint32_t AllocStats::allocs = 0;
+volatile uint32_t AllocStats::mallocs = 0;
+volatile uint32_t AllocStats::frees = 0;
+volatile uint32_t AllocStats::bytes = 0;
+volatile uint32_t AllocStats::live = 0;
+volatile uint32_t AllocStats::peak = 0;
+AllocStats::ScopeStats AllocStats::scopes[SCOPES] = {};
+bool AllocStats::strict[SCOPES] = {false};
+
+#if ALLOC_STATS_WRAP_MALLOC
+// Настоящие функции под --wrap; new/delete идут мимо обёрток, чтобы не считаться дважды
+extern "C" void* __real_malloc(size_t size);
+extern "C" void* __real_calloc(size_t n, size_t size);
+extern "C" void* __real_realloc(void* p, size_t size);
+extern "C" void __real_free(void* p);
+#define ALLOC_RAW_MALLOC __real_malloc
+#define ALLOC_RAW_FREE __real_free
+#else
+#define ALLOC_RAW_MALLOC malloc
+#define ALLOC_RAW_FREE free
+#endif
+
+// new и malloc могут прийти из задач WiFi, поэтому атомарно
+static void countAlloc(void* p, size_t size) {
+  __atomic_fetch_add(&AllocStats::allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&AllocStats::bytes, size, __ATOMIC_RELAXED);
+  uint32_t now = __atomic_add_fetch(&AllocStats::live, heap_caps_get_allocated_size(p), __ATOMIC_RELAXED);
+  if (now > AllocStats::peak) AllocStats::peak = now;
+}
+
+static void countFree(void* p) {
+  __atomic_fetch_add(&AllocStats::frees, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&AllocStats::live, heap_caps_get_allocated_size(p), __ATOMIC_RELAXED);
+}
+
+static void* countedAlloc(size_t size) {
+  void* p = ALLOC_RAW_MALLOC(size ? size : 1);
+  if (p) countAlloc(p, size);
+  return p;
+}
+
+static void countedFree(void* p) {
+  if (!p) return;
+  countFree(p);
+  ALLOC_RAW_FREE(p);
+}
+
+#if ALLOC_STATS_WRAP_MALLOC
+extern "C" void* __wrap_malloc(size_t size) {
+  void* p = __real_malloc(size);
+  if (p) {
+    __atomic_fetch_add(&AllocStats::mallocs, 1, __ATOMIC_RELAXED);
+    countAlloc(p, size);
+  }
+  return p;
+}
+
+extern "C" void* __wrap_calloc(size_t n, size_t size) {
+  void* p = __real_calloc(n, size);
+  if (p) {
+    __atomic_fetch_add(&AllocStats::mallocs, 1, __ATOMIC_RELAXED);
+    countAlloc(p, n * size);
+  }
+  return p;
+}
+
+// Перевыделение - новое выделение (String растёт именно так); старый блок освобождается
+extern "C" void* __wrap_realloc(void* old, size_t size) {
+  size_t oldSize = old ? heap_caps_get_allocated_size(old) : 0;
+  void* p = __real_realloc(old, size);
+  // Без нового блока старый освобождён только при size == 0
+  if (old && (p || size == 0)) {
+    __atomic_fetch_add(&AllocStats::frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&AllocStats::live, oldSize, __ATOMIC_RELAXED);
+  }
+  if (p) {
+    __atomic_fetch_add(&AllocStats::mallocs, 1, __ATOMIC_RELAXED);
+    countAlloc(p, size);
+  }
+  return p;
+}
+
+extern "C" void __wrap_free(void* p) {
+  if (!p) return;
+  countFree(p);
+  __real_free(p);
+}
+#endif
+
+static void* countedNew(size_t size) {
+  void* p = countedAlloc(size);
+#if __cpp_exceptions
+  if (!p) throw std::bad_alloc();
+#else
+  if (!p) abort();
+#endif
+  return p;
+}
+
+void* operator new(size_t size) { return countedNew(size); }
+void* operator new[](size_t size) { return countedNew(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size); }
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { countedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { countedFree(p); }
+
+AllocScope::AllocScope(AllocStats::Scope scope)
+    : scope(scope), allocsBefore(AllocStats::allocs), mallocsBefore(AllocStats::mallocs), bytesBefore(AllocStats::bytes), liveBefore(AllocStats::live),
+      outerPeak(AllocStats::peak), heapBefore(heap_caps_get_free_size(MALLOC_CAP_8BIT)) {
+  AllocStats::peak = liveBefore;
+}
+
+AllocScope::~AllocScope() {
+  uint32_t allocs = AllocStats::allocs - allocsBefore;
+  uint32_t mallocs = AllocStats::mallocs - mallocsBefore;
+  uint32_t bytes = AllocStats::bytes - bytesBefore;
+  uint32_t peak = AllocStats::peak > liveBefore ? AllocStats::peak - liveBefore : 0;
+  AllocStats::ScopeStats& s = AllocStats::scopes[scope];
+  s.calls++;
+  s.allocs += allocs;
+  s.mallocs += mallocs;
+  s.bytes += bytes;
+  if (allocs > s.maxAllocs) s.maxAllocs = allocs;
+  if (bytes > s.maxBytes) s.maxBytes = bytes;
+  if (peak > s.peak) s.peak = peak;
+  s.heapNet += (int32_t)(heapBefore - heap_caps_get_free_size(MALLOC_CAP_8BIT));
+  if (AllocStats::strict[scope] && allocs) {
+    s.violations++;
+    Console.at(ConsoleSink::L_ERROR).printf("Error: %s allocated %lu B in %lu calls (%lu malloc)\n",
+                                            AllocStats::scopeName(scope), (unsigned long)bytes,
+                                            (unsigned long)allocs, (unsigned long)mallocs);
+  }
+  if (outerPeak > AllocStats::peak) AllocStats::peak = outerPeak;
+}
+
+void AllocStats::reset() {
+  memset(scopes, 0, sizeof(scopes));
+  resetPeak();
+}
+
+void AllocStats::printJson(Print& out) {
+  char buf[288];
+  snprintf(buf, sizeof(buf),
+           "{\"mallocWrapped\":%s,\"allocs\":%lu,\"mallocs\":%lu,\"frees\":%lu,\"bytes\":%lu,\"live\":%lu,"
+           "\"peak\":%lu,\"heap\":{\"free\":%u,\"minFree\":%u,\"largest\":%u},\"scopes\":{",
+           ALLOC_STATS_WRAP_MALLOC ? "true" : "false", (unsigned long)allocs, (unsigned long)mallocs,
+           (unsigned long)frees, (unsigned long)bytes, (unsigned long)live,
+           (unsigned long)peak, (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+           (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT),
+           (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  out.print(buf);
+  for (int i = 0; i < SCOPES; i++) {
+    const ScopeStats& s = scopes[i];
+    snprintf(buf, sizeof(buf),
+             "%s\"%s\":{\"calls\":%lu,\"allocs\":%lu,\"mallocs\":%lu,\"bytes\":%lu,\"maxAllocs\":%lu,\"maxBytes\":%lu,"
+             "\"peak\":%lu,\"heapNet\":%ld,\"strict\":%s,\"violations\":%lu}",
+             i ? "," : "", scopeName(i), (unsigned long)s.calls, (unsigned long)s.allocs, (unsigned long)s.mallocs,
+             (unsigned long)s.bytes,
+             (unsigned long)s.maxAllocs, (unsigned long)s.maxBytes, (unsigned long)s.peak, (long)s.heapNet,
+             strict[i] ? "true" : "false", (unsigned long)s.violations);
+    out.print(buf);
+  }
+  out.println("}}");
+}
@@ -0,0 +1,73 @@
+// AllocStats.h
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <Arduino.h>
+
+#ifndef ALLOC_STATS_WRAP_MALLOC
+#define ALLOC_STATS_WRAP_MALLOC 0
+#endif
+
+// Счётчики глобальных operator new/delete (замена в AllocStats.cpp).
+// Живой объём считается по фактическому размеру блока в куче.
+// String и ArduinoJson выделяют память через malloc напрямую; их выделения
+// считаются, если сборка оборачивает malloc линкером:
+//   build_flags = -DALLOC_STATS_WRAP_MALLOC=1 -Wl,--wrap=malloc -Wl,--wrap=calloc
+//                 -Wl,--wrap=realloc -Wl,--wrap=free
+// Тогда allocs включает и их (отдельно - mallocs), и strict срабатывает на них тоже.
+// Без обёртки malloc видно только по изменению свободной кучи (heapNet).
+class AllocStats {
+public:
+  static volatile uint32_t allocs;   // все выделения, с malloc/calloc/realloc
+  static volatile uint32_t mallocs;  // из них через malloc/calloc/realloc
+  static volatile uint32_t frees;
+  static volatile uint32_t bytes;    // запрошено всего
+  static volatile uint32_t live;     // занято сейчас
+  static volatile uint32_t peak;     // максимум live с последнего resetPeak()
+
+  static void resetPeak() { peak = live; }
+
+  // Области, по которым копятся счётчики (AllocScope)
+  enum Scope : uint8_t { S_TICK, S_COMMAND, S_SERIALIZE, S_FLUSH, SCOPES };
+
+  struct ScopeStats {
+    uint32_t calls;
+    uint32_t allocs;
+    uint32_t mallocs;
+    uint32_t bytes;
+    uint32_t maxAllocs;   // за один вызов
+    uint32_t maxBytes;
+    uint32_t peak;        // максимум прироста живого объёма внутри вызова
+    int32_t heapNet;      // изменение свободной кучи (с malloc из String/JSON), сумма
+    uint32_t violations;  // вызовы с выделениями при strict
+  };
+
+  static ScopeStats scopes[SCOPES];
+  static bool strict[SCOPES];   // режим "ноль выделений": нарушение - ошибка в консоль
+
+  static const char* scopeName(int scope) {
+    static const char* names[SCOPES] = {"tick", "command", "serialize", "flush"};
+    return names[scope];
+  }
+  static void reset();
+  static void printJson(Print& out);
+};
+
+// Считает выделения от конструктора до деструктора и складывает в область.
+// Вложенные области не мешают друг другу: пик внешней восстанавливается.
+class AllocScope {
+public:
+  explicit AllocScope(AllocStats::Scope scope);
+  ~AllocScope();
+
+private:
+  AllocStats::Scope scope;
+  uint32_t allocsBefore;
+  uint32_t mallocsBefore;
+  uint32_t bytesBefore;
+  uint32_t liveBefore;
+  uint32_t outerPeak;
+  size_t heapBefore;
+};
+
+#endif
@@ -0,0 +1,185 @@
+// Bench.h
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <Arduino.h>
+#include <Console.h>
+#include <ArduinoJson.h>
+#include <LittleFS.h>
+#include <vector>
+#include <AllocStats.h>
+#include <LogArena.h>
+#include <Motor.h>
+
+// Микробенчмарки горячих путей, запускаются на плате командой BENCH.
+// На каждый случай: нс на операцию, байт через operator new на операцию и пик
+// живой памяти. Базовые значения лежат в /bench.json; случай проваливается, если
+// он медленнее базы больше чем на TOLERANCE_PCT процентов или выделяет больше.
+class Bench {
+public:
+  static const int TOLERANCE_PCT = 25;
+  static const int BYTES_SLACK = 8;
+
+  struct Result {
+    String name;
+    uint32_t iterations;
+    float nsPerOp;
+    float bytesPerOp;
+    uint32_t peakBytes;
+  };
+
+  // Print, который ничего не хранит: меряем формирование, а не рост буфера
+  class NullPrint : public Print {
+  public:
+    size_t write(uint8_t) override { return 1; }
+    size_t write(const uint8_t*, size_t n) override { return n; }
+  };
+
+  explicit Bench(const String& filter, const char* baselinePath = "/bench.json")
+      : filter(filter), baselinePath(baselinePath) {}
+
+  bool wants(const char* name) const { return filter == "*" || filter == name; }
+
+  template <typename F>
+  void measure(const char* name, uint32_t iterations, F op) {
+    if (!wants(name)) return;
+    op(); // прогрев: ленивые загрузки и первые выделения не в счёт
+    uint32_t bytesBefore = AllocStats::bytes;
+    AllocStats::resetPeak();
+    uint32_t liveBefore = AllocStats::live;
+    unsigned long start = micros();
+    for (uint32_t i = 0; i < iterations; i++) op();
+    unsigned long elapsed = micros() - start;
+    Result r;
+    r.name = name;
+    r.iterations = iterations;
+    r.nsPerOp = elapsed * 1000.0f / iterations;
+    r.bytesPerOp = (float)(AllocStats::bytes - bytesBefore) / iterations;
+    r.peakBytes = AllocStats::peak - liveBefore;
+    results.push_back(r);
+  }
+
+  // Журнал, включение мотора и уровни баков на временных устройствах без пинов
+  void deviceCases() {
+    Device::scratch = true;
+    Tank* src = new Tank("_bsrc", 1000000);
+    Tank* dst = new Tank("_bdst", 1000000);
+    Motor* motor = new Motor("_bmotor", -1, 10, -1, src, dst);
+    Device::scratch = false;
+    if (src->getSlot() == DeviceTable::SIZE || dst->getSlot() == DeviceTable::SIZE ||
+        motor->getSlot() == DeviceTable::SIZE) {
+      Console.at(ConsoleSink::L_ERROR).println("Error: Device table full, skipping device benchmarks");
+    } else {
+      StaticJsonDocument<64> extra;
+      extra["ms"] = 1000;
+      JsonObject extraObj = extra.as<JsonObject>();
+      measure("fileLog", 100, [&]() { src->fileLog("debug", "bench", extraObj, true); });
+      LogArena::discard(src->getSlot());
+
+      static const size_t sizes[] = {1024, 4096, 8 * 1024};
+      for (size_t target : sizes) {
+        removeLogs(src);
+        fillLogs(src, target);
+        String flushName = "flushLogs/" + String(target / 1024) + "k";
+        String readName = "getLastLogs/" + String(target / 1024) + "k";
+        measure(flushName.c_str(), 10, [&]() {
+          for (int i = 0; i < 20; i++) appendSample(src);
+          src->flushLogs();
+        });
+        measure(readName.c_str(), 10, [&]() { src->getLastLogs(20); });
+      }
+
+      measure("motorOnOff", 50, [&]() {
+        motor->on(0);
+        motor->off();
+      });
+      measure("tankFillDrain", 1000, [&]() {
+        dst->fill(1);
+        dst->drain(1);
+      });
+    }
+    Device* benchDevices[] = {motor, src, dst};
+    for (Device* d : benchDevices) {
+      LogArena::discard(d->getSlot());
+      removeLogs(d);
+      d->removeStats();
+      delete d;
+    }
+  }
+
+  // Печатает таблицу, сверяет с базой; save - записать текущие значения как базу
+  bool report(Print& out, bool save) {
+    DynamicJsonDocument baseline(2048);
+    if (LittleFS.exists(baselinePath)) {
+      File file = LittleFS.open(baselinePath, FILE_READ);
+      deserializeJson(baseline, file);
+      file.close();
+    }
+    if (!baseline.is<JsonObject>()) baseline.to<JsonObject>();
+
+    int failed = 0;
+    for (const Result& r : results) {
+      char buf[128];
+      JsonObject base = baseline[r.name];
+      const char* verdict = "new";
+      if (base) {
+        float ns = base["ns"] | 0.0f;
+        float b = base["b"] | 0.0f;
+        bool slow = r.nsPerOp > ns * (100 + TOLERANCE_PCT) / 100;
+        bool fat = r.bytesPerOp > b * (100 + TOLERANCE_PCT) / 100 + BYTES_SLACK;
+        verdict = slow || fat ? "FAIL" : "ok";
+        if (slow || fat) failed++;
+      }
+      snprintf(buf, sizeof(buf), "%-18s %6lu x %10.0f ns/op %8.1f B/op peak %6lu B  %s", r.name.c_str(),
+               (unsigned long)r.iterations, r.nsPerOp, r.bytesPerOp, (unsigned long)r.peakBytes, verdict);
+      out.println(buf);
+      if (save) {
+        JsonObject entry = baseline.createNestedObject(r.name);
+        entry["ns"] = r.nsPerOp;
+        entry["b"] = r.bytesPerOp;
+      }
+    }
+    if (save) {
+      File file = LittleFS.open(baselinePath, FILE_WRITE);
+      serializeJson(baseline, file);
+      file.close();
+      out.println("Baseline saved");
+      return true;
+    }
+    out.println(failed ? "BENCH FAIL: " + String(failed) + " regressed" : String("BENCH PASS"));
+    return failed == 0;
+  }
+
+private:
+  String filter;
+  const char* baselinePath;
+  std::vector<Result> results;
+  const char* sampleLine = "{\"time\":1700000000000,\"type\":\"debug\",\"name\":\"_bsrc\",\"message\":\"Off\","
+                           "\"extra\":{\"ms\":1500,\"ml\":150}}";
+
+  void appendSample(Device* d) { LogArena::append(d->getSlot(), LogArena::K_DEBUG, sampleLine, strlen(sampleLine)); }
+
+  void removeLogs(Device* d) {
+    for (int i = 0; i < Device::LOG_SEGMENTS; i++) LittleFS.remove(d->logPath(i));
+    d->logEncoder.loaded = false;
+  }
+
+  // Журнал примерно заданного размера на флеше
+  void fillLogs(Device* d, size_t target) {
+    size_t total = 0;
+    for (int flushes = 0; total < target && flushes < 200; flushes++) {
+      for (int i = 0; i < 20; i++) appendSample(d);
+      d->flushLogs();
+      total = 0;
+      for (int i = 0; i < Device::LOG_SEGMENTS; i++) {
+        String path = d->logPath(i);
+        if (!LittleFS.exists(path)) continue;
+        File file = LittleFS.open(path, FILE_READ);
+        total += file.size();
+        file.close();
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,189 @@
+// ClientQueues.h
+#ifndef CLIENT_QUEUES_H
+#define CLIENT_QUEUES_H
+
+#include <Arduino.h>
+#include <WebSocketsServer.h>
+#include <lwip/sockets.h>
+#include <DeviceTable.h>
+
+// Исходящая очередь каждого клиента WebSocket - маска изменённых устройств.
+// Повторное изменение того же устройства не добавляет кадр: при отправке
+// берётся самое свежее состояние, поэтому очередь ограничена числом устройств.
+// За тик уходит не больше FRAMES_PER_TICK кадров, по кругу между клиентами.
+// Медленный клиент (отправка дольше SLOW_SEND_MS) пропускает BACKOFF_MS;
+// отстающий дольше RESYNC_MS получает вместо дельт полный список, а дольше
+// DISCONNECT_MS или MAX_SLOW медленных отправок подряд - отключается.
+// Отправка блокирует, пока TCP не примет кадр, поэтому до неё проверяется,
+// есть ли место в буфере сокета (writable); нет - кадр не шлётся, изменения
+// копятся в маске, а попытка считается медленной.
+class ClientQueues {
+public:
+  static const int MAX_CLIENTS = WEBSOCKETS_SERVER_CLIENT_MAX;
+  static const int FRAMES_PER_TICK = 2;
+  static const unsigned long SLOW_SEND_MS = 20;
+  static const unsigned long BACKOFF_MS = 250;
+  static const unsigned long RESYNC_MS = 2000;
+  static const unsigned long DISCONNECT_MS = 15000;
+  static const uint8_t MAX_SLOW = 5;
+
+  struct Client {
+    bool connected;
+    bool needFull;
+    uint8_t dirty[DeviceTable::SIZE];
+    uint8_t depth;            // устройств в очереди
+    uint8_t slowInRow;
+    unsigned long since;      // millis() самого старого неотправленного изменения
+    unsigned long backoffUntil;
+    // Метрики
+    uint32_t frames;
+    uint32_t coalesced;       // изменения, слитые с уже ждущими
+    uint32_t resyncs;
+    uint32_t slowSends;
+    uint8_t maxDepth;
+    uint32_t latencySumMs;
+    uint32_t maxLatencyMs;
+  };
+
+  void connect(uint8_t num) {
+    if (num >= MAX_CLIENTS) return;
+    Client& c = clients[num];
+    c = Client();
+    c.connected = true;
+    c.needFull = true;
+    c.since = millis();
+  }
+  void disconnect(uint8_t num) {
+    if (num >= MAX_CLIENTS || !clients[num].connected) return;
+    clients[num].connected = false;
+    disconnects++;
+  }
+
+  void mark(const uint8_t* changes, int count) {
+    unsigned long now = millis();
+    for (Client& c : clients) {
+      if (!c.connected) continue;
+      bool was = pending(c);
+      for (int slot = 0; slot < count; slot++) {
+        if (!changes[slot]) continue;
+        if (c.dirty[slot]) c.coalesced++;
+        else c.depth++;
+        c.dirty[slot] |= changes[slot];
+      }
+      if (!was && pending(c)) c.since = now;
+      if (c.depth > c.maxDepth) c.maxDepth = c.depth;
+    }
+  }
+  void resyncAll() {
+    for (Client& c : clients) {
+      if (!c.connected) continue;
+      if (!pending(c)) c.since = millis();
+      c.needFull = true;
+    }
+  }
+
+  bool pending(const Client& c) const { return c.needFull || c.depth > 0; }
+
+  // Следующий клиент к отправке или -1; вызывать до FRAMES_PER_TICK раз за тик
+  int next(unsigned long now) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+      int num = (cursor + i) % MAX_CLIENTS;
+      Client& c = clients[num];
+      if (!c.connected || !pending(c) || (long)(now - c.backoffUntil) < 0) continue;
+      // Дельты слишком устарели - дешевле отправить всё заново
+      if (!c.needFull && now - c.since >= RESYNC_MS) {
+        c.needFull = true;
+        c.resyncs++;
+      }
+      cursor = (num + 1) % MAX_CLIENTS;
+      return num;
+    }
+    return -1;
+  }
+
+  // Клиент, которого пора отключить, или -1
+  int overdue(unsigned long now) const {
+    for (int num = 0; num < MAX_CLIENTS; num++) {
+      const Client& c = clients[num];
+      if (!c.connected) continue;
+      if (c.slowInRow >= MAX_SLOW || (pending(c) && now - c.since >= DISCONNECT_MS)) return num;
+    }
+    return -1;
+  }
+
+  // Кадр ушёл (или не ушёл): очередь клиента очищается, время отправки учитывается
+  void sent(uint8_t num, unsigned long now, unsigned long tookMs, bool ok) {
+    Client& c = clients[num];
+    if (tookMs >= SLOW_SEND_MS || !ok) {
+      c.slowSends++;
+      c.slowInRow++;
+      c.backoffUntil = now + BACKOFF_MS;
+    } else {
+      c.slowInRow = 0;
+    }
+    if (!ok) return;
+    uint32_t latency = now - c.since;
+    c.frames++;
+    c.latencySumMs += latency;
+    if (latency > c.maxLatencyMs) c.maxLatencyMs = latency;
+    memset(c.dirty, 0, sizeof(c.dirty));
+    c.depth = 0;
+    c.needFull = false;
+  }
+
+  // Сокет клиента не заполнен: sendTXT не встанет в ожидании окна TCP.
+  // lwip отмечает сокет записываемым, пока свободно больше TCP_SNDLOWAT
+  static bool writable(WebSocketsServer& ws, uint8_t num) {
+    WiFiClient* tcp = Access::client(ws, num).tcp;
+    int fd = tcp ? tcp->fd() : -1;
+    if (fd < 0) return false;
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    timeval zero = {0, 0};
+    return select(fd + 1, nullptr, &set, nullptr, &zero) > 0;
+  }
+
+  // Сокет переполнен: кадр не отправлен, клиент ждёт BACKOFF_MS
+  void blocked(uint8_t num, unsigned long now) {
+    Client& c = clients[num];
+    c.slowSends++;
+    c.slowInRow++;
+    c.backoffUntil = now + BACKOFF_MS;
+  }
+
+  const Client& client(uint8_t num) const { return clients[num]; }
+
+  void printStats(Print& out) const {
+    char buf[192];
+    out.print("{\"disconnects\":");
+    out.print((unsigned long)disconnects);
+    out.print(",\"clients\":[");
+    bool first = true;
+    for (int num = 0; num < MAX_CLIENTS; num++) {
+      const Client& c = clients[num];
+      if (!c.connected) continue;
+      snprintf(buf, sizeof(buf),
+               "%s{\"id\":%d,\"depth\":%u,\"maxDepth\":%u,\"frames\":%lu,\"coalesced\":%lu,\"resyncs\":%lu,"
+               "\"slow\":%lu,\"latencyMs\":%lu,\"maxLatencyMs\":%lu}",
+               first ? "" : ",", num, c.depth, c.maxDepth, (unsigned long)c.frames, (unsigned long)c.coalesced,
+               (unsigned long)c.resyncs, (unsigned long)c.slowSends,
+               (unsigned long)(c.frames ? c.latencySumMs / c.frames : 0), (unsigned long)c.maxLatencyMs);
+      out.print(buf);
+      first = false;
+    }
+    out.println("]}");
+  }
+
+private:
+  // Клиенты WebSocketsServer защищены; указатель на член через наследника - законный доступ
+  struct Access : WebSocketsServer {
+    static WSclient_t& client(WebSocketsServer& ws, uint8_t num) { return (ws.*(&Access::_clients))[num]; }
+  };
+
+  Client clients[MAX_CLIENTS] = {};
+  int cursor = 0;
+  uint32_t disconnects = 0;
+};
+
+#endif
@@ -0,0 +1,118 @@
+// Console.cpp
+#include "Console.h"
+
+ConsoleSink Console(Serial);
+
+size_t ConsoleSink::write(const uint8_t* data, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    char c = data[i];
+    if (c == '\n') {
+      commit();
+      continue;
+    }
+    if (c == '\r') continue;
+    if (lineLen == MAX_LINE - 1) spill();
+    line[lineLen++] = c;
+  }
+  return n;
+}
+
+// Буфер строки полон: накопленное - в кольцо, строка продолжится там же
+void ConsoleSink::spill() {
+  if (lineLevel <= maxLevel) {
+    push(line, lineLen);
+    lineSpilled = true;
+  }
+  lineLen = 0;
+}
+
+// Для начатой длинной строки: без потерь, при нехватке места - ждать Serial
+void ConsoleSink::push(const char* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (used == RING_SIZE) {
+      stats.waits++;
+      flushAll();
+      if (used == RING_SIZE) return;
+    }
+    ring[head] = data[i];
+    head = (head + 1) % RING_SIZE;
+    used++;
+  }
+}
+
+void ConsoleSink::commit() {
+  Level level = lineLevel;
+  size_t len = lineLen;
+  lineLen = 0;
+  lineLevel = L_INFO;
+
+  if (lineSpilled) {
+    lineSpilled = false;
+    push(line, len);
+    push("\n", 1);
+    stats.lines++;
+    return;
+  }
+  if (level > maxLevel) {
+    stats.filtered++;
+    return;
+  }
+  size_t need = len + 1;
+  size_t limit = level == L_DEBUG ? RING_SIZE - DEBUG_RESERVE : RING_SIZE;
+  if (used + need > limit) {
+    stats.dropped++;
+    return;
+  }
+  stats.lines++;
+  for (size_t i = 0; i < len; i++) {
+    ring[head] = line[i];
+    head = (head + 1) % RING_SIZE;
+  }
+  ring[head] = '\n';
+  head = (head + 1) % RING_SIZE;
+  used += need;
+}
+
+void ConsoleSink::drain() {
+  while (used > 0) {
+    int room = out.availableForWrite();
+    if (room <= 0) return;
+    size_t tail = (head + RING_SIZE - used) % RING_SIZE;
+    size_t chunk = RING_SIZE - tail;
+    if (chunk > used) chunk = used;
+    if (chunk > (size_t)room) chunk = room;
+    size_t written = out.write((const uint8_t*)ring + tail, chunk);
+    if (written == 0) return;
+    used -= written;
+  }
+}
+
+void ConsoleSink::flushAll() {
+  while (used > 0) {
+    size_t tail = (head + RING_SIZE - used) % RING_SIZE;
+    size_t chunk = RING_SIZE - tail;
+    if (chunk > used) chunk = used;
+    size_t written = out.write((const uint8_t*)ring + tail, chunk);
+    if (written == 0) return;
+    used -= written;
+  }
+}
+
+const char* ConsoleSink::levelName(Level l) {
+  switch (l) {
+    case L_ERROR: return "error";
+    case L_WARN: return "warn";
+    case L_INFO: return "info";
+    default: return "debug";
+  }
+}
+
+bool ConsoleSink::parseLevel(const String& name, Level& l) {
+  for (int i = L_ERROR; i <= L_DEBUG; i++) {
+    if (name == levelName((Level)i)) {
+      l = (Level)i;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,71 @@
+// Console.h
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <Arduino.h>
+
+// Весь вывод в консоль идёт через кольцевой буфер и уходит в Serial в drain()
+// ровно столько, сколько помещается в FIFO UART, поэтому болтливый журнал
+// не останавливает цикл управления. Строки попадают в кольцо целиком или не
+// попадают вовсе (dropped). Отладочным строкам недоступен резерв под ошибки.
+// Строка длиннее MAX_LINE (JSON команд D_STATS, TS и т.п.) не обрезается:
+// она уходит в кольцо частями, а если места нет - кольцо сначала дописывается
+// в Serial с ожиданием (waits), поэтому такие ответы целы, но могут задержать тик.
+class ConsoleSink : public Print {
+public:
+  enum Level : uint8_t { L_ERROR, L_WARN, L_INFO, L_DEBUG };
+
+  static const size_t RING_SIZE = 4096;
+  static const size_t MAX_LINE = 256;
+  static const size_t DEBUG_RESERVE = RING_SIZE / 4;
+
+  struct Counters {
+    uint32_t lines;
+    uint32_t dropped;
+    uint32_t waits;      // длинные строки, ждавшие места в кольце
+    uint32_t filtered;
+  };
+
+  explicit ConsoleSink(Print& out) : out(out) {}
+
+  // Уровень следующей строки, после '\n' снова L_INFO
+  ConsoleSink& at(Level l) {
+    lineLevel = l;
+    return *this;
+  }
+  void setLevel(Level l) { maxLevel = l; }
+  Level getLevel() const { return maxLevel; }
+  const Counters& counters() const { return stats; }
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* data, size_t n) override;
+
+  // Отдать в Serial то, что влезет без ожидания
+  void drain();
+  // Дописать всё; только там, где ждать допустимо (перед перезагрузкой)
+  void flushAll();
+  size_t pending() const { return used; }
+
+  static const char* levelName(Level l);
+  static bool parseLevel(const String& name, Level& l);
+
+private:
+  Print& out;
+  char ring[RING_SIZE];
+  size_t head = 0;   // куда писать
+  size_t used = 0;
+  char line[MAX_LINE];
+  size_t lineLen = 0;
+  bool lineSpilled = false;   // начало строки уже в кольце
+  Level lineLevel = L_INFO;
+  Level maxLevel = L_DEBUG;
+  Counters stats = {0, 0, 0, 0};
+
+  void commit();
+  void spill();
+  void push(const char* data, size_t len);
+};
+
+extern ConsoleSink Console;
+
+#endif
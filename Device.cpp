@@ -1,9 +1,20 @@
 // Device.cpp
 #include "Device.h"
-#include "Motor.h"
+#include "DeviceTable.h"
+#include "EventBus.h"
+#include "Reservations.h"
+#include "Trace.h"
+#include "Console.h"
+#include "LogArena.h"
+#include "PinTrace.h"
+#include "Snapshot.h"
+#include <Preferences.h>
+
+extern Preferences prefs;
 
 String Device::usedNames[10];
 int Device::usedNamesCount = 0;
+bool Device::scratch = false;
 int Device::usedPins[20] = {0};
 int Device::usedPinsCount = 0;
 time_t Device::ntpSeconds = 0;
@@ -15,11 +26,13 @@ String deviceTypeToString(DeviceType type) {
     case DeviceType::TANK: return "TANK";
     case DeviceType::VALVE: return "VALVE";
     case DeviceType::OTHER: return "OTHER";
+    case DeviceType::REMOTE: return "REMOTE";
     default: return "UNKNOWN";
   }
 }
 
 void Device::updateNtpTime(time_t seconds) {
+  Trace::ntp(seconds);
   ntpSeconds = seconds;
   ntpMillis = millis();
 }
@@ -33,16 +46,37 @@ uint64_t Device::getCurrentUtcMillis() {
 }
 
 Device::Device(String deviceName, int mainPin, int btnPin, bool activeHigh)
-  : pin(mainPin), buttonPin(btnPin), byButton(false), isActive(false),
-    timeOn(0), timeOff(0), lastDebounceTime(0), lastButtonState(false),
-    autoTimeOff(0), activeHigh(activeHigh) {
+  : slot(DeviceTable::add(this)),
+    pin(DeviceTable::pin[slot]), buttonPin(DeviceTable::buttonPin[slot]),
+    byButton(DeviceTable::byButton[slot]), isActive(DeviceTable::active[slot]),
+    timeOn(DeviceTable::timeOn[slot]), timeOff(DeviceTable::timeOff[slot]),
+    lastDebounceTime(DeviceTable::lastDebounceTime[slot]),
+    lastButtonState(DeviceTable::lastButtonState[slot]),
+    autoTimeOff(DeviceTable::autoTimeOff[slot]), duration_ms(DeviceTable::durationMs[slot]),
+    activeHigh(DeviceTable::activeHigh[slot]),
+    statsDirty(DeviceTable::statsDirty[slot]), lastStatsSave(DeviceTable::lastStatsSave[slot]) {
+  pin = mainPin;
+  buttonPin = btnPin;
+  this->activeHigh = activeHigh;
 
   if (deviceName.length() > 32)
     deviceName = deviceName.substring(0, 32);
 
   name = deviceName;
 
-  if (!isPinAvailable(mainPin)) {
+  if (slot == DeviceTable::SIZE)
+    log("Error", "Device table full, device will not be updated");
+
+  if (scratch) {
+    pin = -1;
+    buttonPin = -1;
+    return;
+  }
+
+  // Баки и удалённые устройства без выхода: -1 - не ошибка
+  if (mainPin < 0) {
+    pin = -1;
+  } else if (!isPinAvailable(mainPin)) {
     log("Error", "Main pin already used or invalid: " + String(mainPin));
     pin = -1;
   } else {
@@ -71,6 +105,24 @@ Device::Device(String deviceName, int mainPin, int btnPin, bool activeHigh)
     }
   }
   usedNames[usedNamesCount++] = name;
+  nameRegistered = true;
+}
+
+Device::~Device() {
+  flushLogs();
+  LogArena::discard(slot);
+  Reservations::cancel(slot);
+  // Освобождаем пины и имя, чтобы их мог занять новый конфиг
+  if (pin >= 0) releasePin(pin);
+  if (buttonPin >= 0) releasePin(buttonPin);
+  for (int i = 0; i < usedNamesCount && nameRegistered; i++) {
+    if (usedNames[i] == name) {
+      usedNames[i] = usedNames[--usedNamesCount];
+      usedNames[usedNamesCount] = "";
+      break;
+    }
+  }
+  DeviceTable::release(slot);
 }
 
 bool Device::isPinAvailable(int testPin) const {
@@ -85,6 +137,15 @@ void Device::registerPin(int validPin) {
     usedPins[usedPinsCount++] = validPin;
 }
 
+void Device::releasePin(int usedPin) {
+  for (int i = 0; i < usedPinsCount; i++) {
+    if (usedPins[i] == usedPin) {
+      usedPins[i] = usedPins[--usedPinsCount];
+      return;
+    }
+  }
+}
+
 String Device::formatTime(uint64_t ms) const {
   if (ms == 0) return "";
   time_t seconds = ms / 1000;
@@ -100,7 +161,13 @@ void Device::log(const char* action, const String& details) const {
   char msg[128];
   snprintf(msg, sizeof(msg), "[%s] %s%s%s", name.c_str(), action,
            details.length() ? ": " : "", details.c_str());
-  Serial.println(msg);
+  bool error = strcmp(action, "Error") == 0;
+  Console.at(error ? ConsoleSink::L_ERROR
+                   : strcmp(action, "Warning") == 0 ? ConsoleSink::L_WARN : ConsoleSink::L_INFO).println(msg);
+  if (error) {
+    stats.recordError(getCurrentUtcMillis(), details.c_str());
+    statsDirty = true;
+  }
 }
 
 bool Device::validateMilliseconds(const String& param, unsigned long& milliseconds) const {
@@ -123,6 +190,7 @@ void Device::begin() {
   if (buttonPin != -1)
     pinMode(buttonPin, INPUT_PULLUP);
   timeOn = getCurrentUtcMillis();
+  loadStats();
   StaticJsonDocument<64> extra;
   //log("begin", name);
   
@@ -131,75 +199,122 @@ void Device::begin() {
   off();
 }
 
-void Device::on(unsigned long duration) {
-  if (pin > 0){
-    digitalWrite(pin, activeHigh ? HIGH : LOW);
-  } 
+bool Device::on(unsigned long duration) {
+  writePin(true);
   duration_ms = duration;
   isActive = true;
   timeOn = getCurrentUtcMillis();
   autoTimeOff = duration > 0 ? timeOn + duration : 0;
+  EventBus::publish(slot, CHANGE_STATE);
   StaticJsonDocument<64> extra;
   if (autoTimeOff > 0)
     extra["autoTimeOff"] = autoTimeOff;
   extra["ms"] = duration;
-  Motor* motor = static_cast<Motor*>(this);
-  float mspml = motor->getMillisecondsPerMl();
+  float mspml = DeviceTable::msPerMl[slot];
   if (mspml>0) {
     extra["ml"] =  static_cast<int>(duration/mspml);
   }
-  fileLog("debug", "On", extra.as<JsonObject>(), true); 
+  fileLog("state", "On", extra.as<JsonObject>(), true); 
+  return true;
 }
 
 void Device::off() {
-  if (pin > 0) {
-    digitalWrite(pin, activeHigh ? LOW : HIGH);
-  }
+  stop(-1);
+}
+
+void Device::stop(float ml) {
+  writePin(false);
   
   unsigned long duration = getActiveDuration();
+  bool wasActive = isActive;
   isActive = false;
   timeOff = getCurrentUtcMillis();
+  EventBus::publish(slot, CHANGE_STATE);
   StaticJsonDocument<64> extra;
   if(duration > 0){
     extra["ms"] = duration;
-    Motor* motor = static_cast<Motor*>(this);
-    float mspml = motor->getMillisecondsPerMl();
+    float mspml = DeviceTable::msPerMl[slot];
+    if (ml < 0) ml = mspml > 0 ? duration / mspml : 0;
     if (mspml>0) {
-        extra["ml"] =  static_cast<int>(duration/mspml);
+        extra["ml"] =  static_cast<int>(ml);
     }
   }
-  fileLog("debug", "Off", extra.as<JsonObject>(), true);
+  if (ml < 0) ml = 0;
+  if (wasActive) {
+    stats.recordRun(timeOff, duration, ml);
+    statsDirty = true;
+    saveStats();
+  }
+  fileLog("state", "Off", extra.as<JsonObject>(), true);
+}
+
+void Device::deferOp(bool turnOn, unsigned long duration) {
+  Reservations::Deferred d = Reservations::defer(slot, turnOn, duration);
+  if (d == Reservations::D_QUEUED) log("Busy", "queued");
+  else if (d == Reservations::D_FULL) log("Error", "Busy, queue is full");
+}
+
+void Device::writePin(bool on) {
+  if (pin <= 0) return;
+  bool level = on == activeHigh;
+  digitalWrite(pin, level ? HIGH : LOW);
+  PinTrace::edge(pin, level, slot);
 }
 
 void Device::checkButton() {
-  if (buttonPin == -1) return;
-  bool currentButtonState = digitalRead(buttonPin) == LOW;
-  if (currentButtonState != lastButtonState)
-    lastDebounceTime = millis();
-  if ((millis() - lastDebounceTime) > DEBOUNCE_DELAY) {
-    if (currentButtonState && !isActive) {
-      byButton = true;
-      on();
-    } else if (!currentButtonState && isActive && byButton) {
-      byButton = false;
-      off();
-    }
-  }
-  lastButtonState = currentButtonState;
+  DeviceTable::checkButton(slot, millis());
 }
 
 void Device::update() {
-  checkButton();
-  if (!isActive || autoTimeOff == 0) return;
-  uint64_t now = getCurrentUtcMillis();
-  if (now >= autoTimeOff) {
-    off();
-    //log("Auto-off triggered");
+  DeviceTable::updateSlot(slot, getCurrentUtcMillis(), millis());
+}
+
+String Device::prefsKey(const char* prefix, const String& name) {
+  char key[16];
+  snprintf(key, sizeof(key), "%.3s_%08x", prefix, (unsigned)Snapshot::hash(name.c_str()));
+  return String(key);
+}
+
+
+void Device::loadStats() {
+  DeviceStats saved;
+  String key = prefsKey("st", name);
+  if (prefs.getBytesLength(key.c_str()) != sizeof(saved)) return;
+  prefs.getBytes(key.c_str(), &saved, sizeof(saved));
+  if (saved.version != DeviceStats::VERSION) return;
+  // Ошибки, случившиеся до begin() (например, в конструкторе), не теряем
+  if (stats.lastErrorTime) {
+    saved.lastErrorTime = stats.lastErrorTime;
+    memcpy(saved.lastError, stats.lastError, sizeof(saved.lastError));
   }
+  stats = saved;
+  lastStatsSave = getCurrentUtcMillis();
+}
+
+void Device::saveStats() const {
+  if (!statsDirty) return;
+  uint64_t now = getCurrentUtcMillis();
+  if (lastStatsSave != 0 && now - lastStatsSave < STATS_SAVE_INTERVAL_MS) return;
+  prefs.putBytes(prefsKey("st", name).c_str(), &stats, sizeof(stats));
+  statsDirty = false;
+  lastStatsSave = now;
+}
+
+void Device::removeStats() const {
+  prefs.remove(prefsKey("st", name).c_str());
+}
+
+void Device::statsJson(JsonObject& out) const {
+  out["n"] = name;
+  out["t"] = deviceTypeToString(getDeviceType());
+  stats.toJson(out, getCurrentUtcMillis());
 }
 
 bool Device::isDeviceActive() const { return isActive; }
-void Device::setDeviceActive(bool active) { isActive = active; }
+void Device::setDeviceActive(bool active) {
+  if (isActive != active) EventBus::publish(slot, CHANGE_STATE);
+  isActive = active;
+}
 int Device::getPin() const { return pin; }
 int Device::getButtonPin() const { return buttonPin; }
 String Device::getName() const { return name; }
@@ -232,6 +347,7 @@ void Device::setContext(JsonObject& context) const {
 void Device::setPin(int p){
     if (isActive) return;
     pin = p;
+    EventBus::touch();
     //registerPin(pin);
 }
 
@@ -239,6 +355,7 @@ void Device::setButtonPin(int bp){
     if (isActive) return;
 
     buttonPin = bp;
+    EventBus::touch();
     //registerPin(buttonPin);
 }
 void Device::fileLog(const String& type, const String& message, JsonObject extra, bool write) const{
@@ -256,96 +373,146 @@ void Device::fileLog(const String& type, const String& message, JsonObject extra
   }
   String newLine;
   serializeJson(doc, newLine);
-  Serial.println(newLine);
+  Console.at(type == "debug" ? ConsoleSink::L_DEBUG : ConsoleSink::L_INFO).println(newLine);
   if (!write) return;
-  logBuffer.push_back(newLine);
-  
-  DynamicJsonDocument status(512);
-  status["name"] = getName();
-  status["type"] = deviceTypeToString(getDeviceType());
-  status["pin"] = getPin();
-  status["buttonPin"] = getButtonPin();
-  status["active"] = isDeviceActive();
-
-  JsonObject context_status = status.createNestedObject("context");
-  setContext(context_status);  // 👈 пусть device сам формирует context
-  
-  JsonArray logs = status.createNestedArray("logs");
-  //std::vector<String> lastLogs = getLastLogs(10);
-  //for (const String& line : lastLogs) {
-  //  DynamicJsonDocument logDoc(256);
-  //  DeserializationError err = deserializeJson(logDoc, line);
-  //  if (!err) {
-  //    //logDoc["time_str"] = device->formatTime(logDoc["time"]);
-  //    logs.add(logDoc.as<JsonObject>());
-  //  }
-  //}
-
-  
-  //doc["status"] = status;
-  String socketStr;
-  //serializeJson(doc, socketStr);
-  serializeJson(status, socketStr);
-  //webSocket.sendTXT(clientNum, socketStr);
-  uint64_t now = getCurrentUtcMillis();
-  if (now - lastWriteTime >= SAVE_INTERVAL_MS) {
-    flushLogs();
-  }
+  // Состояние клиентам теперь уходит через EventBus, здесь только журнал.
+  // На флеш строку унесёт LogArena::update по заполнению или возрасту
+  LogArena::append(slot, LogArena::kindOf(type), newLine.c_str(), newLine.length());
+}
+String Device::logPath(int segment) const {
+  return "/" + name + (segment ? "." + String(segment) : String("")) + ".dlg";
 }
-std::vector<String> Device::getLastLogs(int count) const {
-  std::vector<String> allLines;
-  String path = "/" + name + ".log";
 
+void Device::loadLogSegment() const {
+  logEncoder.state.reset();
+  logEncoder.bytes = 0;
+  logEncoder.loaded = true;
+
+  String path = logPath(0);
+  bool intact = true;
   if (LittleFS.exists(path)) {
     File file = LittleFS.open(path, FILE_READ);
-    while (file && file.available()) {
-      allLines.push_back(file.readStringUntil('\n'));
+    intact = false;
+    if (file && LogCodec::readHeader(file)) {
+      LogDecoder decoder;
+      StaticJsonDocument<512> doc;
+      while (decoder.next(file, doc)) {}
+      if (file.position() == file.size()) {
+        logEncoder.state = decoder.state;
+        logEncoder.bytes = file.size();
+        intact = true;
+      }
     }
     file.close();
   }
+  // Хвост повреждён (например, питание пропало во время записи):
+  // читаемую часть оставляем в архиве, новый сегмент начинаем с нуля
+  if (!intact) rotateLogs();
+  migrateLegacyLog();
+}
 
-  // Добавим буфер
-  allLines.insert(allLines.end(), logBuffer.begin(), logBuffer.end());
-
-  // Вернём последние `count` строк в обратном порядке
-  std::vector<String> result;
-  int start = allLines.size() > count ? allLines.size() - count : 0;
-  for (int i = allLines.size() - 1; i >= start; --i) {
-    result.push_back(allLines[i]);
+// Старый текстовый журнал переносим построчно в новый формат
+void Device::migrateLegacyLog() const {
+  String legacyPath = "/" + name + ".log";
+  if (!LittleFS.exists(legacyPath)) return;
+  File legacy = LittleFS.open(legacyPath, FILE_READ);
+  File file = openSegment();
+  StaticJsonDocument<512> doc;
+  while (legacy && file && legacy.available()) {
+    String line = legacy.readStringUntil('\n');
+    line.trim();
+    if (line.length()) appendRecord(file, doc, line.c_str(), line.length());
   }
+  file.close();
+  legacy.close();
+  LittleFS.remove(legacyPath);
+}
 
-  return result;
+void Device::rotateLogs() const {
+  String last = logPath(LOG_SEGMENTS - 1);
+  if (LittleFS.exists(last)) LittleFS.remove(last);
+  for (int i = LOG_SEGMENTS - 2; i >= 0; --i) {
+    String from = logPath(i);
+    if (LittleFS.exists(from)) LittleFS.rename(from, logPath(i + 1));
+  }
+  logEncoder.state.reset();
+  logEncoder.bytes = 0;
 }
-void Device::flushLogs() const {
-  if (logBuffer.empty()) return;
 
-  String path = "/" + name + ".log";
-  std::vector<String> lines;
+std::vector<String> Device::getLastLogs(int count) const {
+  std::vector<String> result;
+  if (count <= 0) return result;
+  if (!logEncoder.loaded) loadLogSegment();
+
+  // Кольцо из последних `count` строк, сегменты читаем потоково от старых к новым
+  std::vector<String> ring;
+  ring.reserve(count);
+  size_t total = 0;
+  auto push = [&](const String& line) {
+    if (ring.size() < (size_t)count) ring.push_back(line);
+    else ring[total % count] = line;
+    total++;
+  };
 
-  // Читаем существующие строки
-  if (LittleFS.exists(path)) {
+  StaticJsonDocument<512> doc;
+  for (int i = LOG_SEGMENTS - 1; i >= 0; --i) {
+    String path = logPath(i);
+    if (!LittleFS.exists(path)) continue;
     File file = LittleFS.open(path, FILE_READ);
-    while (file && file.available()) {
-      lines.push_back(file.readStringUntil('\n'));
+    if (file && LogCodec::readHeader(file)) {
+      LogDecoder decoder;
+      while (decoder.next(file, doc)) {
+        String line;
+        serializeJson(doc, line);
+        push(line);
+      }
     }
     file.close();
   }
 
-  // Добавляем из буфера
-  lines.insert(lines.end(), logBuffer.begin(), logBuffer.end());
-
-  // Обрезаем если больше 100
-  while (lines.size() > 100) lines.erase(lines.begin());
+  // Добавим ещё не сброшенное
+  LogArena::each(slot, [&](const char* line, size_t len) {
+    String pending;
+    pending.concat(line, len);
+    push(pending);
+  });
 
-  // Записываем
+  // Вернём последние `count` строк в обратном порядке
+  for (size_t i = 0; i < ring.size(); i++) {
+    result.push_back(ring[(total - 1 - i) % count]);
+  }
+  return result;
+}
+File Device::openSegment() const {
+  String path = logPath(0);
+  if (logEncoder.bytes > 0) return LittleFS.open(path, FILE_APPEND);
   File file = LittleFS.open(path, FILE_WRITE);
-  for (const String& line : lines) {
-    file.println(line);
+  if (file) logEncoder.begin(file);
+  return file;
+}
+
+void Device::appendRecord(File& file, JsonDocument& doc, const char* line, size_t len) const {
+  if (deserializeJson(doc, line, len)) return;
+  JsonObject record = doc.as<JsonObject>();
+  // Сегмент заполнен или закончился словарь - начинаем следующий
+  if (logEncoder.bytes >= LOG_SEGMENT_BYTES || !logEncoder.append(file, record)) {
+    file.close();
+    rotateLogs();
+    file = openSegment();
+    logEncoder.append(file, record);
   }
+}
+
+void Device::flushLogs() const {
+  if (!logEncoder.loaded) loadLogSegment();
+  if (!LogArena::pending(slot)) return;
+
+  File file = openSegment();
+  if (!file) return; // останется в LogArena до следующего сброса
+  StaticJsonDocument<512> doc;
+  LogArena::take(slot, [&](const char* line, size_t len) { appendRecord(file, doc, line, len); });
   file.close();
 
-  logBuffer.clear();
-  lastWriteTime = getCurrentUtcMillis();
   StaticJsonDocument<1> dummyDoc;
   fileLog("debug", "log updated", dummyDoc.to<JsonObject>(), false); 
 }
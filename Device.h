@@ -8,31 +8,40 @@
 #include <time.h>
 #include <vector>
 #include <WebSocketsServer.h>
+#include <LogCodec.h>
+#include <DeviceStats.h>
+#include <DeviceTable.h>
 
 extern WebSocketsServer webSocket;
 
-enum class DeviceType { MOTOR, TANK, VALVE, OTHER };
+enum class DeviceType { MOTOR, TANK, VALVE, OTHER, REMOTE };
 
 String deviceTypeToString(DeviceType type);
 
 class Device {
+  friend class DeviceTable;
+  friend class Bench;
+  friend class LogArena;
 protected:
   String name;
-  int pin;
-  int buttonPin;
-  bool byButton;
-  bool isActive;
-  uint64_t timeOn;
-  uint64_t timeOff;
-  unsigned long lastDebounceTime;
-  bool lastButtonState;
-  uint64_t autoTimeOff;
-  uint64_t duration_ms;
-  bool activeHigh;
+  bool nameRegistered = false;
+  int slot; // строка в DeviceTable
+  // Состояние хранится в DeviceTable, здесь ссылки на свою строку
+  int& pin;
+  int& buttonPin;
+  bool& byButton;
+  bool& isActive;
+  uint64_t& timeOn;
+  uint64_t& timeOff;
+  unsigned long& lastDebounceTime;
+  bool& lastButtonState;
+  uint64_t& autoTimeOff;
+  uint64_t& duration_ms;
+  bool& activeHigh;
 
-  static const unsigned long DEBOUNCE_DELAY = 50;
   static String usedNames[10];
   static int usedNamesCount;
+  static bool scratch; // создаются временные устройства Bench: без пинов и реестра имён
   static int usedPins[20];
   static int usedPinsCount;
   static time_t ntpSeconds;
@@ -40,26 +49,53 @@ protected:
 
 
   void log(const char* action, const String& details = "") const;
+  // Все переключения выхода - здесь, с записью фронта в PinTrace
+  virtual void writePin(bool on);
+  // off() с уже посчитанным объёмом; ml < 0 - по длительности и msPerMl
+  void stop(float ml);
+  // Reservations::defer с записью в журнал только при первой постановке
+  void deferOp(bool turnOn, unsigned long duration);
   bool validateMilliseconds(const String& param, unsigned long& milliseconds) const;
   bool isPinAvailable(int testPin) const;
   void registerPin(int validPin);
+  static void releasePin(int usedPin);
 
-  mutable std::vector<String> logBuffer;
-  mutable uint64_t lastWriteTime = 0;
+  // Несброшенные строки журнала лежат в общем LogArena
+  mutable LogEncoder logEncoder;
   static const unsigned long SAVE_INTERVAL_MS = 2 * 60 * 60 * 1000; // 2 часа
+  static const int LOG_SEGMENTS = 4;                 // /<name>.dlg, /<name>.1.dlg, ...
+  static const size_t LOG_SEGMENT_BYTES = 3 * 1024;  // 12 КБ на устройство в сумме
   void flushLogs() const;
+  String logPath(int segment) const;
+  void loadLogSegment() const;
+  void migrateLegacyLog() const;
+  void rotateLogs() const;
+  File openSegment() const;
+  void appendRecord(File& file, JsonDocument& doc, const char* line, size_t len) const;
+
+  mutable DeviceStats stats;
+  bool& statsDirty;
+  uint64_t& lastStatsSave;
+  static const unsigned long STATS_SAVE_INTERVAL_MS = 10 * 60 * 1000; // 10 минут
+  void loadStats();
+  void saveStats() const;
+  void removeStats() const;
+  // Ключ Preferences для устройства: NVS ограничен 15 символами, вместо имени - его хеш
+  static String prefsKey(const char* prefix, const String& name);
 public:
   String formatTime(uint64_t ms) const;
   static void updateNtpTime(time_t seconds);
   static uint64_t getCurrentUtcMillis();
+  static bool hasWallClock() { return ntpSeconds != 0; }
   static uint8_t clientNum;
   Device(String deviceName, int mainPin, int btnPin = -1, bool activeHigh = true);
-  virtual ~Device() {}
+  virtual ~Device();
 
   virtual DeviceType getDeviceType() const = 0;
 
   virtual void begin();
-  virtual void on(unsigned long duration = 0);
+  // false - включение отклонено (отложенное в Reservations считается принятым)
+  virtual bool on(unsigned long duration = 0);
   virtual void off();
   virtual void update();
 
@@ -67,12 +103,14 @@ public:
 
   bool isDeviceActive() const;
   void setDeviceActive(bool active);
+  int getSlot() const { return slot; }
   int getPin() const;
   void setPin(int pin);
   int getButtonPin() const;
   void setButtonPin(int buttonPin);
   String getName() const;
   String getTimeOn() const;
+  uint64_t getTimeOnMs() const { return timeOn; }
   String getTimeOff() const;
   String getAutoTimeOff() const;
   virtual void setContext(JsonObject& context) const;
@@ -81,6 +119,8 @@ public:
   virtual String getStatus() const;
   virtual void fileLog(const String& type, const String& message, JsonObject extra, bool skipWrite) const;
   std::vector<String> getLastLogs(int count) const;
+  const DeviceStats& getStats() const { return stats; }
+  void statsJson(JsonObject& out) const;
   virtual bool handleCommand(const String& cmd, const String& param) = 0;
 };
 
@@ -2,18 +2,67 @@
 #define DEVICE_MANAGER_H
 
 #include <Device.h>
+#include <JsonStreamWriter.h>
+#include <ClientQueues.h>
+#include <EventBus.h>
+#include <Scheduler.h>
+#include <Reservations.h>
+#include <DispenseQueue.h>
+#include <RouteTable.h>
+#include <Snapshot.h>
+#include <StaticPlant.h>
+#include <RemoteDevice.h>
+#include <TimeSeries.h>
+#include <Bench.h>
+#include <AllocStats.h>
+#include <Trace.h>
+#include <LineAssembler.h>
+#include <Console.h>
+#include <LogArena.h>
+#include <PinTrace.h>
 
 #include <map>
+#include <algorithm>
 #include <WebSocketsServer.h>
 
 extern WebSocketsServer webSocket;
 
-class DeviceManager {
+class DeviceManager : public EventSubscriber {
 private:
   Device** devices;
   int numDevices;
   std::map<String, Device*> deviceMap;
   std::vector<Device*> devicesList;
+  JsonOutBuffer socketBuffer;
+  // Исходящие очереди клиентов; socketBuffer - последний собранный кадр дельт
+  ClientQueues clientQueues;
+  uint8_t deltaMask[DeviceTable::SIZE] = {0};
+  bool deltaValid = false;
+  // Полный список для новых клиентов: пересобирается, только если сменилась версия
+  // состояния, а пока что-то работает - не чаще раза в LIVE_FIELDS_MS (ams, cl и т.п.)
+  JsonOutBuffer fullBuffer;
+  uint32_t fullVersion = 0;
+  bool fullValid = false;
+  unsigned long fullBuiltMs = 0;
+  static const unsigned long LIVE_FIELDS_MS = 200;
+  static const unsigned long BENCH_CLEAR_MS = 60 * 1000; // без запусков по расписанию на это время
+  Scheduler scheduler;
+  DispenseQueue dispenseQueue;
+  TimeSeries timeSeries;
+  RouteTable routes;
+  std::map<String, String> deviceConfigs; // имя -> JSON из конфига, для сравнения в applyConfig
+  const char* bootConfig;
+  const StaticTopology* topology;   // установка из кода (StaticPlant) вместо JSON
+  uint32_t configHash = 0;
+  bool snapshotDirty = false;
+  unsigned long lastSnapshot = 0;
+  std::vector<Snapshot::Run> pendingRuns; // прерванные запуски ждут часов NTP
+  TracePlayer tracePlayer;
+  LineAssembler serialLine;
+  String commandLine;          // ёмкость резервируется один раз в конструкторе
+  static const int MAX_LINES_PER_TICK = 4;
+  int64_t traceClockShift = 0; // сдвиг записанных NTP к текущему времени
+  const char* snapshotPath = "/state.bin";
 
   bool parseCommand(String& command, String& cmd, String& deviceName, String& param) {
     const char* ERR_NO_DEVICE_NAME = "Error: Command must contain device name";
@@ -21,9 +70,9 @@ private:
     char buf[65];
     strncpy(buf, command.c_str(), sizeof(buf) - 1);
     buf[sizeof(buf) - 1] = '\0';
-    char cmdBuf[16], nameBuf[32], paramBuf[32];
+    char cmdBuf[16], nameBuf[32], paramBuf[32] = "";
     if (sscanf(buf, "%15s %31s %31s", cmdBuf, nameBuf, paramBuf) < 2) {
-      Serial.println(ERR_NO_DEVICE_NAME);
+      Console.at(ConsoleSink::L_ERROR).println(ERR_NO_DEVICE_NAME);
       return false;
     }
     cmd = cmdBuf;
@@ -32,183 +81,457 @@ private:
     return true;
   }
 
-  void loadConfig(const char* jsonConfig){
-    DynamicJsonDocument doc(4096);
-    DeserializationError err = deserializeJson(doc, jsonConfig);
-    if (err) {
-      Serial.println("Error parsing config: " + String(err.c_str()));
-      return;
-    }
-    for (JsonObject obj : doc.as<JsonArray>()) {
+  Tank* findTank(const String& name) const {
+    for (Device* d : devicesList)
+      if (d->getDeviceType() == DeviceType::TANK && d->getName() == name) return static_cast<Tank*>(d);
+    return nullptr;
+  }
+  Valve* findValve(const String& name) const {
+    for (Device* d : devicesList)
+      if (d->getDeviceType() == DeviceType::VALVE && d->getName() == name) return static_cast<Valve*>(d);
+    return nullptr;
+  }
+
+  // Ссылки разрешаются по уже созданным устройствам, поэтому баки идут раньше клапанов и моторов
+  Device* createDevice(JsonObject obj) {
     String type = obj["type"];
     String name = obj["name"];
-
     if (type == "TANK") {
       int capacity = obj["capacity"] | 0;
       float level = obj["currentLevel"] | 0;
       Tank* tank = new Tank(name, capacity);
       tank->setCurrentLevel(level);
-      devicesList.push_back(tank);
+      return tank;
     } else if (type == "VALVE") {
       int pin = obj["pin"];
-      int btnPin = obj["btnPin"] | -1;
-      String out1Name = obj["out1"] | "";
-      String out2Name = obj["out2"] | "";
-      Tank* out1 = nullptr;
-      Tank* out2 = nullptr;
-      for (Device* d : devicesList) {
-        if (d->getDeviceType() == DeviceType::TANK) {
-          if (d->getName() == out1Name) out1 = static_cast<Tank*>(d);
-          if (d->getName() == out2Name) out2 = static_cast<Tank*>(d);
-        }
-      }
-      Valve* valve = new Valve(name, pin, out1, out2);
-      devicesList.push_back(valve);
+      return new Valve(name, pin, findTank(obj["out1"] | ""), findTank(obj["out2"] | ""));
     } else if (type == "MOTOR") {
       int pin = obj["pin"];
       float msPerMl = obj["millisecondsPerMl"];
       int btnPin = obj["btnPin"] | -1;
-      String inTankName = obj["inTank"] | "";
-      String outTankName = obj["outTank"] | "";
-      Tank* inTank = nullptr;
-      Tank* outTank = nullptr;
-      for (Device* d : devicesList) {
-        if (d->getDeviceType() == DeviceType::TANK) {
-          if (d->getName() == inTankName) inTank = static_cast<Tank*>(d);
-          if (d->getName() == outTankName) outTank = static_cast<Tank*>(d);
-        }
-      }
-
+      return new Motor(name, pin, msPerMl, btnPin, findTank(obj["inTank"] | ""), findTank(obj["outTank"] | ""),
+                       findValve(obj["inValve"] | ""), findValve(obj["outValve"] | ""));
+    } else if (type == "REMOTE") {
+      // {"type":"REMOTE","name":"pump2","host":"192.168.1.20","remote":"pump1"}
+      return new RemoteDevice(name, obj["host"] | "", obj["remote"] | "", obj["port"] | (int)RemoteLink::PORT);
+    }
+    return nullptr;
+  }
 
-      String inValveName = obj["inValve"] | "";
-      String outValveName = obj["outValve"] | "";
-      Valve* inValve = nullptr;
-      Valve* outValve = nullptr;
-      for (Device* d : devicesList) {
-        if (d->getDeviceType() == DeviceType::VALVE) {
-          if (d->getName() == inValveName) inValve = static_cast<Valve*>(d);
-          if (d->getName() == outValveName) outValve = static_cast<Valve*>(d);
-        }
+  void loadConfig(const char* jsonConfig){
+    DynamicJsonDocument doc(4096);
+    DeserializationError err = deserializeJson(doc, jsonConfig);
+    if (err) {
+      Console.at(ConsoleSink::L_ERROR).println("Error parsing config: " + String(err.c_str()));
+      return;
+    }
+    for (JsonObject obj : doc.as<JsonArray>()) {
+      String name = obj["name"];
+      if (DeviceTable::full()) {
+        Console.at(ConsoleSink::L_ERROR).println("Error: Too many devices, skipping " + name);
+        break;
       }
-      Motor* motor = new Motor(name, pin, msPerMl, btnPin, inTank, outTank, inValve, outValve);
-      devicesList.push_back(motor);
+      Device* device = createDevice(obj);
+      if (!device) continue;
+      devicesList.push_back(device);
+      serializeJson(obj, deviceConfigs[device->getName()]);
+    }
+    devices = devicesList.data();
+    numDevices = devicesList.size();
+  }
+
+  void rememberConfigs(const char* jsonConfig) {
+    DynamicJsonDocument doc(4096);
+    if (deserializeJson(doc, jsonConfig)) return;
+    for (JsonObject obj : doc.as<JsonArray>()) {
+      String name = obj["name"];
+      if (findByName(name)) serializeJson(obj, deviceConfigs[name]);
     }
   }
-  devices = devicesList.data();
-  numDevices = devicesList.size();
+
+  // Тип и пины меняются только пересозданием устройства, остальное - на месте
+  bool sameHardware(const String& name, JsonObject obj) {
+    StaticJsonDocument<512> prev;
+    if (deserializeJson(prev, deviceConfigs[name])) return false;
+    return String(prev["type"] | "") == String(obj["type"] | "") &&
+           (prev["pin"] | -1) == (obj["pin"] | -1) && (prev["btnPin"] | -1) == (obj["btnPin"] | -1) &&
+           String(prev["host"] | "") == String(obj["host"] | "") &&
+           String(prev["remote"] | "") == String(obj["remote"] | "") && (prev["port"] | 0) == (obj["port"] | 0);
   }
-public:
 
-  DeviceManager(const char* jsonConfig){
-    loadConfig(jsonConfig);
-    for (int i = 0; i < numDevices; i++) {
-      deviceMap[devices[i]->getName()] = devices[i];
+  static bool contains(const std::vector<Device*>& list, const Device* device) {
+    return device && std::find(list.begin(), list.end(), device) != list.end();
+  }
+
+  // Мотор качает через одно из изменяемых устройств
+  static bool touches(Motor* motor, const std::vector<Device*>& changed) {
+    if (contains(changed, motor) || contains(changed, motor->getInTank()) || contains(changed, motor->getOutTank())) return true;
+    Valve* valves[2] = {motor->getInValve(), motor->getOutValve()};
+    for (Valve* v : valves) {
+      if (v && (contains(changed, v) || contains(changed, v->getOut1()) || contains(changed, v->getOut2()))) return true;
     }
+    return false;
+  }
+public:
+
+  // Устройства создаются в init(), когда LittleFS уже смонтирована и можно взять снимок
+  DeviceManager(const char* jsonConfig) : devices(nullptr), numDevices(0), bootConfig(jsonConfig), topology(nullptr) {
+    commandLine.reserve(LineAssembler::MAX_LINE + 1);
+    EventBus::subscribe(this);
+  }
+  explicit DeviceManager(const StaticTopology& plant)
+      : devices(nullptr), numDevices(0), bootConfig(""), topology(&plant) {
+    commandLine.reserve(LineAssembler::MAX_LINE + 1);
+    EventBus::subscribe(this);
+  }
+  ~DeviceManager() {
+    EventBus::unsubscribe(this);
   }
   uint8_t clientNum = 0;
   void init() {
     printHelp();
+    std::vector<Snapshot::Run> runs;
+    bool restored;
+    if (topology) {
+      // Устройства уже описаны в коде; из снимка - только уровни и запуски
+      topology->create(devicesList);
+      devices = devicesList.data();
+      numDevices = devicesList.size();
+      configHash = topologyHash();
+      restored = Snapshot::restore(snapshotPath, configHash, devices, numDevices, runs);
+    } else {
+      configHash = Snapshot::hash(bootConfig);
+      restored = Snapshot::load(snapshotPath, configHash, devicesList, runs);
+      if (restored) {
+        devices = devicesList.data();
+        numDevices = devicesList.size();
+      } else {
+        loadConfig(bootConfig);
+      }
+      for (int i = 0; i < numDevices; i++) {
+        deviceMap[devices[i]->getName()] = devices[i];
+      }
+    }
     for (int i = 0; i < numDevices; i++) {
+      PinCause cause(PinTrace::C_BOOT, devices[i]->getSlot());
       devices[i]->begin();
     }
+    routes.build(devices, numDevices);
+    if (restored) pendingRuns.swap(runs);
+    resumeRuns();
+    scheduler.load();
+    timeSeries.begin();
+    RemoteLink::begin();
+    EventBus::touch();
+    snapshotDirty = true;
   }
-  StaticJsonDocument<4096> deviceJsonStatic(bool activeOnly) {
-    StaticJsonDocument<4096> doc;
-    JsonArray arr = doc.to<JsonArray>();
+
+  // Снимок установки из кода годится, пока не изменились имена, типы и пины
+  uint32_t topologyHash() const {
+    uint32_t h = Snapshot::hash("static");
     for (int i = 0; i < numDevices; i++) {
-      if(activeOnly && !devices[i]->isDeviceActive()) continue;
-      Device* device = devices[i];
-      JsonObject jsonDevice = arr.createNestedObject();
-      bool active = device->isDeviceActive();
-      jsonDevice["n"] = device->getName();
-      jsonDevice["t"] = deviceTypeToString(device->getDeviceType());
-      jsonDevice["a"] = active;
+      int8_t row[3] = {(int8_t)devices[i]->getDeviceType(), (int8_t)devices[i]->getPin(),
+                       (int8_t)devices[i]->getButtonPin()};
+      h = Snapshot::hash((const uint8_t*)devices[i]->getName().c_str(), devices[i]->getName().length(), h);
+      h = Snapshot::hash((const uint8_t*)row, sizeof(row), h);
+    }
+    return h;
+  }
+
+  // Время загрузки известно только по NTP: до него досчитать запуски нечем
+  void resumeRuns() {
+    if (pendingRuns.empty() || !Device::hasWallClock()) return;
+    Snapshot::resume(pendingRuns, Device::getCurrentUtcMillis() - millis());
+    pendingRuns.clear();
+    snapshotDirty = true;
+  }
+
+  // Снимок после перехода, не чаще MIN_INTERVAL_MS; работающий запуск не переписывается.
+  // Пока недосчитанные запуски ждут часов, старый снимок остаётся единственной записью о них
+  void saveSnapshot() {
+    unsigned long now = millis();
+    if (!snapshotDirty || !pendingRuns.empty()) return;
+    if (lastSnapshot && now - lastSnapshot < Snapshot::MIN_INTERVAL_MS) return;
+    AllocScope scope(AllocStats::S_FLUSH);
+    if (!Snapshot::save(snapshotPath, devices, numDevices, configHash)) {
+      Console.at(ConsoleSink::L_ERROR).println("Error: Cannot write snapshot");
+    }
+    snapshotDirty = false;
+    lastSnapshot = now;
+  }
+  void writeDeviceJson(JsonStreamWriter& w, Device* device, bool activeOnly) {
+    w.beginObject();
+    const int slot = device->getSlot();
+    const DeviceType type = DeviceTable::type[slot];
+    bool active = DeviceTable::active[slot];
+    w.field("n", device->getName());
+    w.field("t", deviceTypeToString(type));
+    w.field("a", active);
+    if(!activeOnly){
+      int pin = device->getPin();
+      int bp = device->getButtonPin();
+      if (pin >= 0) w.field("p", pin);
+      if (bp >= 0) w.field("bp", bp);
+    }
+    if (active) {
+      const auto duration = device->getDurationMs();
+      const auto activeDur = device->getActiveDuration();
+      w.field("dms", duration);
+      w.field("ams", activeDur);
+      w.field("lms", (duration > 0) ? (duration - activeDur) : 0);
+    }
+
+    if (type == DeviceType::MOTOR) {
+      Motor* motor = static_cast<Motor*>(device);
+      w.field("it", motor->getInTank() ? motor->getInTank()->getName() : "");
+      w.field("ot", motor->getOutTank() ? motor->getOutTank()->getName() : "");
       if(!activeOnly){
-        int pin = device->getPin();
-        int bp = device->getButtonPin();
-        if (pin >= 0) jsonDevice["p"] = pin;
-        if (bp >= 0) jsonDevice["bp"] = bp;
+        w.field("mpm", motor->getMillisecondsPerMl());
+        w.field("iv", motor->getInValve() ? motor->getInValve()->getName() : "");
+        w.field("ov", motor->getOutValve() ? motor->getOutValve()->getName() : "");
       }
       if (active) {
-        const auto duration = device->getDurationMs();
-        const auto activeDur = device->getActiveDuration();
-        jsonDevice["dms"] = duration;
-        jsonDevice["ams"] = activeDur;
-        jsonDevice["lms"] = (duration > 0) ? (duration - activeDur) : 0;
-      }
-      
-      if (device->getDeviceType() == DeviceType::MOTOR) {
-        Motor* motor = static_cast<Motor*>(device);
-        String it = motor->getInTank() ? motor->getInTank()->getName() : "";
-        String ot = motor->getOutTank() ? motor->getOutTank()->getName() : "";
-        //if (motor->getInValve()) {
-          //it=motor->getInValve()->getActiveTank()->getName();
-        //}
-        //if (motor->getOutValve()) {
-          //ot=motor->getOutValve()->getActiveTank()->getName();
-          //ot = motor->getOutValve()->getActiveTank() ? motor->getOutValve()->getActiveTank()->getName() : ot;
-        //}
-        //jsonDevice["it"] = motor->getInValve() ? motor->getInValve()->getActiveTank()->getName() : motor->getInTank() ? motor->getInTank()->getName() : "";
-        //jsonDevice["ot"] = motor->getOutValve() ? motor->getOutValve()->getActiveTank()->getName() : motor->getOutTank() ? motor->getOutTank()->getName() : "";
-        jsonDevice["it"] = it;
-        jsonDevice["ot"] = ot;
-        if(!activeOnly){
-          jsonDevice["mpm"] = motor->getMillisecondsPerMl();
-          jsonDevice["iv"] = motor->getInValve() ? motor->getInValve()->getName() : "";
-          jsonDevice["ov"] = motor->getOutValve() ? motor->getOutValve()->getName() : "";
-        }
-        
-        if (active) {
-          const float d_ml = motor->getDurationMl();
-          const float ad_ml = motor->getActiveDurationMl();
-          jsonDevice["dml"] = d_ml;
-          jsonDevice["aml"] = ad_ml;
-          jsonDevice["lml"] = (d_ml > 0) ? (d_ml - ad_ml) : 0;
-        }
-      } else if (device->getDeviceType() == DeviceType::VALVE) {
-        Valve* valve = static_cast<Valve*>(device);
-        jsonDevice["at"] = valve->getActiveTank() ? valve->getActiveTank()->getName() : "";
-        jsonDevice["o1"] = valve->getOut1() ? valve->getOut1()->getName() : "";
-        jsonDevice["o2"] = valve->getOut2() ? valve->getOut2()->getName() : "";
-        if(!activeOnly){
-          
-        }
-      } else if (device->getDeviceType() == DeviceType::TANK) {
-        Tank* tank = static_cast<Tank*>(device);
-        jsonDevice["sc"] = tank->getCapacity();
-        if(!activeOnly){
-          jsonDevice["c"] = tank->getCapacity();
-        }
-        if (active) {
-          jsonDevice["cl"] = tank->getCurrentLevel() + tank->getActiveDurationMl();
-        } else {
-          jsonDevice["cl"] = tank->getCurrentLevel();
-        }
+        const float d_ml = motor->getDurationMl();
+        const float ad_ml = motor->getActiveDurationMl();
+        w.field("dml", d_ml);
+        w.field("aml", ad_ml);
+        w.field("lml", (d_ml > 0) ? (d_ml - ad_ml) : 0);
+      }
+    } else if (type == DeviceType::VALVE) {
+      Valve* valve = static_cast<Valve*>(device);
+      w.field("at", valve->getActiveTank() ? valve->getActiveTank()->getName() : "");
+      w.field("o1", valve->getOut1() ? valve->getOut1()->getName() : "");
+      w.field("o2", valve->getOut2() ? valve->getOut2()->getName() : "");
+    } else if (type == DeviceType::REMOTE) {
+      RemoteDevice* remote = static_cast<RemoteDevice*>(device);
+      w.field("on", remote->isOnline());
+      if (!activeOnly) {
+        w.field("h", remote->getHost());
+        w.field("rn", remote->getRemoteName());
+      }
+      if (remote->hasLevel()) w.field("cl", remote->getLevel());
+    } else if (type == DeviceType::TANK) {
+      Tank* tank = static_cast<Tank*>(device);
+      w.field("sc", tank->getCapacity());
+      if(!activeOnly){
+        w.field("c", tank->getCapacity());
+      }
+      if (active) {
+        w.field("cl", tank->getCurrentLevel() + tank->getActiveDurationMl());
+      } else {
+        w.field("cl", tank->getCurrentLevel());
       }
     }
-    return doc;
+    w.endObject();
+  }
+
+  // Список устройств в коротких ключах, одним проходом и без ограничения по размеру
+  void writeDevicesJson(Print& out, bool activeOnly) {
+    writeDevicesJson(out, activeOnly, devices, numDevices);
+  }
+  void writeDevicesJson(Print& out, bool activeOnly, Device* const* list, int count) {
+    JsonStreamWriter w(out);
+    w.beginArray();
+    for (int i = 0; i < count; i++) {
+      if(activeOnly && !list[i]->isDeviceActive()) continue;
+      writeDeviceJson(w, list[i], activeOnly);
+    }
+    w.endArray();
   }
 
+  JsonOutBuffer& fullState() {
+    unsigned long now = millis();
+    bool live = false;
+    for (int i = 0; i < numDevices && !live; i++) live = devices[i]->isDeviceActive();
+    if (!fullValid || fullVersion != EventBus::stateVersion() || (live && now - fullBuiltMs >= LIVE_FIELDS_MS)) {
+      AllocScope scope(AllocStats::S_SERIALIZE);
+      fullBuffer.clear();
+      writeDevicesJson(fullBuffer, false);
+      fullVersion = EventBus::stateVersion();
+      fullBuiltMs = now;
+      fullValid = fullBuffer.ok();
+    }
+    return fullBuffer;
+  }
+
+  // Отправка не здесь: клиенты получат это из своих очередей в flushClients()
   void sendSocketDevices(bool activeOnly = false) {
-    StaticJsonDocument<4096> doc = deviceJsonStatic(activeOnly);
-    String socketStr;
-    serializeJson(doc, socketStr);
-    webSocket.broadcastTXT(socketStr);
+    if (!activeOnly) {
+      clientQueues.resyncAll();
+      return;
+    }
+    uint8_t changes[DeviceTable::SIZE] = {0};
+    for (int slot = 0; slot < DeviceTable::size; slot++) {
+      if (DeviceTable::owner[slot] && DeviceTable::active[slot]) changes[slot] = CHANGE_STATE;
+    }
+    clientQueues.mark(changes, DeviceTable::size);
+  }
+  // Подключившийся клиент первым кадром получит полный список
+  void sendFullState(uint8_t num) {
+    clientQueues.connect(num);
+  }
+  void clientDisconnected(uint8_t num) {
+    clientQueues.disconnect(num);
+  }
+
+  // Изменения за тик попадают в очереди клиентов, повторные сливаются
+  void onDeviceChanges(const uint8_t* changes, int count) override {
+    // В снимок - пуски, остановы, смены фазы и положения клапанов, уровни баков;
+    // состояние удалённых устройств снимок не хранит
+    for (int slot = 0; slot < count && !snapshotDirty; slot++) {
+      if (!changes[slot] || DeviceTable::type[slot] == DeviceType::REMOTE) continue;
+      snapshotDirty = true;
+    }
+    clientQueues.mark(changes, count);
+  }
+
+  // Кадр с устройствами из маски; одинаковые маски за тик собираются один раз
+  JsonOutBuffer& deltaFrame(const uint8_t* dirty) {
+    if (deltaValid && memcmp(deltaMask, dirty, sizeof(deltaMask)) == 0) return socketBuffer;
+    AllocScope scope(AllocStats::S_SERIALIZE);
+    socketBuffer.clear();
+    JsonStreamWriter w(socketBuffer);
+    w.beginArray();
+    for (int slot = 0; slot < DeviceTable::SIZE; slot++) {
+      if (!dirty[slot] || !DeviceTable::owner[slot]) continue;
+      writeDeviceJson(w, DeviceTable::owner[slot], true);
+    }
+    w.endArray();
+    memcpy(deltaMask, dirty, sizeof(deltaMask));
+    deltaValid = true;
+    return socketBuffer;
+  }
+
+  void flushClients() {
+    unsigned long now = millis();
+    for (uint8_t num = 0; num < ClientQueues::MAX_CLIENTS; num++) {
+      bool open = webSocket.clientIsConnected(num);
+      if (open && !clientQueues.client(num).connected) clientQueues.connect(num);
+      else if (!open) clientQueues.disconnect(num);
+    }
+    int num;
+    while ((num = clientQueues.overdue(now)) >= 0) {
+      Console.at(ConsoleSink::L_WARN).printf("Warning: WebSocket client %d is not keeping up, disconnecting\n", num);
+      clientQueues.disconnect(num);
+      webSocket.disconnect(num);
+    }
+    deltaValid = false;
+    for (int i = 0; i < ClientQueues::FRAMES_PER_TICK && (num = clientQueues.next(now)) >= 0; i++) {
+      // Кадр в переполненный сокет остановил бы цикл до таймаута TCP
+      if (!ClientQueues::writable(webSocket, num)) {
+        clientQueues.blocked(num, now);
+        continue;
+      }
+      const ClientQueues::Client& c = clientQueues.client(num);
+      JsonOutBuffer& frame = c.needFull ? fullState() : deltaFrame(c.dirty);
+      unsigned long start = millis();
+      bool ok = frame.send(webSocket, num);
+      unsigned long end = millis();
+      clientQueues.sent(num, end, end - start, ok);
+    }
   }
 
   
   void printHelp() {
-    Serial.println("Allowed commands:");
-    Serial.println("M_ON <device> <milliseconds> - Turn on mortor for specified time");
-    Serial.println("M_OFF <device> - Turn off motor");
-    Serial.println("M_DISPENSE <device> <milliliters> - Dispense specified volume");
-    Serial.println("M_SET_MSPERML <device> <msPerMl> - Set ms/ml");
-    Serial.println("M_STATUS <device> - Show motor status");
-    Serial.println("T_FILL <device> <milliliters> - Fill tank");
-    Serial.println("T_DRAIN <device> <milliliters> - Drain tank");
-    Serial.println("T_SET_LEVEL <device> <milliliters> - Set current level ml in tank");
+    Console.println("Allowed commands:");
+    Console.println("M_ON <device> <milliseconds> - Turn on mortor for specified time");
+    Console.println("M_OFF <device> - Turn off motor");
+    Console.println("M_DISPENSE <device> <milliliters> - Dispense specified volume");
+    Console.println("M_SET_MSPERML <device> <msPerMl> - Set ms/ml");
+    Console.println("M_CALIBRATE <device> <fineMl>,<duty%>,<fineMsPerMl> - Two-phase dispense, 0 - off");
+    Console.println("M_STATUS <device> - Show motor status");
+    Console.println("T_FILL <device> <milliliters> - Fill tank");
+    Console.println("T_DRAIN <device> <milliliters> - Drain tank");
+    Console.println("T_SET_LEVEL <device> <milliliters> - Set current level ml in tank");
+    Console.println("D_STATS <device|*> - Show device counters");
+    Console.println("S_ADD <motor> <HH:MM|+sec>,<ml>[,<days 0-6>][,skip|once|all] - Schedule dispense");
+    Console.println("S_DEL <id> - Delete schedule rule");
+    Console.println("S_LIST * - List schedule rules");
+    Console.println("Q_ADD <motor> <src>,<dst>,<ml> - Queue dispense");
+    Console.println("Q_LIST * - List dispense queue");
+    Console.println("Q_STATS * - Dispense queue latency and throughput");
+    Console.println("Q_CLEAR * - Stop and clear dispense queue");
+    Console.println("TRANSFER <from> <to> <ml> - Queue transfer between tanks by route table");
+    Console.println("ROUTES * - List tank-to-tank routes");
+    Console.println("C_APPLY <file> - Apply device config without reboot");
+    Console.println("BENCH <case|*> [save] - Run benchmarks, save as baseline");
+    Console.println("TRACE start|stop|report * - Record inputs to /trace.bin");
+    Console.println("TRACE replay <speed>[,<scale>] - Replay trace, speed 0 = as fast as possible");
+    Console.println("LOG_LEVEL <error|warn|info|debug|*> - Console level and counters");
+    Console.println("LOG_ARENA <flush|*> - Log buffer usage per device, flush to flash");
+    Console.println("TS <device> <window>,<1m|1h|1d> - Level/duty history, e.g. TS tank1 6h,1m");
+    Console.println("TS_INTERVAL <seconds> - History sampling interval");
+    Console.println("R_STATS * - Remote device link counters");
+    Console.println("WS_STATS * - WebSocket client queue depth and latency");
+    Console.println("PIN_TRACE start|stop|stats * - Record output edges with their cause, latency per cause");
+    Console.println("PIN_TRACE vcd [<file>] - Export recorded edges for GTKWave, default /pins.vcd");
+    Console.println("D_ALLOC <reset|strict|relaxed|*>[ <tick|command|serialize|flush>] - Allocations per scope");
+  }
+  void pinTraceCommand(const String& action, const String& param) {
+    if (action == "start") {
+      PinTrace::start();
+    } else if (action == "stop") {
+      PinTrace::stop();
+    } else if (action == "vcd") {
+      String path = param.length() ? param : String("/pins.vcd");
+      File file = LittleFS.open(path, FILE_WRITE);
+      if (!file) {
+        Console.at(ConsoleSink::L_ERROR).println("Error: Cannot open " + path);
+        return;
+      }
+      PinTrace::exportVcd(file);
+      file.close();
+      Console.println("Written " + path);
+    } else if (action != "stats" && action != "*") {
+      Console.at(ConsoleSink::L_ERROR).println("Error: Unknown PIN_TRACE action: " + action);
+      return;
+    }
+    PinTrace::printStats(Console);
+  }
+  // strict/relaxed без области - для всех; strict: выделение в области - ошибка в консоль
+  void allocCommand(const String& action, const String& scopeName) {
+    if (action == "reset") {
+      AllocStats::reset();
+    } else if (action == "strict" || action == "relaxed") {
+      bool found = false;
+      for (int i = 0; i < AllocStats::SCOPES; i++) {
+        if (scopeName.length() && scopeName != AllocStats::scopeName(i)) continue;
+        AllocStats::strict[i] = action == "strict";
+        found = true;
+      }
+      if (!found) {
+        Console.at(ConsoleSink::L_ERROR).println("Error: Unknown scope: " + scopeName);
+        return;
+      }
+    } else if (action != "*") {
+      Console.at(ConsoleSink::L_ERROR).println("Error: Unknown D_ALLOC action: " + action);
+      return;
+    }
+    AllocStats::printJson(Console);
+  }
+  void printStats(const String& deviceName) {
+    DynamicJsonDocument doc(512 * (deviceName == "*" ? numDevices : 1));
+    if (deviceName == "*") {
+      JsonArray arr = doc.to<JsonArray>();
+      for (int i = 0; i < numDevices; i++) {
+        JsonObject obj = arr.createNestedObject();
+        devices[i]->statsJson(obj);
+      }
+    } else {
+      Device* device = findByName(deviceName);
+      if (!device) {
+        Console.at(ConsoleSink::L_ERROR).printf("Unknown device: %s\n", deviceName.c_str());
+        return;
+      }
+      JsonObject obj = doc.to<JsonObject>();
+      device->statsJson(obj);
+    }
+    String out;
+    serializeJson(doc, out);
+    Console.println(out);
   }
   Device* findByName(const String& name) {
+    if (topology) return topology->find(name.c_str());
     auto it = deviceMap.find(name);
     return (it != deviceMap.end()) ? it->second : nullptr;
   }
@@ -216,55 +539,501 @@ public:
     Motor* motor = static_cast<Motor*>(findByName("motor"));
     Valve* inValve = motor->getInValve();
     Valve* outValve = motor->getOutValve();
-    //andrey
-    int ml = 300;
-    int ms = ml * motor->getMillisecondsPerMl();
-    inValve->on();
-    outValve->off();
-    motor->on();
-    delay(ms); 
-    motor->off();
-    //Valve* inValve = static_cast<Valve*>(findByName("inValve"));
-
-    delay(200); // Задержка для стабилизации
-    inValve->off();
-    delay(200);
-
-    //vova
-    outValve->on();
-    delay(100); // Задержка для стабилизации
-    int mlv = 250;
-    int msv = mlv * motor->getMillisecondsPerMl();
-    motor->on();
-    delay(msv); 
-    motor->off();
-    delay(100);
-    inValve->off();
-    outValve->off();
+    // Задания выполняются в update(): клапаны второго переключатся, пока первое стекает
+    String error;
+    bool ok = dispenseQueue.add(motor, inValve->getOut2(), outValve->getOut1(), 300, error) //andrey
+           && dispenseQueue.add(motor, inValve->getOut1(), outValve->getOut2(), 250, error); //vova
+    if (!ok) Console.at(ConsoleSink::L_ERROR).println("Error: " + error);
+  }
+  void runSchedule() {
+    uint64_t now = Device::getCurrentUtcMillis();
+    int idx;
+    while ((idx = scheduler.due(now)) >= 0) {
+      const Scheduler::Rule& rule = scheduler.rule(idx);
+      Device* device = findByName(rule.motor);
+      if (!device || DeviceTable::type[device->getSlot()] != DeviceType::MOTOR) {
+        Console.at(ConsoleSink::L_ERROR).printf("Error: Schedule #%u: unknown motor %s\n", rule.id, rule.motor.c_str());
+        scheduler.done(idx, now, true);
+        continue;
+      }
+      if (device->isDeviceActive() || Reservations::isHeld(device->getSlot())) {
+        scheduler.done(idx, now, false);
+        continue;
+      }
+      PinCause cause(PinTrace::C_SCHEDULE, device->getSlot());
+      static_cast<Motor*>(device)->dispense(rule.ml);
+      scheduler.done(idx, now, true);
+    }
+  }
 
+  // Применить новый конфиг без перезагрузки. Пересоздаются только устройства со
+  // сменившимся типом или пинами, у остальных меняются параметры и ссылки на месте.
+  // Моторы, которые качают через изменяемые устройства, останавливаются.
+  void applyConfig(const char* jsonConfig) {
+    unsigned long started = millis();
+    DynamicJsonDocument doc(4096);
+    DeserializationError err = deserializeJson(doc, jsonConfig);
+    if (err) {
+      Console.at(ConsoleSink::L_ERROR).println("Error parsing config: " + String(err.c_str()));
+      return;
+    }
+    JsonArray list = doc.as<JsonArray>();
+    // После загрузки из снимка исходный JSON ещё не разобран
+    if (deviceConfigs.empty() && numDevices > 0) rememberConfigs(bootConfig);
+
+    std::map<String, Device*> kept;
+    std::vector<Device*> changed;   // удалённые, пересоздаваемые и изменённые
+    std::vector<Device*> removed;
+    int rebuilt = 0;
+    for (JsonObject obj : list) {
+      String name = obj["name"];
+      Device* old = findByName(name);
+      if (!old) continue;
+      String cfg;
+      serializeJson(obj, cfg);
+      if (cfg == deviceConfigs[name]) {
+        kept[name] = old;
+        continue;
+      }
+      changed.push_back(old);
+      if (sameHardware(name, obj)) {
+        kept[name] = old;
+      } else {
+        removed.push_back(old);
+        rebuilt++;
+      }
+    }
+    for (Device* d : devicesList) {
+      if (!kept.count(d->getName()) && !contains(removed, d)) {
+        removed.push_back(d);
+        changed.push_back(d);
+      }
+    }
+
+    for (Device* d : devicesList) {
+      if (d->getDeviceType() == DeviceType::MOTOR && d->isDeviceActive() && touches(static_cast<Motor*>(d), changed)) {
+        d->off();
+      }
+    }
+    for (Device* d : changed) dispenseQueue.cancel(d);
+    pendingRuns.erase(std::remove_if(pendingRuns.begin(), pendingRuns.end(),
+                                     [&](const Snapshot::Run& run) {
+                                       return contains(changed, run.device) || contains(removed, run.device);
+                                     }),
+                      pendingRuns.end());
+    for (Device* d : removed) {
+      if (d->isDeviceActive()) d->off();
+      deviceConfigs.erase(d->getName());
+      delete d;
+    }
+
+    // Новый список в порядке конфига: сохранённые устройства плюс новые
+    std::vector<Device*> created;
+    devicesList.clear();
+    for (JsonObject obj : list) {
+      String name = obj["name"];
+      auto it = kept.find(name);
+      Device* device = it != kept.end() ? it->second : nullptr;
+      if (!device) {
+        if (DeviceTable::full()) {
+          Console.at(ConsoleSink::L_ERROR).println("Error: Too many devices, skipping " + name);
+          continue;
+        }
+        device = createDevice(obj);
+        if (!device) continue;
+        created.push_back(device);
+      } else if (contains(changed, device)) {
+        if (device->getDeviceType() == DeviceType::TANK) {
+          static_cast<Tank*>(device)->setCapacity(obj["capacity"] | 0);
+        } else if (device->getDeviceType() == DeviceType::MOTOR) {
+          static_cast<Motor*>(device)->setMillisecondsPerMl(obj["millisecondsPerMl"] | 0.0f);
+        }
+      }
+      devicesList.push_back(device);
+      deviceConfigs[device->getName()] = "";
+      serializeJson(obj, deviceConfigs[device->getName()]);
+    }
+    devices = devicesList.data();
+    numDevices = devicesList.size();
+    deviceMap.clear();
+    for (int i = 0; i < numDevices; i++) deviceMap[devices[i]->getName()] = devices[i];
+
+    // Ссылки сохранённых устройств могли указывать на пересозданные
+    for (JsonObject obj : list) {
+      Device* device = findByName(obj["name"] | "");
+      if (!device || contains(created, device)) continue;
+      if (device->getDeviceType() == DeviceType::VALVE) {
+        static_cast<Valve*>(device)->link(findTank(obj["out1"] | ""), findTank(obj["out2"] | ""));
+      } else if (device->getDeviceType() == DeviceType::MOTOR) {
+        static_cast<Motor*>(device)->link(findTank(obj["inTank"] | ""), findTank(obj["outTank"] | ""),
+                                          findValve(obj["inValve"] | ""), findValve(obj["outValve"] | ""));
+      }
+    }
+    for (Device* d : created) {
+      PinCause cause(PinTrace::C_BOOT, d->getSlot());
+      d->begin();
+    }
+
+    configHash = Snapshot::hash(jsonConfig);
+    snapshotDirty = true;
+    routes.build(devices, numDevices);
+    EventBus::touch();
+    sendSocketDevices();
+    Console.printf("Config applied: %d added, %d rebuilt, %d updated, %d removed in %lu ms\n",
+                  (int)created.size() - rebuilt, rebuilt, (int)(changed.size() - removed.size()),
+                  (int)removed.size() - rebuilt, millis() - started);
   }
-  void update() {
-    const char* ERR_DEVICE_NOT_FOUND = "Unknown device: %s";
+
+  // Замер идёт синхронно в цикле управления и сорвал бы автоотключения и запуски
+  const char* benchBlocker() {
     for (int i = 0; i < numDevices; i++) {
-      devices[i]->update();
+      if (devices[i]->isDeviceActive()) return "a device is on";
     }
-    if (Serial.available() > 0) {
-      String command = Serial.readStringUntil('\n');
-      const size_t MAX_COMMAND_LENGTH = 64;
-      if (command.length() > MAX_COMMAND_LENGTH) {
-        Serial.printf("Error: Command too long: %s\n", command.c_str());
-        return;
+    if (!dispenseQueue.empty()) return "dispense queue is not empty";
+    if (Reservations::pendingCount() > 0) return "operations are waiting for resources";
+    uint64_t next = scheduler.nextFire();
+    if (next != Scheduler::NEVER && next <= Device::getCurrentUtcMillis() + BENCH_CLEAR_MS) return "schedule is due";
+    return nullptr;
+  }
+
+  // BENCH <case|*> [save]
+  void runBench(const String& filter, const String& param) {
+    const char* busy = benchBlocker();
+    if (busy) {
+      Console.at(ConsoleSink::L_ERROR).printf("Error: BENCH refused, %s\n", busy);
+      return;
+    }
+    Bench bench(filter);
+    bench.measure("parseCommand", 1000, [&]() {
+      String command = "M_ON motor 1000";
+      String cmd, name, arg;
+      parseCommand(command, cmd, name, arg);
+    });
+    if (numDevices > 0) {
+      // Большие конфиги имитируем повтором существующих устройств
+      static const int counts[] = {5, 20, 100};
+      Bench::NullPrint sink;
+      for (int n : counts) {
+        std::vector<Device*> list;
+        for (int i = 0; i < n; i++) list.push_back(devices[i % numDevices]);
+        String name = "devicesJson/" + String(n);
+        bench.measure(name.c_str(), 2000 / n, [&]() { writeDevicesJson(sink, false, list.data(), n); });
+      }
+    }
+    bench.deviceCases();
+    bench.report(Console, param == "save");
+  }
+
+  // TRACE start|stop|report|replay [<speed>[,<scale>]]
+  bool handleTraceCommand(const String& cmd, const String& action, const String& param) {
+    if (cmd != "TRACE") return false;
+    if (action == "start") {
+      tracePlayer.stop();
+      if (!Trace::start()) Console.at(ConsoleSink::L_ERROR).println("Error: Cannot open trace file");
+    } else if (action == "stop") {
+      Trace::stop();
+    } else if (action == "report") {
+      tracePlayer.report(Console);
+    } else if (action == "replay") {
+      Trace::stop();
+      float speed = param.length() ? param.toFloat() : 1;
+      int comma = param.indexOf(',');
+      int scale = comma >= 0 ? param.substring(comma + 1).toInt() : 1;
+      if (!tracePlayer.start("/trace.bin", speed, scale)) {
+        Console.at(ConsoleSink::L_ERROR).println("Error: No trace recorded");
+        return true;
+      }
+      traceClockShift = (int64_t)(Device::getCurrentUtcMillis() / 1000) - (int64_t)(tracePlayer.traceStartUtc() / 1000);
+    } else {
+      Console.at(ConsoleSink::L_ERROR).println("Error: Unknown trace action: " + action);
+    }
+    return true;
+  }
+
+  // Копия команды для k-го по счёту устройства того же типа - так нагрузка
+  // масштабируется на N устройств без изменения записи
+  String retarget(const char* line, int k) {
+    char cmdBuf[16], nameBuf[32], paramBuf[32] = "";
+    if (sscanf(line, "%15s %31s %31s", cmdBuf, nameBuf, paramBuf) < 2) return line;
+    Device* device = findByName(nameBuf);
+    if (!device) return line;
+    std::vector<Device*> same;
+    int idx = 0;
+    for (int i = 0; i < numDevices; i++) {
+      if (devices[i]->getDeviceType() != device->getDeviceType()) continue;
+      if (devices[i] == device) idx = same.size();
+      same.push_back(devices[i]);
+    }
+    Device* target = same[(idx + k) % same.size()];
+    return String(cmdBuf) + " " + target->getName() + (paramBuf[0] ? " " + String(paramBuf) : String(""));
+  }
+
+  void replayTrace() {
+    if (!tracePlayer.isRunning()) return;
+    unsigned long tickStart = millis();
+    Trace::Event e;
+    uint32_t lag;
+    while (tracePlayer.due(millis(), tickStart, e, lag)) {
+      if (e.kind == Trace::BUTTON) {
+        int slot = e.slot;
+        Device* device = slot < DeviceTable::SIZE ? DeviceTable::owner[slot] : nullptr;
+        if (device && e.pressed && !device->isDeviceActive()) {
+          DeviceTable::byButton[slot] = true;
+          device->on();
+        } else if (device && !e.pressed && DeviceTable::byButton[slot]) {
+          DeviceTable::byButton[slot] = false;
+          device->off();
+        }
+      } else if (e.kind == Trace::NTP) {
+        // При ускоренном воспроизведении событие приходит раньше записанного момента:
+        // часы не должны уходить вперёд на разницу, иначе сработают пропущенные правила
+        int64_t aheadMs = (int64_t)e.atMs - (int64_t)tracePlayer.elapsed(millis());
+        Device::updateNtpTime((time_t)(e.seconds + traceClockShift - aheadMs / 1000));
+      } else if (Trace::isMeta(e.text)) {
+        // Трейс старой записи: служебные команды не выполняются
+        Console.at(ConsoleSink::L_WARN).printf("Warning: Not replaying %s\n", e.text);
+      } else {
+        for (int k = 0; k < tracePlayer.getScale(); k++) {
+          String line = k ? retarget(e.text, k) : String(e.text);
+          unsigned long started = micros();
+          executeCommand(line, e.kind);
+          tracePlayer.sample(micros() - started, lag);
+        }
       }
-      String cmd, deviceName, param;
-      if (!parseCommand(command, cmd, deviceName, param)) return;
-      
-      auto it = deviceMap.find(deviceName);
-      if (it == deviceMap.end()) {
-        Serial.printf(ERR_DEVICE_NOT_FOUND, deviceName.c_str());
+      if (!tracePlayer.isRunning()) tracePlayer.report(Console);
+    }
+  }
+
+  void setConsoleLevel(const String& name) {
+    ConsoleSink::Level level;
+    if (name != "*") {
+      if (!ConsoleSink::parseLevel(name, level)) {
+        Console.at(ConsoleSink::L_ERROR).println("Error: Unknown level: " + name);
         return;
       }
-      it->second->handleCommand(cmd, param);
+      Console.setLevel(level);
+    }
+    const ConsoleSink::Counters& c = Console.counters();
+    Console.printf("level=%s lines=%lu dropped=%lu waits=%lu filtered=%lu\n",
+                   ConsoleSink::levelName(Console.getLevel()), (unsigned long)c.lines, (unsigned long)c.dropped,
+                   (unsigned long)c.waits, (unsigned long)c.filtered);
+  }
+
+  bool handleConfigCommand(const String& cmd, const String& path) {
+    if (cmd != "C_APPLY") return false;
+    if (topology) {
+      Console.at(ConsoleSink::L_ERROR).println("Error: Devices are compiled in, C_APPLY is not available");
+      return true;
+    }
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file) {
+      Console.at(ConsoleSink::L_ERROR).println("Error: Cannot open " + path);
+      return true;
+    }
+    String json = file.readString();
+    file.close();
+    applyConfig(json.c_str());
+    return true;
+  }
+
+  // TRANSFER <from> <to> <ml>: маршрут берётся из таблицы, собранной при загрузке конфига
+  void transfer(const String& command) {
+    char from[32], to[32], ml[16];
+    if (sscanf(command.c_str(), "%*15s %31s %31s %15s", from, to, ml) != 3) {
+      Console.at(ConsoleSink::L_ERROR).println("Error: Expected TRANSFER <from> <to> <ml>");
+      return;
+    }
+    Tank* src = findTank(from);
+    Tank* dst = findTank(to);
+    if (!src || !dst) {
+      Console.at(ConsoleSink::L_ERROR).printf("Error: Unknown tank: %s\n", src ? to : from);
+      return;
+    }
+    const RouteTable::Route* route = routes.pick(src, dst);
+    if (!route) {
+      Console.at(ConsoleSink::L_ERROR).printf("Error: No route from %s to %s\n", from, to);
+      return;
+    }
+    String error;
+    if (!dispenseQueue.add(route->motor, src, dst, strtof(ml, nullptr), route->request, error)) {
+      Console.at(ConsoleSink::L_ERROR).println("Error: " + error);
+    }
+  }
+
+  bool handleQueueCommand(const String& cmd, const String& name, const String& param) {
+    if (cmd == "Q_ADD") {
+      Device* motor = findByName(name);
+      if (!motor || DeviceTable::type[motor->getSlot()] != DeviceType::MOTOR) {
+        Console.at(ConsoleSink::L_ERROR).printf("Error: Unknown motor: %s\n", name.c_str());
+        return true;
+      }
+      char buf[32];
+      strncpy(buf, param.c_str(), sizeof(buf) - 1);
+      buf[sizeof(buf) - 1] = '\0';
+      char* rest = nullptr;
+      char* src = strtok_r(buf, ",", &rest);
+      char* dst = strtok_r(nullptr, ",", &rest);
+      char* ml = strtok_r(nullptr, ",", &rest);
+      if (!src || !dst || !ml) {
+        Console.at(ConsoleSink::L_ERROR).println("Error: Expected <src>,<dst>,<ml>");
+        return true;
+      }
+      Device* srcTank = findByName(src);
+      Device* dstTank = findByName(dst);
+      if (!srcTank || DeviceTable::type[srcTank->getSlot()] != DeviceType::TANK ||
+          !dstTank || DeviceTable::type[dstTank->getSlot()] != DeviceType::TANK) {
+        Console.at(ConsoleSink::L_ERROR).printf("Error: Unknown tank in %s\n", param.c_str());
+        return true;
+      }
+      String error;
+      if (!dispenseQueue.add(static_cast<Motor*>(motor), static_cast<Tank*>(srcTank),
+                             static_cast<Tank*>(dstTank), strtof(ml, nullptr), error)) {
+        Console.at(ConsoleSink::L_ERROR).println("Error: " + error);
+      }
+      return true;
+    } else if (cmd == "Q_LIST") {
+      dispenseQueue.list(Console);
+      return true;
+    } else if (cmd == "Q_STATS") {
+      dispenseQueue.printStats(Console);
+      return true;
+    } else if (cmd == "Q_CLEAR") {
+      dispenseQueue.clear();
+      return true;
+    }
+    return false;
+  }
+
+  bool handleScheduleCommand(const String& cmd, const String& name, const String& param) {
+    if (cmd == "S_ADD") {
+      String error;
+      if (!scheduler.add(name, param, Device::getCurrentUtcMillis(), error)) {
+        Console.at(ConsoleSink::L_ERROR).println("Error: " + error);
+      }
+      return true;
+    } else if (cmd == "S_DEL") {
+      if (!scheduler.remove(name.toInt())) Console.at(ConsoleSink::L_ERROR).println("Error: Unknown schedule rule: " + name);
+      return true;
+    } else if (cmd == "S_LIST") {
+      scheduler.list(Console);
+      return true;
+    }
+    return false;
+  }
+
+  void update() {
+    {
+      // Управляющая часть тика - её можно проверять на ноль выделений (D_ALLOC strict)
+      AllocScope scope(AllocStats::S_TICK);
+      // Установка из кода - развёрнутый цикл по типам, без виртуальных вызовов
+      if (topology) topology->update();
+      else DeviceTable::update();
+      // Отложенные из-за занятых ресурсов операции - после автоотключений этого тика
+      {
+        PinCause cause(PinTrace::C_QUEUE);
+        Reservations::update();
+        dispenseQueue.update();
+      }
+      runSchedule();
+      timeSeries.update(devices, numDevices);
+    }
+    // Берём только то, что уже пришло: медленная строка не задерживает автоотключения
+    for (int i = 0; i < MAX_LINES_PER_TICK && serialLine.poll(Serial); i++) {
+      if (serialLine.length() == 0) continue;
+      commandLine = serialLine.line();
+      executeCommand(commandLine);
+    }
+    RemoteLink::update();
+    replayTrace();
+    Trace::update(millis());
+    // Всё, что изменилось за тик, уходит подписчикам одним сообщением
+    EventBus::flush();
+    flushClients();
+    resumeRuns();
+    saveSnapshot();
+    LogArena::update();
+    // Консоль - в остаток тика, без ожидания UART
+    Console.drain();
+  }
+
+  // source - откуда пришла команда, для записи трейса (WebSocket передаёт CMD_WS)
+  void executeCommand(String& command, Trace::Kind source = Trace::CMD_SERIAL) {
+    Trace::command(source, command);
+    PinCause cause(PinTrace::C_COMMAND);
+    AllocScope scope(AllocStats::S_COMMAND);
+    const char* ERR_DEVICE_NOT_FOUND = "Unknown device: %s\n";
+    const size_t MAX_COMMAND_LENGTH = 64;
+    if (command.length() > MAX_COMMAND_LENGTH) {
+      Console.at(ConsoleSink::L_ERROR).printf("Error: Command too long: %s\n", command.c_str());
+      return;
+    }
+    String cmd, deviceName, param;
+    if (!parseCommand(command, cmd, deviceName, param)) return;
+    if (cmd == "D_STATS") {
+      printStats(deviceName);
+      return;
+    }
+    if (handleScheduleCommand(cmd, deviceName, param)) return;
+    if (handleQueueCommand(cmd, deviceName, param)) return;
+    if (handleConfigCommand(cmd, deviceName)) return;
+    if (handleTraceCommand(cmd, deviceName, param)) return;
+    if (cmd == "LOG_LEVEL") {
+      setConsoleLevel(deviceName);
+      return;
+    }
+    if (cmd == "LOG_ARENA") {
+      if (deviceName == "flush") LogArena::flushAll();
+      LogArena::printStats(Console);
+      return;
+    }
+    if (cmd == "TS") {
+      String error;
+      if (!findByName(deviceName)) Console.at(ConsoleSink::L_ERROR).printf(ERR_DEVICE_NOT_FOUND, deviceName.c_str());
+      else if (!timeSeries.query(deviceName, param, Console, error))
+        Console.at(ConsoleSink::L_ERROR).println("Error: " + error);
+      return;
+    }
+    if (cmd == "TS_INTERVAL") {
+      if (!timeSeries.setInterval(deviceName.toInt()))
+        Console.at(ConsoleSink::L_ERROR).println("Error: Invalid interval: " + deviceName);
+      else Console.printf("History interval %d s\n", timeSeries.getInterval());
+      return;
+    }
+    if (cmd == "TRANSFER") {
+      transfer(command);
+      return;
+    }
+    if (cmd == "ROUTES") {
+      routes.print(Console);
+      return;
+    }
+    if (cmd == "WS_STATS") {
+      clientQueues.printStats(Console);
+      return;
+    }
+    if (cmd == "PIN_TRACE") {
+      pinTraceCommand(deviceName, param);
+      return;
+    }
+    if (cmd == "D_ALLOC") {
+      allocCommand(deviceName, param);
+      return;
+    }
+    if (cmd == "R_STATS") {
+      RemoteLink::printStats(Console);
+      return;
+    }
+    if (cmd == "BENCH") {
+      runBench(deviceName, param);
+      return;
+    }
+
+    Device* device = findByName(deviceName);
+    if (!device) {
+      Console.at(ConsoleSink::L_ERROR).printf(ERR_DEVICE_NOT_FOUND, deviceName.c_str());
+      return;
     }
+    device->handleCommand(cmd, param);
   }
 };
 
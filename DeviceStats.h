@@ -0,0 +1,102 @@
+// DeviceStats.h
+#ifndef DEVICE_STATS_H
+#define DEVICE_STATS_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Счётчики устройства, обновляются за O(1) в on()/off()/fill()/drain().
+// Хранятся целиком одним blob'ом в Preferences.
+struct DeviceStats {
+  static const uint16_t VERSION = 1;
+  static const int WINDOW_BUCKETS = 24;                   // скользящее окно 24 часа
+  static const unsigned long BUCKET_MS = 60UL * 60 * 1000;
+
+  struct Bucket {
+    uint32_t slot;    // номер часа от эпохи
+    uint32_t runs;
+    uint32_t onMs;
+    float ml;
+  };
+
+  uint16_t version = VERSION;
+  uint32_t runs = 0;
+  uint64_t onMs = 0;
+  uint32_t minRunMs = 0;
+  uint32_t maxRunMs = 0;
+  float ml = 0;       // объём, прокачанный за запуски (мотор)
+  float mlIn = 0;     // долито в бак
+  float mlOut = 0;    // слито из бака
+  uint64_t lastErrorTime = 0;
+  char lastError[48] = {0};
+  Bucket window[WINDOW_BUCKETS] = {};
+
+  void recordRun(uint64_t now, unsigned long durationMs, float runMl) {
+    runs++;
+    onMs += durationMs;
+    ml += runMl;
+    if (runs == 1 || durationMs < minRunMs) minRunMs = durationMs;
+    if (durationMs > maxRunMs) maxRunMs = durationMs;
+    Bucket& b = bucket(now);
+    b.runs++;
+    b.onMs += durationMs;
+    b.ml += runMl;
+  }
+
+  void recordFlow(float amount) {
+    if (amount > 0) mlIn += amount;
+    else mlOut -= amount;
+  }
+
+  void recordError(uint64_t now, const char* message) {
+    lastErrorTime = now;
+    strncpy(lastError, message, sizeof(lastError) - 1);
+    lastError[sizeof(lastError) - 1] = '\0';
+  }
+
+  void toJson(JsonObject& out, uint64_t now) const {
+    out["runs"] = runs;
+    out["onMs"] = onMs;
+    out["ml"] = roundf(ml * 100) / 100.0f;
+    out["minMs"] = minRunMs;
+    out["maxMs"] = maxRunMs;
+    out["meanMs"] = runs ? (uint32_t)(onMs / runs) : 0;
+    if (mlIn > 0) out["mlIn"] = roundf(mlIn * 100) / 100.0f;
+    if (mlOut > 0) out["mlOut"] = roundf(mlOut * 100) / 100.0f;
+
+    uint32_t current = now / BUCKET_MS;
+    uint32_t wRuns = 0, wOnMs = 0;
+    float wMl = 0;
+    for (int i = 0; i < WINDOW_BUCKETS; i++) {
+      const Bucket& b = window[i];
+      if (b.runs == 0 || current - b.slot >= (uint32_t)WINDOW_BUCKETS) continue;
+      wRuns += b.runs;
+      wOnMs += b.onMs;
+      wMl += b.ml;
+    }
+    JsonObject w = out.createNestedObject("24h");
+    w["runs"] = wRuns;
+    w["onMs"] = wOnMs;
+    w["ml"] = roundf(wMl * 100) / 100.0f;
+
+    if (lastErrorTime) {
+      out["err"] = lastError;
+      out["errTime"] = lastErrorTime;
+    }
+  }
+
+private:
+  Bucket& bucket(uint64_t now) {
+    uint32_t slot = now / BUCKET_MS;
+    Bucket& b = window[slot % WINDOW_BUCKETS];
+    if (b.slot != slot) {
+      b.slot = slot;
+      b.runs = 0;
+      b.onMs = 0;
+      b.ml = 0;
+    }
+    return b;
+  }
+};
+
+#endif
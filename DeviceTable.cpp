@@ -0,0 +1,177 @@
+// DeviceTable.cpp
+#include "DeviceTable.h"
+#include "Device.h"
+#include "Tank.h"
+#include "Motor.h"
+#include "Trace.h"
+#include "PinTrace.h"
+
+Device* DeviceTable::owner[SIZE + 1] = {nullptr};
+DeviceType DeviceTable::type[SIZE + 1];
+int DeviceTable::pin[SIZE + 1];
+int DeviceTable::buttonPin[SIZE + 1];
+bool DeviceTable::activeHigh[SIZE + 1];
+bool DeviceTable::active[SIZE + 1];
+bool DeviceTable::byButton[SIZE + 1];
+bool DeviceTable::lastButtonState[SIZE + 1];
+unsigned long DeviceTable::lastDebounceTime[SIZE + 1];
+uint64_t DeviceTable::timeOn[SIZE + 1];
+uint64_t DeviceTable::timeOff[SIZE + 1];
+uint64_t DeviceTable::autoTimeOff[SIZE + 1];
+uint64_t DeviceTable::hardStop[SIZE + 1];
+uint64_t DeviceTable::phaseAt[SIZE + 1];
+uint64_t DeviceTable::durationMs[SIZE + 1];
+float DeviceTable::msPerMl[SIZE + 1];
+bool DeviceTable::statsDirty[SIZE + 1];
+uint64_t DeviceTable::lastStatsSave[SIZE + 1];
+int DeviceTable::size = 0;
+
+int DeviceTable::tankSlot[SIZE + 1];
+int DeviceTable::capacity[SIZE + 1];
+float DeviceTable::level[SIZE + 1];
+float DeviceTable::lastSavedLevel[SIZE + 1];
+uint64_t DeviceTable::lastSaveTime[SIZE + 1];
+int DeviceTable::tankSize = 0;
+
+bool DeviceTable::full() {
+  for (int i = 0; i < size; i++)
+    if (!owner[i]) return false;
+  return size >= SIZE;
+}
+
+int DeviceTable::add(Device* device) {
+  int slot = 0;
+  while (slot < size && owner[slot]) slot++;
+  if (slot == size) {
+    if (size >= SIZE) slot = SIZE;
+    else size++;
+  }
+  owner[slot] = slot == SIZE ? nullptr : device;
+  type[slot] = DeviceType::OTHER;
+  pin[slot] = -1;
+  buttonPin[slot] = -1;
+  activeHigh[slot] = true;
+  active[slot] = false;
+  byButton[slot] = false;
+  lastButtonState[slot] = false;
+  lastDebounceTime[slot] = 0;
+  timeOn[slot] = 0;
+  timeOff[slot] = 0;
+  autoTimeOff[slot] = 0;
+  hardStop[slot] = 0;
+  phaseAt[slot] = 0;
+  durationMs[slot] = 0;
+  msPerMl[slot] = 0;
+  statsDirty[slot] = false;
+  lastStatsSave[slot] = 0;
+  return slot;
+}
+
+void DeviceTable::release(int slot) {
+  if (slot < 0 || slot >= SIZE) return;
+  owner[slot] = nullptr;
+  active[slot] = false;
+  autoTimeOff[slot] = 0;
+  hardStop[slot] = 0;
+  phaseAt[slot] = 0;
+  buttonPin[slot] = -1;
+  statsDirty[slot] = false;
+  while (size > 0 && !owner[size - 1]) size--;
+}
+
+int DeviceTable::addTank(int slot) {
+  if (slot == SIZE) return SIZE;
+  int tank = 0;
+  while (tank < tankSize && tankSlot[tank] != -1) tank++;
+  if (tank == tankSize) {
+    if (tankSize >= SIZE) tank = SIZE;
+    else tankSize++;
+  }
+  tankSlot[tank] = tank == SIZE ? -1 : slot;
+  capacity[tank] = 0;
+  level[tank] = 0;
+  lastSavedLevel[tank] = -1;
+  lastSaveTime[tank] = 0;
+  return tank;
+}
+
+void DeviceTable::releaseTank(int tank) {
+  if (tank < 0 || tank >= SIZE) return;
+  tankSlot[tank] = -1;
+  while (tankSize > 0 && tankSlot[tankSize - 1] == -1) tankSize--;
+}
+
+void DeviceTable::checkButton(int slot, unsigned long nowMs) {
+  if (buttonPin[slot] == -1 || !owner[slot]) return;
+  bool currentButtonState = digitalRead(buttonPin[slot]) == LOW;
+  if (currentButtonState != lastButtonState[slot])
+    lastDebounceTime[slot] = nowMs;
+  if ((nowMs - lastDebounceTime[slot]) > DEBOUNCE_DELAY) {
+    if (currentButtonState && !active[slot]) {
+      PinCause cause(PinTrace::C_BUTTON, slot);
+      byButton[slot] = true;
+      Trace::button(slot, true);
+      owner[slot]->on();
+    } else if (!currentButtonState && active[slot] && byButton[slot]) {
+      PinCause cause(PinTrace::C_BUTTON, slot);
+      byButton[slot] = false;
+      Trace::button(slot, false);
+      owner[slot]->off();
+    }
+  }
+  lastButtonState[slot] = currentButtonState;
+}
+
+// Опоздание срока в мкс для PinCause: разность в 64 битах, больше ~71 минуты - предел u32
+static uint32_t lateUs(uint64_t now, uint64_t at) {
+  uint64_t ms = now - at;
+  return ms >= 0xFFFFFFFFu / 1000 ? 0xFFFFFFFFu : (uint32_t)(ms * 1000);
+}
+
+void DeviceTable::updateSlot(int slot, uint64_t now, unsigned long nowMs) {
+  if (!owner[slot]) return;
+  checkButton(slot, nowMs);
+  if (statsDirty[slot] &&
+      (lastStatsSave[slot] == 0 || now - lastStatsSave[slot] >= Device::STATS_SAVE_INTERVAL_MS)) {
+    owner[slot]->saveStats();
+  }
+  if (!active[slot]) return;
+  if (hardStop[slot] && now >= hardStop[slot] && (!autoTimeOff[slot] || hardStop[slot] < autoTimeOff[slot])) {
+    // Задержка считается от расчётного момента, а не от этого тика
+    PinCause cause(PinTrace::C_LIMIT, slot, lateUs(now, hardStop[slot]));
+    owner[slot]->log("Warning", "Stopped at tank limit");
+    owner[slot]->off();
+    return;
+  }
+  if (phaseAt[slot] && now >= phaseAt[slot]) {
+    PinCause cause(PinTrace::C_DEADLINE, slot, lateUs(now, phaseAt[slot]));
+    static_cast<Motor*>(owner[slot])->finePhase(now);
+  }
+  if (autoTimeOff[slot] == 0) return;
+  if (now >= autoTimeOff[slot]) {
+    PinCause cause(PinTrace::C_DEADLINE, slot, lateUs(now, autoTimeOff[slot]));
+    owner[slot]->off();
+    // Выключение отложено (клапан держит мотор): срок уже в очереди, повторно не срабатывает
+    if (active[slot]) autoTimeOff[slot] = 0;
+    //log("Auto-off triggered");
+  }
+}
+
+void DeviceTable::updateTank(int tank, uint64_t now) {
+  if (level[tank] != lastSavedLevel[tank] && now - lastSaveTime[tank] >= Device::SAVE_INTERVAL_MS) {
+    static_cast<Tank*>(owner[tankSlot[tank]])->saveLevel(now);
+  }
+}
+
+void DeviceTable::update() {
+  uint64_t now = Device::getCurrentUtcMillis();
+  unsigned long nowMs = millis();
+  for (int i = 0; i < size; i++) {
+    if (!owner[i]) continue;
+    updateSlot(i, now, nowMs);
+  }
+  for (int t = 0; t < tankSize; t++) {
+    if (tankSlot[t] == -1) continue;
+    updateTank(t, now);
+  }
+}
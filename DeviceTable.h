@@ -0,0 +1,67 @@
+// DeviceTable.h
+#ifndef DEVICE_TABLE_H
+#define DEVICE_TABLE_H
+
+#include <Arduino.h>
+
+#ifndef DEVICE_TABLE_SIZE
+#define DEVICE_TABLE_SIZE 32
+#endif
+
+class Device;
+enum class DeviceType;
+
+// Горячее состояние всех устройств в виде структуры массивов.
+// Device/Tank/Motor держат ссылки на свою строку, поэтому их API не меняется,
+// а DeviceManager за тик проходит плотные массивы без виртуальных вызовов.
+// Последняя строка (SIZE) - запасная для устройств сверх лимита, она не сканируется.
+class DeviceTable {
+public:
+  static const int SIZE = DEVICE_TABLE_SIZE;
+  static const unsigned long DEBOUNCE_DELAY = 50;
+
+  // Общие массивы, индекс - слот устройства
+  static Device* owner[SIZE + 1];
+  static DeviceType type[SIZE + 1];
+  static int pin[SIZE + 1];
+  static int buttonPin[SIZE + 1];
+  static bool activeHigh[SIZE + 1];
+  static bool active[SIZE + 1];
+  static bool byButton[SIZE + 1];
+  static bool lastButtonState[SIZE + 1];
+  static unsigned long lastDebounceTime[SIZE + 1];
+  static uint64_t timeOn[SIZE + 1];
+  static uint64_t timeOff[SIZE + 1];
+  static uint64_t autoTimeOff[SIZE + 1];
+  static uint64_t hardStop[SIZE + 1];      // бак станет полным/пустым (Tank::updateLimit), 0 - нет
+  static uint64_t phaseAt[SIZE + 1];       // переход дозирования на медленную фазу (Motor), 0 - нет
+  static uint64_t durationMs[SIZE + 1];
+  static float msPerMl[SIZE + 1];          // только моторы, у остальных 0
+  static bool statsDirty[SIZE + 1];
+  static uint64_t lastStatsSave[SIZE + 1];
+  static int size;                         // число занятых слотов, включая дыры
+
+  // Баки, индекс - номер бака
+  static int tankSlot[SIZE + 1];
+  static int capacity[SIZE + 1];
+  static float level[SIZE + 1];
+  static float lastSavedLevel[SIZE + 1];
+  static uint64_t lastSaveTime[SIZE + 1];
+  static int tankSize;
+
+  static int add(Device* device);
+  static void release(int slot);
+  static int addTank(int slot);
+  static void releaseTank(int tank);
+  static bool full();
+
+  // Логика одного слота; Device::update()/checkButton() вызывают её же
+  static void checkButton(int slot, unsigned long nowMs);
+  static void updateSlot(int slot, uint64_t now, unsigned long nowMs);
+  static void updateTank(int tank, uint64_t now);
+
+  // Проход по всей таблице за один тик
+  static void update();
+};
+
+#endif
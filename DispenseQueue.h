@@ -0,0 +1,276 @@
+// DispenseQueue.h
+#ifndef DISPENSE_QUEUE_H
+#define DISPENSE_QUEUE_H
+
+#include <Arduino.h>
+#include <vector>
+#include <Motor.h>
+#include <Reservations.h>
+#include <Console.h>
+
+// Очередь дозирований "мотор, откуда, куда, сколько" без delay().
+// Задание заранее занимает клапаны в нужном положении. Если у следующего задания
+// того же мотора маршрут совпадает, оно стартует сразу после остановки мотора,
+// пока предыдущее ещё держит маршрут на время стекания (TAIL_MS). Свободные
+// клапаны переключаются заранее, поэтому их успокоение идёт параллельно с
+// работой насоса, а остальные переключаются одновременно, а не по очереди.
+class DispenseQueue {
+public:
+  static const int MAX_JOBS = 16;
+  static const unsigned long SETTLE_MS = 100; // клапан успокаивается после переключения
+  static const unsigned long TAIL_MS = 200;   // жидкость стекает после остановки насоса
+
+  enum State : uint8_t { QUEUED, ROUTING, PUMPING, TAIL, FAILED };
+
+  struct Job {
+    uint16_t id;
+    Motor* motor;
+    Tank* src;
+    Tank* dst;
+    float ml;
+    State state;
+    Reservations::Request route;
+    unsigned long queuedAt;
+    unsigned long startedAt;
+    unsigned long pumpedAt;
+  };
+
+  struct Stats {
+    uint32_t jobs = 0;
+    float ml = 0;
+    uint64_t waitMs = 0;      // от постановки в очередь до старта насоса
+    uint64_t latencyMs = 0;   // от постановки до конца стекания
+    uint32_t maxLatencyMs = 0;
+    uint64_t busyMs = 0;      // время с непустой очередью
+  };
+
+  bool add(Motor* motor, Tank* src, Tank* dst, float ml, String& error) {
+    Reservations::Request route;
+    if (!plan(motor, src, motor->getInValve(), 0, route, error) ||
+        !plan(motor, dst, motor->getOutValve(), 1, route, error)) {
+      return false;
+    }
+    return add(motor, src, dst, ml, route, error);
+  }
+
+  // Маршрут уже известен (RouteTable)
+  bool add(Motor* motor, Tank* src, Tank* dst, float ml, const Reservations::Request& route, String& error) {
+    if (jobs.size() >= (size_t)MAX_JOBS) {
+      error = "Dispense queue is full";
+      return false;
+    }
+    if (ml <= 0) {
+      error = "Invalid milliliters: " + String(ml);
+      return false;
+    }
+    Job job;
+    job.id = nextId;
+    job.motor = motor;
+    job.src = src;
+    job.dst = dst;
+    job.ml = ml;
+    job.state = QUEUED;
+    job.queuedAt = millis();
+    job.startedAt = 0;
+    job.pumpedAt = 0;
+    job.route = route;
+    job.route.motor = -1; // мотор занимает сам Motor::on
+    if (jobs.empty()) busySince = job.queuedAt;
+    jobs.push_back(job);
+    nextId++;
+    return true;
+  }
+
+  void clear() {
+    for (Job& job : jobs) {
+      if (job.state == PUMPING) job.motor->off();
+      if (job.state != QUEUED) Reservations::release(job.route);
+    }
+    if (!jobs.empty()) stats.busyMs += millis() - busySince;
+    jobs.clear();
+  }
+
+  // Снять задания, в которых участвует устройство (переконфигурация)
+  void cancel(const Device* device) {
+    size_t n = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+      Job& job = jobs[i];
+      bool uses = job.motor == device || job.src == device || job.dst == device;
+      for (int v = 0; v < 2; v++) {
+        if (job.route.valve[v] >= 0 && DeviceTable::owner[job.route.valve[v]] == device) uses = true;
+      }
+      if (!uses) {
+        jobs[n++] = job;
+        continue;
+      }
+      if (job.state == PUMPING) job.motor->off();
+      if (job.state != QUEUED) Reservations::release(job.route);
+    }
+    if (n == jobs.size()) return;
+    jobs.resize(n);
+    if (jobs.empty()) stats.busyMs += millis() - busySince;
+  }
+
+  bool empty() const { return jobs.empty(); }
+
+  void update() {
+    unsigned long now = millis();
+    bool prepositioned = false;
+    for (size_t i = 0; i < jobs.size(); i++) {
+      Job& job = jobs[i];
+      switch (job.state) {
+        case QUEUED:
+          if (!firstFor(job.motor, i, QUEUED)) break;
+          if (!Reservations::acquire(job.route)) {
+            // Только самое старое ждущее задание, иначе два задания дёргали бы общий клапан
+            if (!prepositioned) prepositionFree(job.route, now);
+            prepositioned = true;
+            break;
+          }
+          switchValves(job.route, now);
+          job.state = ROUTING;
+          // fallthrough
+        case ROUTING:
+          if (!firstFor(job.motor, i, ROUTING) || !settled(job.route, now)) break;
+          if (job.motor->isDeviceActive() || Reservations::isHeld(job.motor->getSlot())) break;
+          if (!job.motor->dispense(job.ml)) {
+            // Отказ (бак полон или источник пуст) не пройдёт сам: задание снимается,
+            // иначе оно повторялось бы каждый тик и держало маршрут и мотор
+            Console.at(ConsoleSink::L_ERROR).printf("Error: Dispense #%u failed, job dropped\n", job.id);
+            Reservations::release(job.route);
+            job.state = FAILED;
+            break;
+          }
+          if (!job.motor->isDeviceActive()) {
+            // Отложенный запуск не нужен: задание само повторит его следующим тиком
+            Reservations::cancel(job.motor->getSlot(), true);
+            break;
+          }
+          job.state = PUMPING;
+          job.startedAt = now;
+          break;
+        case PUMPING:
+          if (job.motor->isDeviceActive()) break;
+          job.state = TAIL;
+          job.pumpedAt = now;
+          break;
+        case TAIL:
+        case FAILED:
+          break;
+      }
+    }
+    // Завершённые после стекания удаляем, сохраняя порядок
+    size_t n = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+      Job& job = jobs[i];
+      if (job.state == FAILED) continue;
+      if (job.state == TAIL && now - job.pumpedAt >= TAIL_MS) {
+        Reservations::release(job.route);
+        record(job, now);
+        continue;
+      }
+      jobs[n++] = job;
+    }
+    if (n != jobs.size()) {
+      jobs.resize(n);
+      if (jobs.empty()) stats.busyMs += now - busySince;
+    }
+  }
+
+  void list(Print& out) const {
+    static const char* names[] = {"queued", "routing", "pumping", "tail", "failed"};
+    for (const Job& job : jobs) {
+      char buf[128];
+      snprintf(buf, sizeof(buf), "#%u %s %s -> %s %.2f ml %s", job.id, job.motor->getName().c_str(),
+               job.src ? job.src->getName().c_str() : "-", job.dst ? job.dst->getName().c_str() : "-",
+               job.ml, names[job.state]);
+      out.println(buf);
+    }
+  }
+
+  void printStats(Print& out) const {
+    uint64_t busy = stats.busyMs + (jobs.empty() ? 0 : millis() - busySince);
+    char buf[160];
+    snprintf(buf, sizeof(buf),
+             "{\"jobs\":%lu,\"ml\":%.2f,\"waitMs\":%lu,\"latencyMs\":%lu,\"maxLatencyMs\":%lu,\"perMin\":%.2f}",
+             (unsigned long)stats.jobs, stats.ml,
+             (unsigned long)(stats.jobs ? stats.waitMs / stats.jobs : 0),
+             (unsigned long)(stats.jobs ? stats.latencyMs / stats.jobs : 0),
+             (unsigned long)stats.maxLatencyMs, busy ? stats.jobs * 60000.0 / busy : 0.0);
+    out.println(buf);
+  }
+
+private:
+  std::vector<Job> jobs;
+  uint16_t nextId = 1;
+  unsigned long busySince = 0;
+  Stats stats;
+  unsigned long settleUntil[DeviceTable::SIZE + 1] = {0};
+
+  // Положение клапана (или постоянный бак мотора), которое ведёт к tank
+  static bool plan(Motor* motor, Tank* tank, Valve* valve, int side, Reservations::Request& route, String& error) {
+    if (!valve) {
+      Tank* fixed = side == 0 ? motor->getInTank() : motor->getOutTank();
+      if (tank == fixed) return true;
+      error = "No route from " + motor->getName() + " to " + (tank ? tank->getName() : String("-"));
+      return false;
+    }
+    route.valve[side] = valve->getSlot();
+    if (tank == valve->getOut1()) route.position[side] = 0;
+    else if (tank == valve->getOut2()) route.position[side] = 1;
+    else {
+      error = "No route through " + valve->getName() + " to " + (tank ? tank->getName() : String("-"));
+      return false;
+    }
+    return true;
+  }
+
+  // Задание - первое для своего мотора среди тех, что ещё не дошли до state
+  bool firstFor(Motor* motor, size_t idx, State state) const {
+    for (size_t i = 0; i < idx; i++) {
+      if (jobs[i].motor == motor && jobs[i].state <= state) return false;
+    }
+    return true;
+  }
+
+  void switchValve(int slot, int8_t position, unsigned long now) {
+    Device* valve = DeviceTable::owner[slot];
+    if (!valve || DeviceTable::active[slot] == (position == 1)) return;
+    if (position == 1) valve->on();
+    else valve->off();
+    settleUntil[slot] = now + SETTLE_MS;
+  }
+
+  void switchValves(const Reservations::Request& route, unsigned long now) {
+    for (int i = 0; i < 2; i++) {
+      if (route.valve[i] >= 0) switchValve(route.valve[i], route.position[i], now);
+    }
+  }
+
+  // Маршрут ещё занят, но никем не удерживаемые клапаны можно переключить заранее
+  void prepositionFree(const Reservations::Request& route, unsigned long now) {
+    for (int i = 0; i < 2; i++) {
+      int v = route.valve[i];
+      if (v >= 0 && !Reservations::isHeld(v)) switchValve(v, route.position[i], now);
+    }
+  }
+
+  bool settled(const Reservations::Request& route, unsigned long now) const {
+    for (int i = 0; i < 2; i++) {
+      int v = route.valve[i];
+      if (v >= 0 && (long)(now - settleUntil[v]) < 0) return false;
+    }
+    return true;
+  }
+
+  void record(const Job& job, unsigned long now) {
+    uint32_t latency = now - job.queuedAt;
+    stats.jobs++;
+    stats.ml += job.ml;
+    stats.waitMs += job.startedAt - job.queuedAt;
+    stats.latencyMs += latency;
+    if (latency > stats.maxLatencyMs) stats.maxLatencyMs = latency;
+  }
+};
+
+#endif
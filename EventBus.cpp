@@ -0,0 +1,39 @@
+// EventBus.cpp
+#include "EventBus.h"
+
+uint8_t EventBus::pending[DeviceTable::SIZE] = {0};
+int EventBus::pendingCount = 0;
+uint32_t EventBus::version = 0;
+EventSubscriber* EventBus::subscribers[MAX_SUBSCRIBERS] = {nullptr};
+
+bool EventBus::subscribe(EventSubscriber* subscriber) {
+  for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (subscribers[i] == subscriber) return true;
+  }
+  for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (!subscribers[i]) {
+      subscribers[i] = subscriber;
+      return true;
+    }
+  }
+  return false;
+}
+
+void EventBus::unsubscribe(EventSubscriber* subscriber) {
+  for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (subscribers[i] == subscriber) subscribers[i] = nullptr;
+  }
+}
+
+void EventBus::flush() {
+  if (pendingCount == 0) return;
+  // Подписчик может снова что-то опубликовать - это уйдёт следующим тиком
+  uint8_t changes[DeviceTable::SIZE];
+  int count = pendingCount;
+  memcpy(changes, pending, count);
+  memset(pending, 0, count);
+  pendingCount = 0;
+  for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (subscribers[i]) subscribers[i]->onDeviceChanges(changes, count);
+  }
+}
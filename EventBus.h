@@ -0,0 +1,50 @@
+// EventBus.h
+#ifndef EVENT_BUS_H
+#define EVENT_BUS_H
+
+#include <Arduino.h>
+#include <DeviceTable.h>
+
+// Что изменилось у устройства
+enum DeviceChange : uint8_t {
+  CHANGE_STATE = 1 << 0,  // on/off, длительности
+  CHANGE_LEVEL = 1 << 1,  // уровень бака
+  CHANGE_ROUTE = 1 << 2,  // активный бак клапана / мотора
+};
+
+class EventSubscriber {
+public:
+  virtual ~EventSubscriber() {}
+  // changes[slot] - маска DeviceChange, накопленная за тик; 0 - без изменений
+  virtual void onDeviceChanges(const uint8_t* changes, int count) = 0;
+};
+
+// Устройства публикуют изменения, а flush() в конце тика отдаёт их
+// каждому подписчику одним вызовом: составное действие (мотор + баки +
+// клапаны) превращается в одно исходящее сообщение.
+class EventBus {
+public:
+  static const int MAX_SUBSCRIBERS = 4;
+
+  static void publish(int slot, uint8_t change) {
+    version++;
+    if (slot < 0 || slot >= DeviceTable::SIZE) return;
+    pending[slot] |= change;
+    if (slot >= pendingCount) pendingCount = slot + 1;
+  }
+  static bool subscribe(EventSubscriber* subscriber);
+  static void unsubscribe(EventSubscriber* subscriber);
+  static bool hasPending() { return pendingCount > 0; }
+  // Растёт при любом изменении устройств; по нему кэшируется полный список
+  static uint32_t stateVersion() { return version; }
+  static void touch() { version++; }
+  static void flush();
+
+private:
+  static uint8_t pending[DeviceTable::SIZE];
+  static int pendingCount;
+  static uint32_t version;
+  static EventSubscriber* subscribers[MAX_SUBSCRIBERS];
+};
+
+#endif
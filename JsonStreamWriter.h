@@ -0,0 +1,184 @@
+// JsonStreamWriter.h
+#ifndef JSON_STREAM_WRITER_H
+#define JSON_STREAM_WRITER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WebSocketsServer.h>
+
+// Пишет JSON прямо в Print без промежуточного документа.
+// Числа с плавающей точкой и строки форматируются так же, как serializeJson.
+class JsonStreamWriter {
+public:
+  static const int MAX_DEPTH = 8;
+
+  explicit JsonStreamWriter(Print& out) : out(out) {}
+
+  void beginArray() { open('['); }
+  void endArray() { close(']'); }
+  void beginObject() { open('{'); }
+  void endObject() { close('}'); }
+
+  void key(const char* k) {
+    separator();
+    writeString(k);
+    out.write(':');
+    afterKey = true;
+  }
+
+  void value(const char* v) { separator(); writeString(v); }
+  void value(const String& v) { value(v.c_str()); }
+  void value(bool v) { separator(); out.write(v ? "true" : "false"); }
+  void value(int v) { value((long long)v); }
+  void value(long v) { value((long long)v); }
+  void value(unsigned int v) { value((unsigned long long)v); }
+  void value(unsigned long v) { value((unsigned long long)v); }
+  void value(long long v) {
+    separator();
+    if (v < 0) {
+      out.write('-');
+      writeUnsigned(0ULL - (unsigned long long)v);
+    } else {
+      writeUnsigned(v);
+    }
+  }
+  void value(unsigned long long v) { separator(); writeUnsigned(v); }
+  void value(float v) { value((double)v); }
+  void value(double v) {
+    separator();
+    // Формат дробных чисел берём у ArduinoJson, чтобы вывод совпадал байт в байт
+    StaticJsonDocument<16> number;
+    number.set(v);
+    serializeJson(number, out);
+  }
+
+  template <typename T>
+  void field(const char* k, const T& v) {
+    key(k);
+    value(v);
+  }
+
+private:
+  Print& out;
+  bool first[MAX_DEPTH] = {true};
+  int depth = 0;
+  bool afterKey = false;
+
+  void separator() {
+    if (afterKey) {
+      afterKey = false;
+      return;
+    }
+    if (depth > 0 && depth <= MAX_DEPTH) {
+      if (!first[depth - 1]) out.write(',');
+      first[depth - 1] = false;
+    }
+  }
+  void open(char c) {
+    separator();
+    out.write(c);
+    if (depth < MAX_DEPTH) first[depth] = true;
+    depth++;
+  }
+  void close(char c) {
+    if (depth > 0) depth--;
+    out.write(c);
+  }
+  void writeUnsigned(unsigned long long v) {
+    char buf[21];
+    int i = sizeof(buf);
+    do {
+      buf[--i] = '0' + v % 10;
+      v /= 10;
+    } while (v);
+    out.write((const uint8_t*)buf + i, sizeof(buf) - i);
+  }
+  void writeString(const char* s) {
+    out.write('"');
+    const char* run = s;
+    for (; *s; s++) {
+      char esc = 0;
+      switch (*s) {
+        case '"': esc = '"'; break;
+        case '\\': esc = '\\'; break;
+        case '\b': esc = 'b'; break;
+        case '\f': esc = 'f'; break;
+        case '\n': esc = 'n'; break;
+        case '\r': esc = 'r'; break;
+        case '\t': esc = 't'; break;
+      }
+      if (!esc) continue;
+      out.write((const uint8_t*)run, s - run);
+      out.write('\\');
+      out.write(esc);
+      run = s + 1;
+    }
+    out.write((const uint8_t*)run, s - run);
+    out.write('"');
+  }
+};
+
+// Переиспользуемый буфер кадра WebSocket: перед данными оставлено место под
+// заголовок, поэтому кадр уходит через sendTXT/broadcastTXT(..., true) без копии.
+class JsonOutBuffer : public Print {
+public:
+  static const size_t HEADROOM = WEBSOCKETS_MAX_HEADER_SIZE;
+
+  explicit JsonOutBuffer(size_t initial = 1024) { grow(initial); }
+  ~JsonOutBuffer() { free(buf); }
+  JsonOutBuffer(const JsonOutBuffer&) = delete;
+  JsonOutBuffer& operator=(const JsonOutBuffer&) = delete;
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* data, size_t n) override {
+    if (HEADROOM + len + n + 1 > cap && !grow(len + n)) {
+      overflowed = true;
+      return 0;
+    }
+    memcpy(buf + HEADROOM + len, data, n);
+    len += n;
+    buf[HEADROOM + len] = '\0';
+    return n;
+  }
+
+  void clear() {
+    len = 0;
+    overflowed = false;
+    if (buf) buf[HEADROOM] = '\0';
+  }
+  size_t length() const { return len; }
+  const char* c_str() const { return buf ? (const char*)buf + HEADROOM : ""; }
+  bool ok() const { return buf && !overflowed; }
+  // Начало буфера вместе с местом под заголовок - для headerToPayload = true
+  uint8_t* frame() { return buf; }
+
+  bool broadcast(WebSocketsServer& ws) {
+    if (!ok() || len == 0) return false;
+    return ws.broadcastTXT(buf, len, true);
+  }
+  bool send(WebSocketsServer& ws, uint8_t num) {
+    if (!ok() || len == 0) return false;
+    return ws.sendTXT(num, buf, len, true);
+  }
+
+private:
+  uint8_t* buf = nullptr;
+  size_t cap = 0;
+  size_t len = 0;
+  bool overflowed = false;
+
+  bool grow(size_t payload) {
+    size_t need = HEADROOM + payload + 1;
+    if (need <= cap) return true;
+    size_t next = cap ? cap : 256;
+    while (next < need) next *= 2;
+    uint8_t* p = (uint8_t*)realloc(buf, next);
+    if (!p) return false;
+    buf = p;
+    cap = next;
+    buf[HEADROOM + len] = '\0';
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,58 @@
+// LineAssembler.h
+#ifndef LINE_ASSEMBLER_H
+#define LINE_ASSEMBLER_H
+
+#include <Arduino.h>
+#include <Console.h>
+
+// Собирает строку команды из того, что уже пришло в Stream, без ожидания и без кучи.
+// Строка длиннее MAX_LINE отбрасывается целиком до следующего '\n'.
+class LineAssembler {
+public:
+  static const size_t MAX_LINE = 64;
+
+  // true - готова полная строка, она в line()/length() до следующего вызова
+  bool poll(Stream& in) {
+    if (ready) {
+      ready = false;
+      len = 0;
+    }
+    while (in.available() > 0) {
+      int c = in.read();
+      if (c < 0) break;
+      if (c == '\n') {
+        if (overflow) {
+          overflow = false;
+          len = 0;
+          dropped++;
+          Console.at(ConsoleSink::L_ERROR).printf("Error: Command too long, limit %u\n", (unsigned)MAX_LINE);
+          continue;
+        }
+        if (len > 0 && buf[len - 1] == '\r') len--;
+        buf[len] = '\0';
+        ready = true;
+        return true;
+      }
+      if (overflow) continue;
+      if (len >= MAX_LINE) {
+        overflow = true;
+        continue;
+      }
+      buf[len++] = (char)c;
+    }
+    return false;
+  }
+
+  const char* line() const { return buf; }
+  size_t length() const { return len; }
+  uint32_t droppedLines() const { return dropped; }
+
+private:
+  char buf[MAX_LINE + 1];
+  size_t len = 0;
+  bool ready = false;
+  bool overflow = false;
+  uint32_t dropped = 0;
+};
+
+#endif
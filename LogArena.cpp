@@ -0,0 +1,119 @@
+// LogArena.cpp
+#include "LogArena.h"
+#include "Device.h"
+#include "AllocStats.h"
+
+uint8_t LogArena::data[SIZE];
+size_t LogArena::used = 0;
+size_t LogArena::peak = 0;
+unsigned long LogArena::oldest = 0;
+uint32_t LogArena::flushes = 0;
+uint32_t LogArena::forced = 0;
+uint32_t LogArena::lostState = 0;
+size_t LogArena::usedAfterFlush = 0;
+LogArena::Account LogArena::accounts[DeviceTable::SIZE + 1];
+
+bool LogArena::append(int slot, Kind kind, const char* line, size_t len) {
+  size_t need = HEADER + len;
+  size_t limit = kind == K_DEBUG ? SIZE - STATE_RESERVE : SIZE;
+  if (slot < 0 || slot > DeviceTable::SIZE || need > limit) {
+    if (slot >= 0 && slot <= DeviceTable::SIZE) accounts[slot].dropped++;
+    return false;
+  }
+  if (used + need > limit) compact(false);
+  // Места нет: сначала жертвуем отладкой, для перехода состояния - ждём флеш
+  if (used + need > limit && kind != K_DEBUG) compact(true);
+  if (used + need > limit && kind == K_STATE) {
+    forced++;
+    flushAll();
+  }
+  if (used + need > limit) {
+    accounts[slot].dropped++;
+    if (kind == K_STATE) lostState++;
+    return false;
+  }
+
+  if (used == 0) oldest = millis();
+  uint8_t* rec = data + used;
+  rec[0] = slot;
+  rec[1] = kind;
+  rec[2] = len & 0xFF;
+  rec[3] = len >> 8;
+  memcpy(rec + HEADER, line, len);
+  used += need;
+  if (used > peak) peak = used;
+  accounts[slot].records++;
+  accounts[slot].bytes += need;
+  return true;
+}
+
+void LogArena::erase(size_t pos) {
+  Account& a = accounts[data[pos]];
+  a.records--;
+  a.bytes -= HEADER + length(pos);
+  data[pos] = FREE;
+}
+
+// Сдвигает живые записи к началу; dropDebug - заодно выкинуть отладочные
+void LogArena::compact(bool dropDebug) {
+  size_t out = 0;
+  for (size_t pos = 0; pos < used;) {
+    size_t size = HEADER + length(pos);
+    if (data[pos] != FREE && dropDebug && data[pos + 1] == K_DEBUG) {
+      accounts[data[pos]].dropped++;
+      erase(pos);
+    }
+    if (data[pos] != FREE) {
+      if (out != pos) memmove(data + out, data + pos, size);
+      out += size;
+    }
+    pos += size;
+  }
+  used = out;
+  if (used < usedAfterFlush) usedAfterFlush = used;
+}
+
+void LogArena::discard(int slot) {
+  take(slot, [](const char*, size_t) {});
+  accounts[slot].dropped = 0;
+}
+
+void LogArena::flushAll() {
+  AllocScope scope(AllocStats::S_FLUSH);
+  for (int slot = 0; slot <= DeviceTable::SIZE; slot++) {
+    if (!pending(slot)) continue;
+    Device* device = DeviceTable::owner[slot];
+    if (device) device->flushLogs();
+    else discard(slot);
+  }
+  flushes++;
+  usedAfterFlush = used;
+  // Что не ушло (флеш не открылся), ждёт следующего срока, а не каждого тика
+  if (used) oldest = millis();
+}
+
+void LogArena::update() {
+  if (used == 0) return;
+  bool full = used * 100 >= SIZE * FLUSH_FILL_PCT && used > usedAfterFlush;
+  if (full || millis() - oldest >= FLUSH_AGE_MS) flushAll();
+}
+
+void LogArena::printStats(Print& out) {
+  char buf[96];
+  snprintf(buf, sizeof(buf), "{\"used\":%u,\"size\":%u,\"peak\":%u,\"flushes\":%lu,\"forced\":%lu,\"lostState\":%lu",
+           (unsigned)used, (unsigned)SIZE, (unsigned)peak, (unsigned long)flushes, (unsigned long)forced,
+           (unsigned long)lostState);
+  out.print(buf);
+  out.print(",\"devices\":{");
+  bool first = true;
+  for (int slot = 0; slot < DeviceTable::size; slot++) {
+    Device* device = DeviceTable::owner[slot];
+    if (!device) continue;
+    const Account& a = accounts[slot];
+    snprintf(buf, sizeof(buf), "%s\"%s\":{\"records\":%u,\"bytes\":%u,\"dropped\":%lu}", first ? "" : ",",
+             device->getName().c_str(), a.records, a.bytes, (unsigned long)a.dropped);
+    out.print(buf);
+    first = false;
+  }
+  out.println("}}");
+}
@@ -0,0 +1,81 @@
+// LogArena.h
+#ifndef LOG_ARENA_H
+#define LOG_ARENA_H
+
+#include <Arduino.h>
+#include <DeviceTable.h>
+
+// Общий буфер журналов всех устройств фиксированного размера вместо
+// std::vector<String> у каждого. Запись: слот u8, вид u8, длина u16, строка JSON.
+// Сброс на флеш - при заполнении на FLUSH_FILL_PCT процентов или когда самая
+// старая запись ждёт дольше FLUSH_AGE_MS. Если флеш не успевает: отладочные
+// записи не занимают резерв STATE_RESERVE и вытесняются первыми, переходы
+// состояния не вытесняются никогда - перед ними буфер сбрасывается синхронно.
+class LogArena {
+public:
+  static const size_t SIZE = 8 * 1024;
+  static const size_t STATE_RESERVE = 2 * 1024;   // недоступно отладке
+  static const int FLUSH_FILL_PCT = 50;
+  static const unsigned long FLUSH_AGE_MS = 5 * 60 * 1000;
+  static const size_t HEADER = 4;
+  static const uint8_t FREE = 0xFF;               // слот стёртой записи
+
+  enum Kind : uint8_t { K_DEBUG, K_INFO, K_STATE };
+
+  struct Account {
+    uint16_t records;
+    uint16_t bytes;
+    uint32_t dropped;
+  };
+
+  static Kind kindOf(const String& type) {
+    if (type == "debug") return K_DEBUG;
+    if (type == "state") return K_STATE;
+    return K_INFO;
+  }
+
+  // false - запись потеряна (учтена в dropped)
+  static bool append(int slot, Kind kind, const char* line, size_t len);
+  static bool pending(int slot) { return accounts[slot].records > 0; }
+
+  // Отдать записи слота в fn(line, len) от старых к новым и освободить место
+  template <typename F>
+  static void take(int slot, F fn) {
+    for (size_t pos = 0; pos < used; pos += HEADER + length(pos)) {
+      if (data[pos] != slot) continue;
+      fn((const char*)data + pos + HEADER, length(pos));
+      erase(pos);
+    }
+    compact(false);
+  }
+  template <typename F>
+  static void each(int slot, F fn) {
+    for (size_t pos = 0; pos < used; pos += HEADER + length(pos)) {
+      if (data[pos] == slot) fn((const char*)data + pos + HEADER, length(pos));
+    }
+  }
+  // Выбросить записи слота и обнулить его учёт (устройство удаляется)
+  static void discard(int slot);
+
+  // Из цикла: сброс по заполнению или возрасту
+  static void update();
+  static void flushAll();
+  static void printStats(Print& out);
+
+private:
+  static uint8_t data[SIZE];
+  static size_t used;
+  static size_t peak;
+  static unsigned long oldest;   // millis() первой записи после сброса
+  static uint32_t flushes;
+  static uint32_t forced;        // синхронные сбросы ради записи состояния
+  static uint32_t lostState;     // только если флеш не принимает вовсе
+  static size_t usedAfterFlush;
+  static Account accounts[DeviceTable::SIZE + 1];
+
+  static size_t length(size_t pos) { return data[pos + 2] | (data[pos + 3] << 8); }
+  static void erase(size_t pos);
+  static void compact(bool dropDebug);
+};
+
+#endif
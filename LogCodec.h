@@ -0,0 +1,383 @@
+// LogCodec.h
+#ifndef LOG_CODEC_H
+#define LOG_CODEC_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <vector>
+
+// Compact on-flash log encoding.
+//
+// A segment starts with "DLG" + version and is a stream of records:
+//   0x01 STR    varint len, bytes               - next dictionary string
+//   0x02 SHAPE  varint type, name, message,     - next record shape
+//               u8 fields (0 = no extra, 0xFF = raw extra, n+1 = n fields),
+//               n * (varint key, u8 value tag)
+//   0x80|s      event with shape s: zigzag varint time delta, then values
+//
+// Strings (names, types, messages, keys, string values) are stored once per
+// segment, so an event is just a shape byte, a time delta and its values.
+// Every segment is self-contained and can be decoded front to back.
+
+class LogCodec {
+public:
+  static const uint8_t VERSION = 1;
+  static const uint8_t TAG_STR = 0x01;
+  static const uint8_t TAG_SHAPE = 0x02;
+  static const uint8_t TAG_EVENT = 0x80;
+  static const uint8_t MAX_SHAPES = 0x80;
+  static const uint16_t MAX_STRINGS = 255;
+  static const uint8_t MAX_FIELDS = 8;
+  static const uint8_t FIELDS_RAW = 0xFF;
+  static const size_t HEADER_SIZE = 4;
+
+  enum ValueTag : uint8_t { V_NULL, V_BOOL, V_INT, V_TREL, V_FLOAT, V_STR, V_JSON };
+
+  struct Shape {
+    uint16_t type;
+    uint16_t name;
+    uint16_t message;
+    uint8_t fields;
+    uint16_t key[MAX_FIELDS];
+    uint8_t tag[MAX_FIELDS];
+  };
+
+  static void writeHeader(Print& out) {
+    const uint8_t header[HEADER_SIZE] = {'D', 'L', 'G', VERSION};
+    out.write(header, HEADER_SIZE);
+  }
+  static bool readHeader(Stream& in) {
+    uint8_t header[HEADER_SIZE];
+    if (in.readBytes((char*)header, HEADER_SIZE) != HEADER_SIZE) return false;
+    return header[0] == 'D' && header[1] == 'L' && header[2] == 'G' && header[3] == VERSION;
+  }
+
+  static size_t writeVarint(Print& out, uint64_t v) {
+    uint8_t buf[10];
+    size_t n = 0;
+    do {
+      uint8_t b = v & 0x7F;
+      v >>= 7;
+      buf[n++] = v ? (b | 0x80) : b;
+    } while (v);
+    return out.write(buf, n);
+  }
+  static bool readVarint(Stream& in, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      int b = in.read();
+      if (b < 0) return false;
+      v |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) return true;
+    }
+    return false;
+  }
+  static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+  static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+  // Epoch-like integers (autoTimeOff etc.) are stored relative to the event time
+  static bool isEpochMillis(int64_t v) { return v >= 1000000000000LL; }
+};
+
+// Segment state shared by the encoder and the decoder
+class LogCodecState {
+public:
+  std::vector<String> dict;
+  std::vector<LogCodec::Shape> shapes;
+  int64_t lastTime = 0;
+
+  void reset() {
+    dict.clear();
+    shapes.clear();
+    lastTime = 0;
+  }
+};
+
+class LogDecoder {
+public:
+  LogCodecState state;
+
+  // Reads records until the next event and rebuilds it as the original log line.
+  // Returns false at end of segment or on a damaged record.
+  bool next(Stream& in, JsonDocument& line) {
+    while (true) {
+      int tag = in.read();
+      if (tag < 0) return false;
+      if (tag == LogCodec::TAG_STR) {
+        if (!readString(in)) return false;
+      } else if (tag == LogCodec::TAG_SHAPE) {
+        if (!readShape(in)) return false;
+      } else if (tag & LogCodec::TAG_EVENT) {
+        return readEvent(in, tag & 0x7F, line);
+      } else {
+        return false;
+      }
+    }
+  }
+
+private:
+  bool readString(Stream& in) {
+    uint64_t len;
+    if (!LogCodec::readVarint(in, len) || len > 512) return false;
+    char buf[513];
+    if (in.readBytes(buf, len) != len) return false;
+    buf[len] = '\0';
+    state.dict.push_back(String(buf));
+    return true;
+  }
+  bool readIndex(Stream& in, uint16_t& idx) {
+    uint64_t v;
+    if (!LogCodec::readVarint(in, v) || v >= state.dict.size()) return false;
+    idx = v;
+    return true;
+  }
+  bool readShape(Stream& in) {
+    LogCodec::Shape s;
+    if (!readIndex(in, s.type) || !readIndex(in, s.name) || !readIndex(in, s.message)) return false;
+    int fields = in.read();
+    if (fields < 0) return false;
+    s.fields = fields;
+    if (s.fields != LogCodec::FIELDS_RAW) {
+      if (s.fields > LogCodec::MAX_FIELDS + 1) return false;
+      for (int i = 0; i + 1 < s.fields; i++) {
+        int t;
+        if (!readIndex(in, s.key[i]) || (t = in.read()) < 0) return false;
+        s.tag[i] = t;
+      }
+    }
+    state.shapes.push_back(s);
+    return true;
+  }
+  template <typename K>
+  bool readValue(Stream& in, uint8_t tag, int64_t time, JsonObject dest, const K& key) {
+    uint64_t v;
+    switch (tag) {
+      case LogCodec::V_NULL:
+        dest[key] = nullptr;
+        return true;
+      case LogCodec::V_BOOL: {
+        int b = in.read();
+        if (b < 0) return false;
+        dest[key] = b != 0;
+        return true;
+      }
+      case LogCodec::V_INT:
+        if (!LogCodec::readVarint(in, v)) return false;
+        dest[key] = LogCodec::unzigzag(v);
+        return true;
+      case LogCodec::V_TREL:
+        if (!LogCodec::readVarint(in, v)) return false;
+        dest[key] = time + LogCodec::unzigzag(v);
+        return true;
+      case LogCodec::V_FLOAT: {
+        double d;
+        if (in.readBytes((char*)&d, sizeof(d)) != sizeof(d)) return false;
+        dest[key] = d;
+        return true;
+      }
+      case LogCodec::V_STR: {
+        uint16_t idx;
+        if (!readIndex(in, idx)) return false;
+        dest[key] = state.dict[idx];
+        return true;
+      }
+      case LogCodec::V_JSON: {
+        uint16_t idx;
+        if (!readIndex(in, idx)) return false;
+        dest[key] = serialized(state.dict[idx]);
+        return true;
+      }
+    }
+    return false;
+  }
+  bool readEvent(Stream& in, uint8_t shapeIdx, JsonDocument& line) {
+    if (shapeIdx >= state.shapes.size()) return false;
+    const LogCodec::Shape& s = state.shapes[shapeIdx];
+    uint64_t dt;
+    if (!LogCodec::readVarint(in, dt)) return false;
+    int64_t time = state.lastTime + LogCodec::unzigzag(dt);
+    state.lastTime = time;
+
+    line.clear();
+    line["time"] = (uint64_t)time;
+    line["type"] = state.dict[s.type];
+    line["name"] = state.dict[s.name];
+    line["message"] = state.dict[s.message];
+    if (s.fields == 0) return true;
+    if (s.fields == LogCodec::FIELDS_RAW) {
+      return readValue(in, LogCodec::V_JSON, time, line.as<JsonObject>(), "extra");
+    }
+    JsonObject extra = line.createNestedObject("extra");
+    for (int i = 0; i + 1 < s.fields; i++) {
+      if (!readValue(in, s.tag[i], time, extra, state.dict[s.key[i]])) return false;
+    }
+    return true;
+  }
+};
+
+class LogEncoder {
+public:
+  LogCodecState state;
+  size_t bytes = 0;     // размер текущего сегмента
+  bool loaded = false;  // состояние восстановлено из файла
+
+  void begin(Print& out) {
+    state.reset();
+    LogCodec::writeHeader(out);
+    bytes = LogCodec::HEADER_SIZE;
+    loaded = true;
+  }
+
+  // Appends one log line. Returns false without writing anything when the
+  // segment dictionary is full and the caller has to start a new segment.
+  bool append(Print& out, JsonObject line) {
+    int64_t time = line["time"].as<int64_t>();
+    uint8_t tags[LogCodec::MAX_FIELDS];
+    JsonObject extra = line["extra"];
+    bool raw = false;
+    uint8_t fields = 0;
+    if (!extra.isNull()) {
+      fields = 1;
+      for (JsonPair kv : extra) {
+        if (fields > LogCodec::MAX_FIELDS) {
+          raw = true;
+          break;
+        }
+        tags[fields - 1] = valueTag(kv.value(), time);
+        fields++;
+      }
+    } else if (!line["extra"].isNull()) {
+      raw = true;
+    }
+    if (raw) fields = LogCodec::FIELDS_RAW;
+
+    // Худший случай: type, name, message, ключи и строковые значения
+    if (state.dict.size() + 3 + 2 * LogCodec::MAX_FIELDS > LogCodec::MAX_STRINGS ||
+        state.shapes.size() >= LogCodec::MAX_SHAPES) {
+      return false;
+    }
+
+    LogCodec::Shape s;
+    s.type = intern(out, line["type"].as<const char*>());
+    s.name = intern(out, line["name"].as<const char*>());
+    s.message = intern(out, line["message"].as<const char*>());
+    s.fields = fields;
+    if (!raw && fields > 0) {
+      int i = 0;
+      for (JsonPair kv : extra) {
+        s.key[i] = intern(out, kv.key().c_str());
+        s.tag[i] = tags[i];
+        i++;
+      }
+    }
+    uint8_t shapeIdx = shape(out, s);
+
+    // Строковые значения добавляем в словарь до записи события
+    String rawExtra;
+    uint16_t strIdx[LogCodec::MAX_FIELDS];
+    if (raw) {
+      serializeJson(line["extra"], rawExtra);
+      strIdx[0] = intern(out, rawExtra.c_str());
+    } else if (fields > 0) {
+      int i = 0;
+      for (JsonPair kv : extra) {
+        if (s.tag[i] == LogCodec::V_STR) strIdx[i] = intern(out, kv.value().as<const char*>());
+        if (s.tag[i] == LogCodec::V_JSON) {
+          String json;
+          serializeJson(kv.value(), json);
+          strIdx[i] = intern(out, json.c_str());
+        }
+        i++;
+      }
+    }
+
+    uint8_t head = LogCodec::TAG_EVENT | shapeIdx;
+    bytes += out.write(head);
+    bytes += LogCodec::writeVarint(out, LogCodec::zigzag(time - state.lastTime));
+    state.lastTime = time;
+    if (raw) {
+      bytes += LogCodec::writeVarint(out, strIdx[0]);
+    } else if (fields > 0) {
+      int i = 0;
+      for (JsonPair kv : extra) {
+        writeValue(out, s.tag[i], kv.value(), time, strIdx[i]);
+        i++;
+      }
+    }
+    return true;
+  }
+
+private:
+  static uint8_t valueTag(JsonVariant v, int64_t time) {
+    if (v.isNull()) return LogCodec::V_NULL;
+    if (v.is<bool>()) return LogCodec::V_BOOL;
+    if (v.is<int64_t>()) {
+      int64_t i = v.as<int64_t>();
+      return LogCodec::isEpochMillis(i) && LogCodec::isEpochMillis(time) ? LogCodec::V_TREL : LogCodec::V_INT;
+    }
+    if (v.is<double>()) return LogCodec::V_FLOAT;
+    if (v.is<const char*>()) return LogCodec::V_STR;
+    return LogCodec::V_JSON;
+  }
+
+  void writeValue(Print& out, uint8_t tag, JsonVariant v, int64_t time, uint16_t strIdx) {
+    switch (tag) {
+      case LogCodec::V_BOOL:
+        bytes += out.write((uint8_t)(v.as<bool>() ? 1 : 0));
+        break;
+      case LogCodec::V_INT:
+        bytes += LogCodec::writeVarint(out, LogCodec::zigzag(v.as<int64_t>()));
+        break;
+      case LogCodec::V_TREL:
+        bytes += LogCodec::writeVarint(out, LogCodec::zigzag(v.as<int64_t>() - time));
+        break;
+      case LogCodec::V_FLOAT: {
+        double d = v.as<double>();
+        bytes += out.write((const uint8_t*)&d, sizeof(d));
+        break;
+      }
+      case LogCodec::V_STR:
+      case LogCodec::V_JSON:
+        bytes += LogCodec::writeVarint(out, strIdx);
+        break;
+    }
+  }
+
+  uint16_t intern(Print& out, const char* str) {
+    if (!str) str = "";
+    for (size_t i = 0; i < state.dict.size(); i++) {
+      if (state.dict[i] == str) return i;
+    }
+    size_t len = strlen(str);
+    if (len > 512) len = 512;
+    bytes += out.write(LogCodec::TAG_STR);
+    bytes += LogCodec::writeVarint(out, len);
+    bytes += out.write((const uint8_t*)str, len);
+    state.dict.push_back(String(str).substring(0, len));
+    return state.dict.size() - 1;
+  }
+
+  uint8_t shape(Print& out, const LogCodec::Shape& s) {
+    int n = s.fields == LogCodec::FIELDS_RAW ? 0 : (s.fields > 0 ? s.fields - 1 : 0);
+    for (size_t i = 0; i < state.shapes.size(); i++) {
+      const LogCodec::Shape& o = state.shapes[i];
+      if (o.type != s.type || o.name != s.name || o.message != s.message || o.fields != s.fields) continue;
+      bool same = true;
+      for (int f = 0; f < n && same; f++) same = o.key[f] == s.key[f] && o.tag[f] == s.tag[f];
+      if (same) return i;
+    }
+    bytes += out.write(LogCodec::TAG_SHAPE);
+    bytes += LogCodec::writeVarint(out, s.type);
+    bytes += LogCodec::writeVarint(out, s.name);
+    bytes += LogCodec::writeVarint(out, s.message);
+    bytes += out.write(s.fields);
+    for (int f = 0; f < n; f++) {
+      bytes += LogCodec::writeVarint(out, s.key[f]);
+      bytes += out.write(s.tag[f]);
+    }
+    state.shapes.push_back(s);
+    return state.shapes.size() - 1;
+  }
+};
+
+#endif
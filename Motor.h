@@ -4,15 +4,119 @@
 #include <Device.h>
 #include <Tank.h>
 #include <Valve.h>
+#include <Reservations.h>
+#include <PinTrace.h>
 
 class Motor : public Device {
 protected:
-  float millisecondsPerMl;
+  float& millisecondsPerMl; // DeviceTable::msPerMl[slot]
   Tank* inTank; // Опциональный танк для входа (drain)
   Tank* outTank; // Опциональный танк для выхода (fill)
   
   Valve* inValve; // Опциональный входной клапан
   Valve* outValve;// Опциональный выходной клапан
+
+  Reservations::Request reservation; // что занято текущим запуском
+  bool reserved = false;
+
+  // Дозирование в две фазы: основной объём на полной скважности с millisecondsPerMl,
+  // последние fineMl - на fineDuty % со своей скоростью fineMsPerMl (M_CALIBRATE)
+  struct Profile {
+    float fineMl;       // 0 - одна фаза, выход без ШИМ
+    float fineMsPerMl;
+    uint8_t fineDuty;   // %
+  };
+  static const int PWM_CHANNELS = 16;
+  static const int PWM_FREQ = 5000;
+  static const int PWM_BITS = 8;
+  // 2^bits у LEDC - постоянный уровень; 2^bits - 1 всё ещё даёт импульс в каждом периоде
+  static const uint32_t PWM_FULL = 1 << PWM_BITS;
+  Profile profile = {0, 0, 0};
+  int pwmChannel = -1;
+  // Дозирование, которое ждёт запуска (on() может быть отложен Reservations)
+  float planMl = 0;
+  unsigned long planMs = 0;
+  unsigned long planFastMs = 0;
+  // Текущее дозирование
+  float targetMl = 0;     // 0 - обычный запуск на время
+  bool fine = false;
+  uint64_t fineStart = 0;
+  float fastMl = 0;       // прокачано до медленной фазы
+
+  static uint16_t& pwmUsed() {
+    static uint16_t used = 0;
+    return used;
+  }
+  bool twoPhase() const { return profile.fineMl > 0 && pwmChannel >= 0; }
+
+  void attachPwm() {
+    if (pwmChannel >= 0 || pin <= 0) return;
+    for (int ch = 0; ch < PWM_CHANNELS; ch++) {
+      if (pwmUsed() & (1 << ch)) continue;
+      pwmUsed() |= 1 << ch;
+      pwmChannel = ch;
+      ledcSetup(ch, PWM_FREQ, PWM_BITS);
+      ledcAttachPin(pin, ch);
+      writePin(isActive);
+      return;
+    }
+    log("Error", "No free PWM channel");
+  }
+  void detachPwm() {
+    if (pwmChannel < 0) return;
+    ledcDetachPin(pin);
+    pwmUsed() &= ~(1 << pwmChannel);
+    pwmChannel = -1;
+    pinMode(pin, OUTPUT);
+    writePin(isActive);
+  }
+  void writeDuty(uint8_t percent) {
+    uint32_t duty = percent * PWM_FULL / 100;
+    ledcWrite(pwmChannel, activeHigh ? duty : PWM_FULL - duty);
+  }
+  // С ШИМ выход ведёт LEDC: digitalWrite на подключённом к нему пине не действует
+  void writePin(bool on) override {
+    if (pwmChannel < 0) {
+      Device::writePin(on);
+      return;
+    }
+    writeDuty(on ? 100 : 0);
+    PinTrace::edge(pin, on == activeHigh, slot);
+  }
+
+  // Ключ NVS ограничен 15 символами - хеш имени, как у статистики
+  String profileKey() const { return prefsKey("dp", name); }
+  void loadProfile() {
+    String key = profileKey();
+    if (prefs.getBytesLength(key.c_str()) == sizeof(profile)) prefs.getBytes(key.c_str(), &profile, sizeof(profile));
+  }
+
+  // <fineMl>,<duty %>,<fineMsPerMl>; "0" - выключить
+  bool calibrate(const String& param) {
+    float fineMl = 0, fineMsPerMl = 0;
+    int duty = 0;
+    int n = sscanf(param.c_str(), "%f,%d,%f", &fineMl, &duty, &fineMsPerMl);
+    bool disable = n == 1 && fineMl == 0;
+    if (!disable && (n != 3 || fineMl <= 0 || duty < 1 || duty > 99 || fineMsPerMl <= millisecondsPerMl)) {
+      log("Error", "Invalid calibration: " + param);
+      return false;
+    }
+    if (isActive) {
+      log("Error", "Busy, stop the motor first");
+      return false;
+    }
+    if (disable) {
+      profile = {0, 0, 0};
+      prefs.remove(profileKey().c_str());
+      detachPwm();
+    } else {
+      profile = {fineMl, fineMsPerMl, (uint8_t)duty};
+      prefs.putBytes(profileKey().c_str(), &profile, sizeof(profile));
+      attachPwm();
+    }
+    EventBus::publish(slot, CHANGE_STATE);
+    return true;
+  }
   
   bool validateMilliliters(const String& param, float& milliliters) {
     if (param.isEmpty()) {
@@ -30,43 +134,37 @@ protected:
 
 public:
   Motor(String deviceName, int pin, float msPerMl, int btnPin = -1, Tank* in = nullptr, Tank* out = nullptr, Valve* inV = nullptr, Valve* outV = nullptr)
-        : Device(deviceName, pin, btnPin), millisecondsPerMl(msPerMl), inTank(in), outTank(out), inValve(inV), outValve(outV) {if (msPerMl <= 0) {
+        : Device(deviceName, pin, btnPin), millisecondsPerMl(DeviceTable::msPerMl[slot]), inTank(in), outTank(out), inValve(inV), outValve(outV) {
+    DeviceTable::type[slot] = DeviceType::MOTOR;
+    millisecondsPerMl = msPerMl;
+    if (msPerMl <= 0) {
       log("Error", "Invalid msPerMl: " + String(msPerMl));
       millisecondsPerMl = 1.0;
     }
-    if (inTank) {
-      inTank->setMillisecondsPerMl(millisecondsPerMl);
-      inTank->setIn(true); // Устанавливаем флаг входа
-    }
-    
-    if (outTank) {
-      outTank->setMillisecondsPerMl(millisecondsPerMl);
-      outTank->setIn(false); // Устанавливаем флаг входа
-    }
-    if (inValve) {
-      inValve->getOut1()->setMillisecondsPerMl(millisecondsPerMl);
-      inValve->getOut1()->setIn(true);
-      inValve->getOut2()->setMillisecondsPerMl(millisecondsPerMl);
-      inValve->getOut2()->setIn(true);
-      inValve->motor_name = deviceName;
-      inValve->in = true;
-      setInTank(inValve->getOut1());
-    }
-    if (outValve) {
-      outValve->getOut1()->setMillisecondsPerMl(millisecondsPerMl);
-      outValve->getOut2()->setMillisecondsPerMl(millisecondsPerMl);
-      outValve->motor_name = deviceName;
-      setOutTank(outValve->getOut1());
+    link(in, out, inV, outV);
+  }
+  ~Motor() {
+    if (reserved) Reservations::release(reservation);
+    if (pwmChannel >= 0) {
+      ledcDetachPin(pin);
+      pwmUsed() &= ~(1 << pwmChannel);
     }
   }
+  void begin() override {
+    Device::begin();
+    loadProfile();
+    if (profile.fineMl > 0) attachPwm();
+  }
   float getActiveDurationMl() const {
     if (!isActive) return 0;
     unsigned long duration_ms = getActiveDuration();
-    float ml = duration_ms / millisecondsPerMl;
+    float ml = fine ? fastMl + (getCurrentUtcMillis() - fineStart) / profile.fineMsPerMl
+                    : duration_ms / millisecondsPerMl;
     return roundf(ml * 100) / 100.0f;
   }
   float getDurationMl() const {
     if (!isActive) return 0;
+    if (targetMl > 0) return roundf(targetMl * 100) / 100.0f;
     unsigned long duration_ms = getDurationMs();
     float ml = duration_ms / millisecondsPerMl;
 
@@ -86,6 +184,39 @@ public:
     }
     return outTank; 
   }
+  // Привязка к бакам и клапанам; вызывается из конструктора и при переконфигурации
+  void link(Tank* in, Tank* out, Valve* inV, Valve* outV) {
+    inTank = in;
+    outTank = out;
+    inValve = inV;
+    outValve = outV;
+    if (inTank) {
+      inTank->setMillisecondsPerMl(millisecondsPerMl);
+      inTank->setIn(true); // Устанавливаем флаг входа
+    }
+    
+    if (outTank) {
+      outTank->setMillisecondsPerMl(millisecondsPerMl);
+      outTank->setIn(false); // Устанавливаем флаг входа
+    }
+    if (inValve) {
+      inValve->getOut1()->setMillisecondsPerMl(millisecondsPerMl);
+      inValve->getOut1()->setIn(true);
+      inValve->getOut2()->setMillisecondsPerMl(millisecondsPerMl);
+      inValve->getOut2()->setIn(true);
+      inValve->motor_name = name;
+      inValve->motorSlot = slot;
+      inValve->in = true;
+      setInTank(inValve->getOut1());
+    }
+    if (outValve) {
+      outValve->getOut1()->setMillisecondsPerMl(millisecondsPerMl);
+      outValve->getOut2()->setMillisecondsPerMl(millisecondsPerMl);
+      outValve->motor_name = name;
+      outValve->motorSlot = slot;
+      setOutTank(outValve->getOut1());
+    }
+  }
   Valve* getInValve() const { return inValve; }
   Valve* getOutValve() const { return outValve; }
   void setInValve(Valve* valve) {
@@ -116,6 +247,7 @@ public:
   void setMillisecondsPerMl(float msPerMl) {
     if (msPerMl > 0) {
       millisecondsPerMl = msPerMl;
+      EventBus::publish(slot, CHANGE_STATE);
       //StaticJsonDocument<1> dummyDoc;
       //fileLog("debug", "set millisecondsPerMl="+String(millisecondsPerMl), dummyDoc.to<JsonObject>(), true); 
     } else {
@@ -124,34 +256,65 @@ public:
   }
 
   float getMillisecondsPerMl() const { return millisecondsPerMl; }
+  // Поток, ещё не зачтённый в баки: с начала запуска или со смены фазы
+  uint64_t getFlowStart() const { return fine ? fineStart : timeOn; }
+  float getFlowMsPerMl() const { return fine ? profile.fineMsPerMl : millisecondsPerMl; }
+  float getTargetMl() const { return targetMl; }
+  // Зачтено в баки при смене фазы (finePhase)
+  float getCreditedMl() const { return fine ? fastMl : 0; }
 
-  void dispense(float milliliters) {
+  // false - запрос неверен или мотор отказался запускаться (предел бака)
+  bool dispense(float milliliters) {
     if (milliliters <= 0 || millisecondsPerMl <= 0) {
       log("Error", "Invalid dispense request");
-      return;
+      return false;
     }
-    unsigned long duration = (unsigned long)(milliliters * millisecondsPerMl);
-    if (duration > 0xFFFFFFF0) {
-      log("Error", "Duration too large: " + String(duration));
-      return;
+    // Быстрая фаза - всё, кроме последних fineMl; меньший объём целиком медленно
+    float fast = !twoPhase() ? milliliters : milliliters > profile.fineMl ? milliliters - profile.fineMl : 0;
+    double total = (double)fast * millisecondsPerMl + (double)(milliliters - fast) * profile.fineMsPerMl;
+    if (total > 0xFFFFFFF0) {
+      log("Error", "Duration too large: " + String(total));
+      return false;
     }
-    on(duration);
+    unsigned long duration = (unsigned long)total;
+    planMl = twoPhase() ? milliliters : 0;
+    planMs = duration;
+    planFastMs = (unsigned long)(fast * millisecondsPerMl);
+    return on(duration);
+  }
+
+  // Срок DeviceTable::phaseAt: скважность снижается, остаток считается от
+  // фактически прокачанного, чтобы опоздание тика не сбивало объём
+  void finePhase(uint64_t now) {
+    DeviceTable::phaseAt[slot] = 0;
+    if (!isActive || targetMl <= 0 || !twoPhase()) return;
+    fastMl = (now - timeOn) / millisecondsPerMl;
+    fine = true;
+    fineStart = now;
+    writeDuty(profile.fineDuty);
+    float left = targetMl - fastMl;
+    autoTimeOff = now + (left > 0 ? (uint64_t)(left * profile.fineMsPerMl) : 0);
+    duration_ms = autoTimeOff - timeOn;
+    // Баки зачитывают прокачанное на полной скорости, дальше поток медленнее
+    if (getInTank()) getInTank()->changeFlowRate(slot, profile.fineMsPerMl, now);
+    if (getOutTank()) getOutTank()->changeFlowRate(slot, profile.fineMsPerMl, now);
+    EventBus::publish(slot, CHANGE_STATE);
   }
 
   bool handleCommand(const String& cmd, const String& param) override {
     if (cmd == "M_ON") {
       unsigned long milliseconds;
       if (!validateMilliseconds(param, milliseconds)) return false;
-      on(milliseconds);
-      return true;
+      return on(milliseconds);
     } else if (cmd == "M_OFF") {
+      // Отложенный запуск после явной остановки не выполняется
+      Reservations::cancel(slot, true);
       off();
       return true;
     } else if (cmd == "M_DISPENSE") {
       float milliliters;
       if (!validateMilliliters(param, milliliters)) return false;
-      dispense(milliliters);
-      return true;
+      return dispense(milliliters);
     } else if (cmd == "M_SET_MSPERML") {
       float msPerMl = param.toFloat();
       if (msPerMl <= 0) {
@@ -161,9 +324,14 @@ public:
       setMillisecondsPerMl(msPerMl);
       log("Set msPerMl", String(msPerMl));
       return true;
+    } else if (cmd == "M_CALIBRATE") {
+      if (!calibrate(param)) return false;
+      log("Calibrated", profileText());
+      return true;
     } else if (cmd == "M_STATUS") {
       log("Status", "active=" + String(isActive ? "Yes" : "No") +
                     ", msPerMl=" + String(millisecondsPerMl) +
+                    ", " + profileText() +
                     ", timeOn=" + formatTime(timeOn) +
                     ", timeOff=" + formatTime(timeOff) +
                     ", activeDuration=" + String(getActiveDuration()) + " ms");
@@ -174,120 +342,85 @@ public:
   }
 
   String getStatus() const override {
-    return Device::getStatus() + ", msPerMl=" + String(millisecondsPerMl);
+    return Device::getStatus() + ", msPerMl=" + String(millisecondsPerMl) + ", " + profileText();
+  }
+  String profileText() const {
+    if (profile.fineMl <= 0) return "fine=off";
+    return "fine=" + String(profile.fineMl) + "ml@" + String(profile.fineDuty) + "%," +
+           String(profile.fineMsPerMl) + "ms/ml" + (pwmChannel < 0 ? " (no PWM)" : "");
   }
 
-  void on(unsigned long duration = 0) override {
-    
-    if (getInTank()) {
-      //inTank->setDeviceActive(true);
-      getInTank()->on();
+  // Мотор, его клапаны в текущем положении; баки не блокируются
+  Reservations::Request resources() const {
+    Reservations::Request r;
+    r.motor = slot;
+    if (inValve) {
+      r.valve[0] = inValve->getSlot();
+      r.position[0] = inValve->isDeviceActive() ? 1 : 0;
     }
-    if (getOutTank()) {
-      getOutTank()->on();
+    if (outValve) {
+      r.valve[1] = outValve->getSlot();
+      r.position[1] = outValve->isDeviceActive() ? 1 : 0;
     }
-    Device::on(duration);
-
-
-
-    StaticJsonDocument<4096> doc;
-    JsonArray arr = doc.to<JsonArray>();
-    JsonObject md = arr.createNestedObject();
-    md["n"] = name;
-    md["t"] = "MOTOR";
-    md["a"] = true;
-
-    const auto duration_s = getDurationMs();
-    const auto activeDur = getActiveDuration();
-    md["dms"] = duration_s;
-    md["ams"] = activeDur;
-    md["lms"] = (duration_s > 0) ? (duration_s - activeDur) : 0;
-
-    md["it"] = getInTank() ? getInTank()->getName() : "";
-    md["ot"] = getOutTank() ? getOutTank()->getName() : "";
+    return r;
+  }
 
-    const float d_ml = getDurationMl();
-    const float ad_ml = getActiveDurationMl();
-    md["dml"] = d_ml;
-    md["aml"] = ad_ml;
-    md["lml"] = (d_ml > 0) ? (d_ml - ad_ml) : 0;
+  // Бак назначения уже полон или источник пуст (у баков с ёмкостью), с учётом текущих потоков
+  bool tankLimitReached() const {
+    Tank* out = getOutTank();
+    Tank* in = getInTank();
+    if (out && out->getCapacity() > 0 && out->getCurrentLevel() + out->getActiveDurationMl() >= out->getCapacity())
+      return true;
+    return in && in->getCapacity() > 0 && in->getCurrentLevel() + in->getActiveDurationMl() <= 0;
+  }
 
-    if (getInTank()) {
-      JsonObject it = arr.createNestedObject();
-      it["n"] = getInTank()->getName();
-      it["t"] = "TANK";
-      it["a"] = true;
-      it["cl"] = getInTank()->getCurrentLevel() + getInTank()->getActiveDurationMl();
+  bool on(unsigned long duration = 0) override {
+    // Предел проверяется до пина и журнала: мотор не включается и сразу не выключается
+    if (tankLimitReached()) {
+      log("Error", "Tank limit reached, not starting");
+      planMl = 0;
+      return false;
     }
-    if (getOutTank()) {
-      JsonObject ot = arr.createNestedObject();
-      ot["n"] = getOutTank()->getName();
-      ot["a"] = true;
-      ot["t"] = "TANK";
-      ot["cl"] = getOutTank()->getCurrentLevel() + getOutTank()->getActiveDurationMl();
+    // Мотор занят своим же запуском или ресурсы у другого - запуск ждёт в очереди
+    Reservations::Request r = resources();
+    if (reserved || !Reservations::acquire(r)) {
+      deferOp(true, duration);
+      return true;
     }
-    String socketStr;
-    serializeJson(doc, socketStr);
-    webSocket.sendTXT(clientNum, socketStr);
+    reservation = r;
+    reserved = true;
+    Device::on(duration);
+    // Своё ли это дозирование (или отложенное им же), или запуск на время
+    bool planned = planMl > 0 && duration == planMs && twoPhase();
+    targetMl = planned ? planMl : 0;
+    fine = planned && planFastMs == 0;
+    fastMl = 0;
+    fineStart = timeOn;
+    DeviceTable::phaseAt[slot] = planned && planFastMs ? timeOn + planFastMs : 0;
+    planMl = 0;
+    if (fine) writeDuty(profile.fineDuty);
+    float rate = fine ? profile.fineMsPerMl : millisecondsPerMl;
+    if (getInTank()) getInTank()->beginFlow(slot, rate, false, timeOn);
+    if (getOutTank()) getOutTank()->beginFlow(slot, rate, true, timeOn);
+    // Мотор и оба бака уйдут клиентам одним кадром через EventBus
+    return true;
   }
 
   void off() override{
-    float amount = getActiveDuration() / millisecondsPerMl;
-    amount = roundf(amount * 100) / 100.0;
-    const auto duration = getActiveDuration();
-    const float d_ml = getActiveDuration() / millisecondsPerMl;
-    Device::off();
-
-    if (getInTank()) {
-      getInTank()->drain(amount);
-      getInTank()->setDeviceActive(false);
-      getInTank()->off();
-      //inTank->update();
-    }
-    if (getOutTank()) {
-      getOutTank()->fill(amount);
-      getOutTank()->setDeviceActive(false);
-      getOutTank()->off();
-      //outTank->update();
+    uint64_t now = getCurrentUtcMillis();
+    // Объём по фазам: у двухфазного дозирования скорости разные
+    stop(getActiveDurationMl());
+    DeviceTable::phaseAt[slot] = 0;
+    targetMl = 0;
+    fine = false;
+    // Каждый бак считает объём по своему потоку, при равных start/now он совпадает
+    if (getInTank()) getInTank()->endFlow(slot, now);
+    if (getOutTank()) getOutTank()->endFlow(slot, now);
+    if (reserved) {
+      Reservations::release(reservation);
+      reserved = false;
     }
     lastUpdateTime = 0;
-    
-    StaticJsonDocument<4096> doc;
-    JsonArray arr = doc.to<JsonArray>();
-    JsonObject md = arr.createNestedObject();
-    md["n"] = name;
-    md["t"] = "MOTOR";
-
-    const auto duration_s = getDurationMs();
-    const auto activeDur = getActiveDuration();
-    md["dms"] = duration_s;
-    md["ams"] = activeDur;
-    md["lms"] = (duration_s > 0) ? (duration_s - activeDur) : 0;
-
-    md["it"] = getInTank() ? getInTank()->getName() : "";
-    md["ot"] = getOutTank() ? getOutTank()->getName() : "";
-
-    const float d_ml1 = getDurationMl();
-    const float ad_ml = getActiveDurationMl();
-    md["dml"] = d_ml1;
-    md["aml"] = ad_ml;
-    md["lml"] = (d_ml1 > 0) ? (d_ml1 - ad_ml) : 0;
-
-    if (getInTank()) {
-      JsonObject it = arr.createNestedObject();
-      it["n"] = getInTank()->getName();
-      it["t"] = "TANK";
-      it["cl"] = getInTank()->getCurrentLevel() + getInTank()->getActiveDurationMl();
-    }
-    if (getOutTank()) {
-      JsonObject ot = arr.createNestedObject();
-      ot["n"] = getOutTank()->getName();
-      ot["t"] = "TANK";
-      ot["cl"] = getOutTank()->getCurrentLevel() + getOutTank()->getActiveDurationMl();
-    }
-    String socketStr;
-    serializeJson(doc, socketStr);
-    webSocket.sendTXT(clientNum, socketStr);
   }
 
   void update() override {
@@ -302,6 +435,12 @@ public:
     context["autoTimeOff"] = formatTime(autoTimeOff);
     context["activeDuration"] = getActiveDuration();
     context["millisecondsPerMl"] = getMillisecondsPerMl();
+    if (profile.fineMl > 0) {
+      context["fineMl"] = profile.fineMl;
+      context["fineDuty"] = profile.fineDuty;
+      context["fineMsPerMl"] = profile.fineMsPerMl;
+    }
+    if (targetMl > 0) context["phase"] = fine ? "fine" : "fast";
     if (inTank) context["inTank"] = inTank->getName();
     if (outTank) context["outTank"] = outTank->getName();
   }
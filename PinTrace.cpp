@@ -0,0 +1,135 @@
+// PinTrace.cpp
+#include "PinTrace.h"
+#include "DeviceTable.h"
+#include "Device.h"
+
+PinTrace::Event PinTrace::events[SIZE];
+int PinTrace::head = 0;
+int PinTrace::count = 0;
+bool PinTrace::recording = false;
+PinTrace::Cause PinTrace::cause = PinTrace::C_OTHER;
+uint32_t PinTrace::causeUs = 0;
+PinTrace::Latency PinTrace::latency[CAUSES] = {};
+
+PinCause::PinCause(PinTrace::Cause cause, int slot, uint32_t lateUs)
+    : savedCause(PinTrace::cause), savedUs(PinTrace::causeUs) {
+  PinTrace::cause = cause;
+  PinTrace::causeUs = micros() - lateUs;
+  if (!PinTrace::recording) return;
+  PinTrace::Event e = {PinTrace::causeUs, PinTrace::MARK, (uint8_t)cause, -1, 0, (uint8_t)(slot < 0 ? 0xFF : slot)};
+  PinTrace::push(e);
+}
+
+void PinTrace::start() {
+  clear();
+  recording = true;
+}
+
+void PinTrace::clear() {
+  head = 0;
+  count = 0;
+  memset(latency, 0, sizeof(latency));
+}
+
+void PinTrace::push(const Event& e) {
+  events[(head + count) % SIZE] = e;
+  if (count < SIZE) count++;
+  else head = (head + 1) % SIZE;
+}
+
+void PinTrace::edge(int pin, bool level, int slot) {
+  uint32_t now = micros();
+  if (cause != C_OTHER) {
+    Latency& l = latency[cause];
+    uint32_t us = now - causeUs;
+    l.edges++;
+    l.sumUs += us;
+    if (us > l.maxUs) l.maxUs = us;
+  }
+  if (!recording) return;
+  Event e = {now, EDGE, (uint8_t)cause, (int8_t)pin, (uint8_t)level, (uint8_t)slot};
+  push(e);
+}
+
+void PinTrace::printStats(Print& out) {
+  char buf[96];
+  snprintf(buf, sizeof(buf), "{\"recording\":%s,\"events\":%d,\"latency\":{", recording ? "true" : "false", count);
+  out.print(buf);
+  bool first = true;
+  for (int i = 1; i < CAUSES; i++) {
+    const Latency& l = latency[i];
+    if (!l.edges) continue;
+    snprintf(buf, sizeof(buf), "%s\"%s\":{\"edges\":%lu,\"avgUs\":%lu,\"maxUs\":%lu}", first ? "" : ",",
+             causeName(i), (unsigned long)l.edges, (unsigned long)(l.sumUs / l.edges), (unsigned long)l.maxUs);
+    out.print(buf);
+    first = false;
+  }
+  out.println("}}");
+}
+
+// Идентификаторы VCD - печатные символы с '!'; 0 - причина, дальше пины
+static char vcdId(int index) { return (char)('!' + index); }
+
+void PinTrace::exportVcd(Print& out) {
+  int8_t pins[SIZE];
+  uint8_t slots[SIZE];
+  int numPins = 0;
+  for (int i = 0; i < count; i++) {
+    const Event& e = events[(head + i) % SIZE];
+    if (e.kind != EDGE) continue;
+    int k = 0;
+    while (k < numPins && pins[k] != e.pin) k++;
+    if (k == numPins) {
+      pins[numPins] = e.pin;
+      slots[numPins++] = e.slot;
+    }
+  }
+
+  out.println("$version PinTrace $end");
+  out.println("$timescale 1us $end");
+  out.println("$scope module pins $end");
+  out.printf("$var integer 8 %c cause $end\n", vcdId(0));
+  for (int k = 0; k < numPins; k++) {
+    Device* d = slots[k] < DeviceTable::SIZE ? DeviceTable::owner[slots[k]] : nullptr;
+    String name = d ? d->getName() : String("");
+    name.replace(' ', '_');
+    out.printf("$var wire 1 %c gpio%d%s%s $end\n", vcdId(k + 1), pins[k], name.length() ? "_" : "", name.c_str());
+  }
+  out.println("$upscope $end");
+  out.println("$enddefinitions $end");
+  out.println("#0");
+  out.println("$dumpvars");
+  out.printf("b0 %c\n", vcdId(0));
+  for (int k = 0; k < numPins; k++) out.printf("x%c\n", vcdId(k + 1));
+  out.println("$end");
+
+  // Время от первого события; разности по модулю 2^32 переживают переполнение micros()
+  uint64_t t = 0;
+  uint64_t lastT = 0;
+  uint32_t prevUs = count ? events[head].us : 0;
+  uint8_t lastCause = 0;
+  for (int i = 0; i < count; i++) {
+    const Event& e = events[(head + i) % SIZE];
+    // Причина с задним числом (просроченный дедлайн) не уводит время назад
+    if ((int32_t)(e.us - prevUs) > 0) {
+      t += (uint32_t)(e.us - prevUs);
+      prevUs = e.us;
+    }
+    if (t != lastT) {
+      out.printf("#%llu\n", (unsigned long long)t);
+      lastT = t;
+    }
+    if (e.cause != lastCause) {
+      out.print('b');
+      for (int bit = 7; bit >= 0; bit--) out.print((e.cause >> bit) & 1 ? '1' : '0');
+      out.print(' ');
+      out.println(vcdId(0));
+      lastCause = e.cause;
+    }
+    if (e.kind != EDGE) continue;
+    int k = 0;
+    while (pins[k] != e.pin) k++;
+    out.print(e.level ? '1' : '0');
+    out.println(vcdId(k + 1));
+  }
+}
@@ -0,0 +1,77 @@
+// PinTrace.h
+#ifndef PIN_TRACE_H
+#define PIN_TRACE_H
+
+#include <Arduino.h>
+
+// Запись переключений выходов с точностью до микросекунды. Каждый фронт
+// помнит причину (команда, автоотключение, кнопка, ...) и время, когда она
+// возникла, поэтому задержка "причина -> digitalWrite" считается всегда,
+// а с PIN_TRACE start ещё и пишется в кольцо на SIZE событий, которое
+// выгружается в VCD для GTKWave: провод на пин и целое "cause" на причины.
+class PinTrace {
+public:
+  static const int SIZE = 512;
+
+  enum Cause : uint8_t { C_OTHER, C_COMMAND, C_DEADLINE, C_LIMIT, C_BUTTON, C_SCHEDULE, C_QUEUE, C_REMOTE, C_BOOT, CAUSES };
+  enum Kind : uint8_t { EDGE, MARK };
+
+  struct Event {
+    uint32_t us;      // micros()
+    uint8_t kind;
+    uint8_t cause;
+    int8_t pin;
+    uint8_t level;
+    uint8_t slot;
+  };
+
+  struct Latency {
+    uint32_t edges;
+    uint32_t sumUs;
+    uint32_t maxUs;
+  };
+
+  static void start();
+  static void stop() { recording = false; }
+  static void clear();
+  static bool isRecording() { return recording; }
+
+  static void edge(int pin, bool level, int slot);
+  static void printStats(Print& out);
+  static void exportVcd(Print& out);
+
+  static const char* causeName(int cause) {
+    static const char* names[CAUSES] = {"other", "command", "deadline", "limit", "button",
+                                        "schedule", "queue", "remote", "boot"};
+    return names[cause];
+  }
+
+private:
+  friend class PinCause;
+  static Event events[SIZE];
+  static int head;
+  static int count;
+  static bool recording;
+  static Cause cause;
+  static uint32_t causeUs;
+  static Latency latency[CAUSES];
+
+  static void push(const Event& e);
+};
+
+// Причина переключений внутри блока; lateUs - насколько причина старше
+// момента создания (просроченный autoTimeOff), задержка считается от неё.
+class PinCause {
+public:
+  PinCause(PinTrace::Cause cause, int slot = -1, uint32_t lateUs = 0);
+  ~PinCause() {
+    PinTrace::cause = savedCause;
+    PinTrace::causeUs = savedUs;
+  }
+
+private:
+  PinTrace::Cause savedCause;
+  uint32_t savedUs;
+};
+
+#endif
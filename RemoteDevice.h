@@ -0,0 +1,109 @@
+// RemoteDevice.h
+#ifndef REMOTE_DEVICE_H
+#define REMOTE_DEVICE_H
+
+#include <Device.h>
+#include <EventBus.h>
+#include <RemoteLink.h>
+
+// Устройство на другом контроллере. on/off/команды уходят пиру через RemoteLink,
+// состояние берётся из кеша, который обновляют ответы и опрос раз в POLL_MS.
+// Локально ничего не переключается, автоотключение считает сам пир.
+class RemoteDevice : public Device {
+public:
+  RemoteDevice(String deviceName, const String& host, const String& remoteName, uint16_t port = RemoteLink::PORT)
+      : Device(deviceName, -1, -1, true), host(host), remoteName(remoteName.length() ? remoteName : deviceName),
+        port(port) {
+    DeviceTable::type[slot] = DeviceType::REMOTE;
+    if (!peer.fromString(host)) log("Error", "Invalid host " + host);
+    RemoteLink::attach(this);
+  }
+  ~RemoteDevice() override { RemoteLink::detach(this); }
+
+  DeviceType getDeviceType() const override { return DeviceType::REMOTE; }
+
+  // Без Device::begin(): его off() выключил бы устройство на пире при каждой загрузке
+  void begin() override {
+    loadStats();
+    RemoteLink::request(this, RemoteLink::OP_STATUS, 0);
+  }
+  bool on(unsigned long duration = 0) override {
+    RemoteLink::request(this, RemoteLink::OP_ON, duration);
+    return true;
+  }
+  void off() override { RemoteLink::request(this, RemoteLink::OP_OFF); }
+
+  bool handleCommand(const String& cmd, const String& param) override {
+    RemoteLink::request(this, RemoteLink::OP_COMMAND, 0, param.length() ? cmd + " " + param : cmd);
+    return true;
+  }
+
+  const IPAddress& getPeer() const { return peer; }
+  uint16_t getPort() const { return port; }
+  const String& getHost() const { return host; }
+  const String& getRemoteName() const { return remoteName; }
+  uint32_t getVersion() const { return cached.version; }
+  bool isOnline() const { return online; }
+  bool hasLevel() const { return cached.type == (uint8_t)DeviceType::TANK; }
+  float getLevel() const { return cached.level; }
+
+  // Ответ пира: status - RemoteLink::Status
+  void apply(uint8_t status, const RemoteLink::State& state) {
+    bool changed = !online;
+    online = true;
+    if (status == RemoteLink::ST_UNKNOWN) {
+      if (!unknownLogged) log("Error", "Unknown on " + host + ": " + remoteName);
+      unknownLogged = true;
+      return;
+    }
+    unknownLogged = false;
+    cached.version = state.version;
+    if (status == RemoteLink::ST_OK) {
+      changed = changed || state.active != isActive || state.level != cached.level ||
+                state.durationMs != duration_ms;
+      cached = state;
+      uint64_t now = getCurrentUtcMillis();
+      isActive = state.active;
+      timeOn = state.active ? now - state.activeMs : timeOn;
+      if (!state.active && changed) timeOff = now;
+      duration_ms = state.durationMs;
+    }
+    if (changed) EventBus::publish(slot, CHANGE_STATE);
+  }
+
+  // Пир не ответил за все попытки. Состояние остаётся последним известным:
+  // недоставленный OFF не значит, что устройство на пире остановлено
+  void lost(uint8_t op) {
+    if (op != RemoteLink::OP_STATUS)
+      log("Error", String(RemoteLink::opName(op)) + " not delivered to " + host + ", state unknown");
+    cached.version = 0; // следующий опрос вернёт полное состояние
+    if (!online) return;
+    online = false;
+    log("Warning", "No response from " + host);
+    EventBus::publish(slot, CHANGE_STATE);
+  }
+
+  String getStatus() const override {
+    return String(online ? "online" : "offline") + ", version=" + String(cached.version) + ", " +
+           Device::getStatus();
+  }
+
+  void setContext(JsonObject& context) const override {
+    context["host"] = host;
+    context["remote"] = remoteName;
+    context["online"] = online;
+  }
+
+  unsigned long lastPoll = 0;
+
+private:
+  String host;
+  String remoteName;
+  uint16_t port;
+  IPAddress peer;
+  RemoteLink::State cached = {};
+  bool online = false;
+  bool unknownLogged = false;
+};
+
+#endif
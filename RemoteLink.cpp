@@ -0,0 +1,269 @@
+// RemoteLink.cpp
+#include "RemoteLink.h"
+#include "RemoteDevice.h"
+#include "DeviceTable.h"
+#include "Tank.h"
+#include "EventBus.h"
+#include "Console.h"
+#include "PinTrace.h"
+#include <algorithm>
+
+WiFiUDP RemoteLink::udp;
+bool RemoteLink::started = false;
+uint16_t RemoteLink::nextSeq = 1;
+uint32_t RemoteLink::session = 0;
+std::vector<RemoteDevice*> RemoteLink::devices;
+std::vector<RemoteLink::Batch> RemoteLink::open;
+std::vector<RemoteLink::Batch> RemoteLink::inflight;
+RemoteLink::Served RemoteLink::served[MAX_SERVED];
+int RemoteLink::servedNext = 0;
+RemoteLink::Counters RemoteLink::stats = {};
+
+void RemoteLink::begin(uint16_t port) {
+  if (started) return;
+  session = esp_random();
+  started = udp.begin(port);
+  if (!started) Console.at(ConsoleSink::L_ERROR).printf("Error: Cannot open UDP port %u\n", port);
+}
+
+void RemoteLink::attach(RemoteDevice* device) {
+  devices.push_back(device);
+}
+
+void RemoteLink::detach(RemoteDevice* device) {
+  devices.erase(std::remove(devices.begin(), devices.end(), device), devices.end());
+  // Ответы для удалённого устройства просто пропустим
+  for (std::vector<Batch>* list : {&open, &inflight}) {
+    for (Batch& b : *list) {
+      for (int i = 0; i < b.ops; i++)
+        if (b.devices[i] == device) b.devices[i] = nullptr;
+    }
+  }
+}
+
+void RemoteLink::writeHeader(std::vector<uint8_t>& out, Kind kind, uint16_t seq, uint32_t session) {
+  out.push_back('R');
+  out.push_back('D');
+  out.push_back((uint8_t)VERSION);
+  out.push_back((uint8_t)kind);
+  put(out, seq);
+  put(out, session);
+}
+
+void RemoteLink::request(RemoteDevice* device, Op op, uint32_t arg, const String& text) {
+  const String& name = device->getRemoteName();
+  size_t need = 1 + 1 + name.length() + 4 + 1 + text.length();
+  if (name.length() > 255 || text.length() > 255 || HEADER + need > MAX_PACKET) return;
+
+  Batch* batch = nullptr;
+  for (Batch& b : open) {
+    if (b.peer == device->getPeer() && b.port == device->getPort()) batch = &b;
+  }
+  // Не влезает - текущая уходит сразу, начинаем следующую
+  if (batch && (batch->ops == MAX_OPS || batch->data.size() + need > MAX_PACKET)) {
+    Batch full = *batch;
+    open.erase(open.begin() + (batch - open.data()));
+    send(full);
+    batch = nullptr;
+  }
+  if (!batch) {
+    open.push_back(Batch());
+    batch = &open.back();
+    batch->peer = device->getPeer();
+    batch->port = device->getPort();
+    batch->seq = 0;
+    batch->ops = 0;
+    batch->sentAt = 0;
+    batch->tries = 0;
+    batch->data.reserve(MAX_PACKET);
+    writeHeader(batch->data, REQUEST, 0, session);
+  }
+  std::vector<uint8_t>& out = batch->data;
+  out.push_back(op);
+  out.push_back(name.length());
+  out.insert(out.end(), name.c_str(), name.c_str() + name.length());
+  put(out, arg);
+  out.push_back(text.length());
+  out.insert(out.end(), text.c_str(), text.c_str() + text.length());
+  batch->devices[batch->ops] = device;
+  batch->opCodes[batch->ops++] = op;
+  device->lastPoll = millis();
+  stats.ops++;
+}
+
+void RemoteLink::send(Batch& batch) {
+  if (!started) return;
+  if (batch.tries == 0) {
+    batch.seq = nextSeq++;
+    memcpy(batch.data.data() + 4, &batch.seq, 2);
+  }
+  udp.beginPacket(batch.peer, batch.port);
+  udp.write(batch.data.data(), batch.data.size());
+  udp.endPacket();
+  batch.sentAt = millis();
+  batch.tries++;
+  stats.sent++;
+  if (batch.tries == 1) inflight.push_back(batch);
+}
+
+void RemoteLink::update() {
+  if (!started) return;
+  receive();
+
+  unsigned long now = millis();
+  for (RemoteDevice* d : devices) {
+    if (now - d->lastPoll >= POLL_MS) request(d, OP_STATUS, d->getVersion());
+  }
+
+  // Повторы и потери
+  size_t n = 0;
+  for (size_t i = 0; i < inflight.size(); i++) {
+    Batch& b = inflight[i];
+    if (now - b.sentAt >= RETRY_MS) {
+      if (b.tries < MAX_TRIES) {
+        stats.retries++;
+        send(b);
+      } else {
+        stats.lost++;
+        for (int k = 0; k < b.ops; k++)
+          if (b.devices[k]) b.devices[k]->lost(b.opCodes[k]);
+        continue;
+      }
+    }
+    if (n != i) inflight[n] = inflight[i];
+    n++;
+  }
+  inflight.resize(n);
+
+  // Новые датаграммы - не больше MAX_INFLIGHT в полёте, остальные ждут следующего тика
+  size_t sent = 0;
+  for (; sent < open.size() && inflight.size() < (size_t)MAX_INFLIGHT; sent++) send(open[sent]);
+  open.erase(open.begin(), open.begin() + sent);
+}
+
+void RemoteLink::receive() {
+  uint8_t buf[MAX_PACKET];
+  for (int size = udp.parsePacket(); size > 0; size = udp.parsePacket()) {
+    int len = udp.read(buf, sizeof(buf));
+    if (len < (int)HEADER || buf[0] != 'R' || buf[1] != 'D' || buf[2] != VERSION) continue;
+    if (buf[3] == REQUEST) serve(buf, len, udp.remoteIP(), udp.remotePort());
+    else if (buf[3] == RESPONSE) complete(buf, len, udp.remoteIP());
+  }
+}
+
+static Device* findLocal(const char* name, size_t len) {
+  for (int slot = 0; slot < DeviceTable::size; slot++) {
+    Device* d = DeviceTable::owner[slot];
+    if (!d) continue;
+    String n = d->getName();
+    if (n.length() == len && memcmp(n.c_str(), name, len) == 0) return d;
+  }
+  return nullptr;
+}
+
+void RemoteLink::serve(const uint8_t* data, size_t len, IPAddress peer, uint16_t port) {
+  uint16_t seq;
+  uint32_t from;
+  memcpy(&seq, data + 4, 2);
+  memcpy(&from, data + 6, 4);
+  // Повтор уже выполненного запроса - тот же ответ, без повторного on()/off()
+  for (Served& s : served) {
+    if (!s.data.empty() && s.seq == seq && s.session == from && s.peer == peer) {
+      udp.beginPacket(peer, port);
+      udp.write(s.data.data(), s.data.size());
+      udp.endPacket();
+      return;
+    }
+  }
+
+  std::vector<uint8_t> out;
+  out.reserve(HEADER + MAX_OPS * 19);
+  writeHeader(out, RESPONSE, seq, from);
+  size_t pos = HEADER;
+  while (pos < len) {
+    uint8_t op, nameLen, textLen;
+    uint32_t arg;
+    if (!get(data, len, pos, op) || !get(data, len, pos, nameLen) || pos + nameLen > len) break;
+    const char* name = (const char*)data + pos;
+    pos += nameLen;
+    if (!get(data, len, pos, arg) || !get(data, len, pos, textLen) || pos + textLen > len) break;
+    String text;
+    text.concat((const char*)data + pos, textLen);
+    pos += textLen;
+
+    Device* device = findLocal(name, nameLen);
+    PinCause cause(PinTrace::C_REMOTE, device ? device->getSlot() : -1);
+    if (device && op == OP_ON) device->on(arg);
+    else if (device && op == OP_OFF) device->off();
+    else if (device && op == OP_COMMAND) {
+      int space = text.indexOf(' ');
+      device->handleCommand(space < 0 ? text : text.substring(0, space), space < 0 ? String("") : text.substring(space + 1));
+    }
+
+    uint32_t version = EventBus::stateVersion();
+    Status status = !device ? ST_UNKNOWN : op == OP_STATUS && arg == version ? ST_NOT_MODIFIED : ST_OK;
+    out.push_back(status);
+    put(out, version);
+    if (status != ST_OK) continue;
+    out.push_back((uint8_t)device->getDeviceType());
+    out.push_back(device->isDeviceActive() ? 1 : 0);
+    put(out, (uint32_t)device->getActiveDuration());
+    put(out, (uint32_t)device->getDurationMs());
+    float level = device->getDeviceType() == DeviceType::TANK ? static_cast<Tank*>(device)->getCurrentLevel() : 0;
+    put(out, level);
+  }
+
+  udp.beginPacket(peer, port);
+  udp.write(out.data(), out.size());
+  udp.endPacket();
+  stats.served++;
+  Served& s = served[servedNext];
+  servedNext = (servedNext + 1) % MAX_SERVED;
+  s.peer = peer;
+  s.session = from;
+  s.seq = seq;
+  s.data.swap(out);
+}
+
+void RemoteLink::complete(const uint8_t* data, size_t len, IPAddress peer) {
+  uint16_t seq;
+  uint32_t to;
+  memcpy(&seq, data + 4, 2);
+  memcpy(&to, data + 6, 4);
+  if (to != session) return; // ответ на запрос до нашей перезагрузки
+  for (size_t i = 0; i < inflight.size(); i++) {
+    Batch& b = inflight[i];
+    if (b.seq != seq || !(b.peer == peer)) continue;
+    size_t pos = HEADER;
+    for (int k = 0; k < b.ops; k++) {
+      uint8_t status;
+      State state = {};
+      if (!get(data, len, pos, status) || !get(data, len, pos, state.version)) break;
+      if (status == ST_OK) {
+        uint8_t active;
+        if (!get(data, len, pos, state.type) || !get(data, len, pos, active) ||
+            !get(data, len, pos, state.activeMs) || !get(data, len, pos, state.durationMs) ||
+            !get(data, len, pos, state.level)) {
+          break;
+        }
+        state.active = active;
+      } else if (status == ST_NOT_MODIFIED) {
+        stats.notModified++;
+      }
+      if (b.devices[k]) b.devices[k]->apply(status, state);
+    }
+    inflight.erase(inflight.begin() + i);
+    return;
+  }
+}
+
+void RemoteLink::printStats(Print& out) {
+  char buf[160];
+  snprintf(buf, sizeof(buf),
+           "{\"devices\":%u,\"sent\":%lu,\"ops\":%lu,\"retries\":%lu,\"lost\":%lu,\"served\":%lu,\"notModified\":%lu,"
+           "\"inflight\":%u}",
+           (unsigned)devices.size(), (unsigned long)stats.sent, (unsigned long)stats.ops,
+           (unsigned long)stats.retries, (unsigned long)stats.lost, (unsigned long)stats.served,
+           (unsigned long)stats.notModified, (unsigned)inflight.size());
+  out.println(buf);
+}
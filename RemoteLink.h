@@ -0,0 +1,122 @@
+// RemoteLink.h
+#ifndef REMOTE_LINK_H
+#define REMOTE_LINK_H
+
+#include <Arduino.h>
+#include <WiFiUdp.h>
+#include <vector>
+
+class RemoteDevice;
+
+// Двоичный RPC между контроллерами по UDP. Каждая плата и клиент, и сервер.
+// Запросы RemoteDevice к одному пиру за тик собираются в одну датаграмму,
+// датаграммы отправляются не дожидаясь ответов на предыдущие (до MAX_INFLIGHT),
+// потерянные повторяются; сервер по тому же seq отдаёт сохранённый ответ, не
+// выполняя операцию второй раз. Состояние удалённого устройства кешируется с
+// версией (EventBus::stateVersion пира): если она не изменилась, на опрос
+// приходит только NOT_MODIFIED.
+//
+// Датаграмма: "RD", версия u8, вид u8 (REQUEST/RESPONSE), seq u16, сессия u32, операции.
+// Сессия - случайное число клиента на каждую загрузку, ответ её повторяет: после
+// перезагрузки seq начинается заново, и кеш повторов пира не должен их спутать.
+// Операция запроса: op u8, длина имени u8, имя, arg u32, длина текста u8, текст.
+// Ответ на операцию: статус u8, версия u32; при ST_OK ещё тип u8, активно u8,
+// прошло мс u32, задано мс u32, уровень f32.
+class RemoteLink {
+public:
+  static const uint16_t PORT = 4210;
+  static const uint8_t VERSION = 2;
+  static const size_t HEADER = 10;
+  static const size_t MAX_PACKET = 512;
+  static const int MAX_OPS = 16;          // операций в датаграмме
+  static const int MAX_INFLIGHT = 8;
+  static const int MAX_SERVED = 4;        // кеш ответов для повторов
+  static const unsigned long RETRY_MS = 250;
+  static const uint8_t MAX_TRIES = 3;
+  static const unsigned long POLL_MS = 1000;
+
+  enum Kind : uint8_t { REQUEST = 1, RESPONSE = 2 };
+  enum Op : uint8_t { OP_STATUS, OP_ON, OP_OFF, OP_COMMAND };
+  enum Status : uint8_t { ST_OK, ST_NOT_MODIFIED, ST_UNKNOWN };
+
+  struct State {
+    uint32_t version;
+    uint8_t type;
+    bool active;
+    uint32_t activeMs;
+    uint32_t durationMs;
+    float level;
+  };
+
+  struct Counters {
+    uint32_t sent;
+    uint32_t ops;
+    uint32_t retries;
+    uint32_t lost;
+    uint32_t served;
+    uint32_t notModified;
+  };
+
+  static void begin(uint16_t port = PORT);
+  static void attach(RemoteDevice* device);
+  static void detach(RemoteDevice* device);
+  // Ставит операцию в датаграмму пира; уйдёт в update()
+  static void request(RemoteDevice* device, Op op, uint32_t arg = 0, const String& text = "");
+  static void update();
+  static void printStats(Print& out);
+  static const char* opName(uint8_t op) {
+    static const char* names[] = {"STATUS", "ON", "OFF", "COMMAND"};
+    return op <= OP_COMMAND ? names[op] : "?";
+  }
+
+private:
+  struct Batch {
+    IPAddress peer;
+    uint16_t port;
+    uint16_t seq;
+    std::vector<uint8_t> data;
+    RemoteDevice* devices[MAX_OPS];
+    uint8_t opCodes[MAX_OPS];
+    uint8_t ops;
+    unsigned long sentAt;
+    uint8_t tries;
+  };
+  struct Served {
+    IPAddress peer;
+    uint32_t session;
+    uint16_t seq;
+    std::vector<uint8_t> data;
+  };
+
+  static WiFiUDP udp;
+  static bool started;
+  static uint16_t nextSeq;
+  static uint32_t session;
+  static std::vector<RemoteDevice*> devices;
+  static std::vector<Batch> open;
+  static std::vector<Batch> inflight;
+  static Served served[MAX_SERVED];
+  static int servedNext;
+  static Counters stats;
+
+  static void send(Batch& batch);
+  static void receive();
+  static void serve(const uint8_t* data, size_t len, IPAddress peer, uint16_t port);
+  static void complete(const uint8_t* data, size_t len, IPAddress peer);
+  static void writeHeader(std::vector<uint8_t>& out, Kind kind, uint16_t seq, uint32_t session);
+
+  template <typename T>
+  static void put(std::vector<uint8_t>& out, T v) {
+    const uint8_t* p = (const uint8_t*)&v;
+    out.insert(out.end(), p, p + sizeof(T));
+  }
+  template <typename T>
+  static bool get(const uint8_t* data, size_t len, size_t& pos, T& v) {
+    if (pos + sizeof(T) > len) return false;
+    memcpy(&v, data + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+};
+
+#endif
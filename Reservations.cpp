@@ -0,0 +1,89 @@
+// Reservations.cpp
+#include "Reservations.h"
+#include "Device.h"
+
+uint8_t Reservations::holders[DeviceTable::SIZE + 1] = {0};
+int8_t Reservations::position[DeviceTable::SIZE + 1] = {0};
+Reservations::Pending Reservations::pending[MAX_PENDING];
+int Reservations::pendingSize = 0;
+int Reservations::retrying = -1;
+
+bool Reservations::available(const Request& r) {
+  if (r.motor >= 0 && holders[r.motor] > 0) return false;
+  for (int i = 0; i < 2; i++) {
+    int v = r.valve[i];
+    if (v < 0 || r.position[i] < 0) continue;
+    if (holders[v] > 0 && position[v] != r.position[i]) return false;
+  }
+  return true;
+}
+
+bool Reservations::acquire(const Request& r) {
+  if (!available(r)) return false;
+  if (r.motor >= 0) holders[r.motor]++;
+  for (int i = 0; i < 2; i++) {
+    int v = r.valve[i];
+    if (v < 0 || r.position[i] < 0) continue;
+    holders[v]++;
+    position[v] = r.position[i];
+  }
+  return true;
+}
+
+void Reservations::release(const Request& r) {
+  if (r.motor >= 0 && holders[r.motor] > 0) holders[r.motor]--;
+  for (int i = 0; i < 2; i++) {
+    int v = r.valve[i];
+    if (v < 0 || r.position[i] < 0) continue;
+    if (holders[v] > 0) holders[v]--;
+  }
+}
+
+bool Reservations::canSwitchValve(int slot, bool toOut2) {
+  return holders[slot] == 0 || position[slot] == (toOut2 ? 1 : 0);
+}
+
+Reservations::Deferred Reservations::defer(int slot, bool turnOn, unsigned long duration) {
+  for (int i = 0; i < pendingSize; i++) {
+    if (pending[i].slot == slot && pending[i].turnOn == turnOn) {
+      pending[i].duration = duration;
+      return D_REQUEUED;
+    }
+  }
+  if (pendingSize >= MAX_PENDING) return D_FULL;
+  pending[pendingSize++] = {slot, turnOn, duration};
+  return slot == retrying ? D_REQUEUED : D_QUEUED;
+}
+
+void Reservations::cancel(int slot) {
+  int n = 0;
+  for (int i = 0; i < pendingSize; i++) {
+    if (pending[i].slot != slot) pending[n++] = pending[i];
+  }
+  pendingSize = n;
+}
+
+void Reservations::cancel(int slot, bool turnOn) {
+  int n = 0;
+  for (int i = 0; i < pendingSize; i++) {
+    if (pending[i].slot != slot || pending[i].turnOn != turnOn) pending[n++] = pending[i];
+  }
+  pendingSize = n;
+}
+
+void Reservations::update() {
+  // Каждую отложенную операцию пробуем один раз за тик. Если ресурсы всё ещё
+  // заняты, устройство само поставит её в очередь заново - порядок сохранится.
+  int count = pendingSize;
+  Pending batch[MAX_PENDING];
+  memcpy(batch, pending, sizeof(Pending) * count);
+  pendingSize = 0;
+  for (int i = 0; i < count; i++) {
+    Device* device = DeviceTable::owner[batch[i].slot];
+    if (!device) continue;
+    retrying = batch[i].slot;
+    if (batch[i].turnOn) device->on(batch[i].duration);
+    else device->off();
+  }
+  retrying = -1;
+}
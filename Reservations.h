@@ -0,0 +1,53 @@
+// Reservations.h
+#ifndef RESERVATIONS_H
+#define RESERVATIONS_H
+
+#include <Arduino.h>
+#include <DeviceTable.h>
+
+// Резервирование ресурсов для параллельной работы моторов.
+// Мотор занимается одной операцией целиком, клапан фиксируется в нужном
+// положении и может делиться между операциями, которым нужно то же
+// положение. Баки не блокируются: каждый поток учитывается в баке отдельно
+// (Tank::beginFlow/endFlow). Конфликтующие операции ждут в очереди и
+// запускаются из update() в порядке поступления.
+class Reservations {
+public:
+  static const int MAX_PENDING = 8;
+
+  struct Request {
+    int motor = -1;                 // слот мотора, монопольно
+    int valve[2] = {-1, -1};        // слоты клапанов
+    int8_t position[2] = {-1, -1};  // 0 - out1, 1 - out2
+  };
+
+  static bool available(const Request& r);
+  static bool acquire(const Request& r);
+  static void release(const Request& r);
+  static bool isHeld(int slot) { return holders[slot] > 0; }
+  static bool canSwitchValve(int slot, bool toOut2);
+
+  // Отложить on()/off() устройства до освобождения ресурсов. Одна операция
+  // каждого вида на устройство: повторная только обновляет длительность.
+  // D_REQUEUED - операция уже ждала (повтор из update() или та же команда), в журнал не пишется
+  enum Deferred : uint8_t { D_FULL, D_QUEUED, D_REQUEUED };
+  static Deferred defer(int slot, bool turnOn, unsigned long duration);
+  static void cancel(int slot);
+  static void cancel(int slot, bool turnOn);
+  static int pendingCount() { return pendingSize; }
+  static void update();
+
+private:
+  struct Pending {
+    int slot;
+    bool turnOn;
+    unsigned long duration;
+  };
+  static uint8_t holders[DeviceTable::SIZE + 1];
+  static int8_t position[DeviceTable::SIZE + 1];
+  static Pending pending[MAX_PENDING];
+  static int pendingSize;
+  static int retrying;   // слот, чья операция сейчас повторяется из update()
+};
+
+#endif
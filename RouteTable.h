@@ -0,0 +1,149 @@
+// RouteTable.h
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include <Arduino.h>
+#include <vector>
+#include <Motor.h>
+#include <Reservations.h>
+
+// Таблица маршрутов "бак -> бак", собирается один раз при загрузке конфига.
+// Для каждой пары баков - список вариантов: мотор и положения его клапанов
+// (Reservations::Request). Поиск - индексы баков и одна ячейка матрицы,
+// без обхода графа на каждый запрос.
+class RouteTable {
+public:
+  struct Route {
+    Motor* motor;
+    Reservations::Request request;
+  };
+
+  RouteTable() {
+    for (int i = 0; i <= DeviceTable::SIZE; i++) tankIndex[i] = -1;
+  }
+
+  void build(Device* const* devices, int count) {
+    tanks.clear();
+    routes.clear();
+    cells.clear();
+    for (int i = 0; i <= DeviceTable::SIZE; i++) tankIndex[i] = -1;
+    for (int i = 0; i < count; i++) {
+      if (devices[i]->getDeviceType() != DeviceType::TANK || devices[i]->getSlot() >= DeviceTable::SIZE) continue;
+      tankIndex[devices[i]->getSlot()] = tanks.size();
+      tanks.push_back(static_cast<Tank*>(devices[i]));
+    }
+    size_t n = tanks.size();
+
+    // Сначала все варианты подряд, потом раскладываем по ячейкам
+    std::vector<std::pair<int, Route>> found;
+    for (int i = 0; i < count; i++) {
+      if (devices[i]->getDeviceType() != DeviceType::MOTOR) continue;
+      Motor* motor = static_cast<Motor*>(devices[i]);
+      Side in[2], out[2];
+      int nIn = sides(motor->getInValve(), motor->getInTank(), in);
+      int nOut = sides(motor->getOutValve(), motor->getOutTank(), out);
+      for (int a = 0; a < nIn; a++) {
+        for (int b = 0; b < nOut; b++) {
+          int src = indexOf(in[a].tank), dst = indexOf(out[b].tank);
+          if (src < 0 || dst < 0 || src == dst) continue;
+          Route r;
+          r.motor = motor;
+          r.request.valve[0] = in[a].valve;
+          r.request.position[0] = in[a].position;
+          r.request.valve[1] = out[b].valve;
+          r.request.position[1] = out[b].position;
+          found.push_back(std::make_pair(src * (int)n + dst, r));
+        }
+      }
+    }
+    cells.assign(n * n, Cell());
+    for (const auto& f : found) cells[f.first].count++;
+    uint16_t first = 0;
+    for (Cell& c : cells) {
+      c.first = first;
+      first += c.count;
+      c.count = 0;
+    }
+    routes.resize(found.size());
+    for (const auto& f : found) {
+      Cell& c = cells[f.first];
+      routes[c.first + c.count++] = f.second;
+    }
+  }
+
+  // Варианты маршрута from -> to; count = 0, если пути нет
+  const Route* find(const Tank* from, const Tank* to, int& count) const {
+    count = 0;
+    int src = indexOf(from), dst = indexOf(to);
+    if (src < 0 || dst < 0) return nullptr;
+    const Cell& c = cells[src * tanks.size() + dst];
+    count = c.count;
+    return count ? &routes[c.first] : nullptr;
+  }
+
+  // Первый вариант, который можно запустить сейчас, иначе первый вообще
+  const Route* pick(const Tank* from, const Tank* to) const {
+    int count;
+    const Route* r = find(from, to, count);
+    for (int i = 0; i < count; i++) {
+      if (!r[i].motor->isDeviceActive() && !Reservations::isHeld(r[i].motor->getSlot()) &&
+          Reservations::available(r[i].request)) {
+        return &r[i];
+      }
+    }
+    return r;
+  }
+
+  void print(Print& out) const {
+    for (size_t s = 0; s < tanks.size(); s++) {
+      for (size_t d = 0; d < tanks.size(); d++) {
+        const Cell& c = cells[s * tanks.size() + d];
+        for (int i = 0; i < c.count; i++) {
+          const Route& r = routes[c.first + i];
+          out.print(tanks[s]->getName() + " -> " + tanks[d]->getName() + ": " + r.motor->getName());
+          for (int v = 0; v < 2; v++) {
+            if (r.request.valve[v] < 0) continue;
+            out.print(" " + DeviceTable::owner[r.request.valve[v]]->getName() + "=" +
+                      String(r.request.position[v] ? "out2" : "out1"));
+          }
+          out.println();
+        }
+      }
+    }
+  }
+
+private:
+  struct Cell {
+    uint16_t first = 0;
+    uint8_t count = 0;
+  };
+  struct Side {
+    Tank* tank;
+    int valve;
+    int8_t position;
+  };
+
+  std::vector<Tank*> tanks;
+  std::vector<Route> routes;
+  std::vector<Cell> cells;   // tanks.size() x tanks.size(), строка - источник
+  int tankIndex[DeviceTable::SIZE + 1];
+
+  // Куда может смотреть сторона мотора: оба выхода клапана или постоянный бак
+  static int sides(Valve* valve, Tank* fixed, Side* out) {
+    if (!valve) {
+      out[0] = {fixed, -1, -1};
+      return fixed ? 1 : 0;
+    }
+    int n = 0;
+    if (valve->getOut1()) out[n++] = {valve->getOut1(), valve->getSlot(), 0};
+    if (valve->getOut2()) out[n++] = {valve->getOut2(), valve->getSlot(), 1};
+    return n;
+  }
+
+  int indexOf(const Tank* tank) const {
+    if (!tank || tank->getSlot() >= DeviceTable::SIZE) return -1;
+    return tankIndex[tank->getSlot()];
+  }
+};
+
+#endif
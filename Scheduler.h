@@ -0,0 +1,323 @@
+// Scheduler.h
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <LittleFS.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include <Device.h>
+#include <Console.h>
+
+// Расписание дозирования по настенному времени.
+// Правило: "каждый день в HH:MM" (с маской дней недели, по местному времени)
+// или "каждые N секунд". Ближайшие срабатывания лежат в min-куче, поэтому за
+// тик проверяется только её вершина. Пропуски (перезагрузка, скачок NTP)
+// обрабатываются по политике правила: skip, once или all (не больше MAX_CATCH_UP).
+class Scheduler {
+public:
+  enum Kind : uint8_t { DAILY, INTERVAL };
+  enum Missed : uint8_t { MISSED_SKIP, MISSED_ONCE, MISSED_ALL };
+
+  struct Rule {
+    uint16_t id;
+    String motor;
+    float ml;
+    Kind kind;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t days;          // бит 0 - воскресенье ... бит 6 - суббота
+    uint32_t intervalSec;
+    Missed missed;
+    uint64_t anchor;       // точка отсчёта для INTERVAL
+    uint64_t lastRun;
+    uint64_t nextFire;
+    uint8_t catchUp;       // сколько пропущенных запусков ещё выполнить
+    uint16_t retries;
+  };
+
+  static const uint8_t MAX_CATCH_UP = 3;
+  static const unsigned long JUMP_MS = 2 * 60 * 1000;       // скачок часов вперёд
+  static const unsigned long JUMP_BACK_MS = 2 * 1000;       // и назад
+  static const unsigned long RETRY_MS = 1000;               // мотор занят - повтор
+  static const uint16_t MAX_RETRIES = 600;                  // не дольше 10 минут
+  static const uint64_t NEVER = ~0ULL;
+
+  explicit Scheduler(const char* path = "/schedule.json") : path(path) {}
+
+  void load() {
+    rules.clear();
+    if (!LittleFS.exists(path)) return;
+    File file = LittleFS.open(path, FILE_READ);
+    DynamicJsonDocument doc(4096);
+    DeserializationError err = deserializeJson(doc, file);
+    file.close();
+    if (err) {
+      Console.at(ConsoleSink::L_ERROR).println("Error parsing schedule: " + String(err.c_str()));
+      return;
+    }
+    for (JsonObject obj : doc.as<JsonArray>()) {
+      Rule r;
+      r.id = obj["id"];
+      r.motor = obj["m"].as<String>();
+      r.ml = obj["ml"];
+      r.kind = (Kind)(obj["k"] | 0);
+      r.hour = obj["h"] | 0;
+      r.minute = obj["mi"] | 0;
+      r.days = obj["d"] | 0x7F;
+      r.intervalSec = obj["i"] | 0;
+      r.missed = (Missed)(obj["p"] | 0);
+      r.anchor = obj["a"] | 0ULL;
+      r.lastRun = obj["l"] | 0ULL;
+      r.nextFire = NEVER;
+      r.catchUp = 0;
+      r.retries = 0;
+      rules.push_back(r);
+      if (r.id >= nextId) nextId = r.id + 1;
+    }
+    synced = false;
+    heap.clear();
+  }
+
+  void save() const {
+    DynamicJsonDocument doc(256 + rules.size() * 160);
+    JsonArray arr = doc.to<JsonArray>();
+    for (const Rule& r : rules) {
+      JsonObject obj = arr.createNestedObject();
+      obj["id"] = r.id;
+      obj["m"] = r.motor;
+      obj["ml"] = r.ml;
+      obj["k"] = (int)r.kind;
+      if (r.kind == DAILY) {
+        obj["h"] = r.hour;
+        obj["mi"] = r.minute;
+        obj["d"] = r.days;
+      } else {
+        obj["i"] = r.intervalSec;
+        obj["a"] = r.anchor;
+      }
+      obj["p"] = (int)r.missed;
+      obj["l"] = r.lastRun;
+    }
+    File file = LittleFS.open(path, FILE_WRITE);
+    serializeJson(doc, file);
+    file.close();
+  }
+
+  // spec: "<HH:MM|+seconds>,<ml>[,<days 0-6>][,skip|once|all]", например "07:00,50,12345,once"
+  bool add(const String& motor, const String& spec, uint64_t now, String& error) {
+    if (!Device::hasWallClock()) {
+      error = "Wall clock is not synced yet";
+      return false;
+    }
+    Rule r;
+    r.id = nextId;
+    r.motor = motor;
+    r.kind = DAILY;
+    r.hour = 0;
+    r.minute = 0;
+    r.days = 0x7F;
+    r.intervalSec = 0;
+    r.missed = MISSED_SKIP;
+    r.anchor = now;
+    r.lastRun = now;
+    r.nextFire = NEVER;
+    r.catchUp = 0;
+    r.retries = 0;
+
+    char buf[32];
+    strncpy(buf, spec.c_str(), sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    char* rest = nullptr;
+    char* when = strtok_r(buf, ",", &rest);
+    char* ml = strtok_r(nullptr, ",", &rest);
+    if (!when || !ml) {
+      error = "Expected <HH:MM|+seconds>,<ml>";
+      return false;
+    }
+    if (when[0] == '+') {
+      r.kind = INTERVAL;
+      r.intervalSec = strtoul(when + 1, nullptr, 10);
+      if (r.intervalSec == 0) {
+        error = "Invalid interval: " + String(when);
+        return false;
+      }
+    } else {
+      int h, m;
+      if (sscanf(when, "%d:%d", &h, &m) != 2 || h < 0 || h > 23 || m < 0 || m > 59) {
+        error = "Invalid time: " + String(when);
+        return false;
+      }
+      r.hour = h;
+      r.minute = m;
+    }
+    r.ml = strtof(ml, nullptr);
+    if (r.ml <= 0) {
+      error = "Invalid milliliters: " + String(ml);
+      return false;
+    }
+    for (char* opt = strtok_r(nullptr, ",", &rest); opt; opt = strtok_r(nullptr, ",", &rest)) {
+      if (strcmp(opt, "skip") == 0) r.missed = MISSED_SKIP;
+      else if (strcmp(opt, "once") == 0) r.missed = MISSED_ONCE;
+      else if (strcmp(opt, "all") == 0) r.missed = MISSED_ALL;
+      else if (isdigit((unsigned char)opt[0])) {
+        r.days = 0;
+        for (char* c = opt; *c; c++) {
+          if (*c < '0' || *c > '6') {
+            error = "Invalid days: " + String(opt);
+            return false;
+          }
+          r.days |= 1 << (*c - '0');
+        }
+      } else {
+        error = "Unknown option: " + String(opt);
+        return false;
+      }
+    }
+
+    nextId++;
+    rules.push_back(r);
+    if (synced) {
+      Rule& added = rules.back();
+      added.nextFire = nextAfter(added, now);
+      heap.push_back(rules.size() - 1);
+      std::push_heap(heap.begin(), heap.end(), Later(rules));
+    }
+    save();
+    return true;
+  }
+
+  bool remove(uint16_t id) {
+    for (size_t i = 0; i < rules.size(); i++) {
+      if (rules[i].id != id) continue;
+      rules.erase(rules.begin() + i);
+      rebuildHeap();
+      save();
+      return true;
+    }
+    return false;
+  }
+
+  void list(Print& out) const {
+    for (const Rule& r : rules) {
+      char buf[128];
+      if (r.kind == DAILY) {
+        snprintf(buf, sizeof(buf), "#%u %s %.2f ml at %02u:%02u days=%02x", r.id, r.motor.c_str(),
+                 r.ml, r.hour, r.minute, r.days);
+      } else {
+        snprintf(buf, sizeof(buf), "#%u %s %.2f ml every %lu s", r.id, r.motor.c_str(), r.ml,
+                 (unsigned long)r.intervalSec);
+      }
+      out.print(buf);
+      out.print(", next=");
+      out.println(r.nextFire == NEVER ? String("-") : String((unsigned long long)r.nextFire));
+    }
+  }
+
+  const Rule& rule(int idx) const { return rules[idx]; }
+  // Ближайший запуск; NEVER - правил нет или часы ещё не сверены
+  uint64_t nextFire() const { return synced && !heap.empty() ? rules[heap.front()].nextFire : (uint64_t)NEVER; }
+
+  // Индекс правила, которое пора выполнить, или -1
+  int due(uint64_t now) {
+    if (!Device::hasWallClock()) return -1;
+    if (!synced || now + JUMP_BACK_MS < lastTick || now > lastTick + JUMP_MS) {
+      resync(now);
+      synced = true;
+    }
+    lastTick = now;
+    if (heap.empty()) return -1;
+    int top = heap.front();
+    return rules[top].nextFire <= now ? top : -1;
+  }
+
+  // ran = false - мотор занят, повторим чуть позже
+  void done(int idx, uint64_t now, bool ran) {
+    std::pop_heap(heap.begin(), heap.end(), Later(rules));
+    heap.pop_back();
+    Rule& r = rules[idx];
+    if (!ran && r.retries < MAX_RETRIES) {
+      r.retries++;
+      r.nextFire = now + RETRY_MS;
+    } else {
+      if (ran) {
+        r.lastRun = now;
+        if (r.catchUp) r.catchUp--;
+      } else {
+        r.catchUp = 0;
+      }
+      r.retries = 0;
+      r.nextFire = r.catchUp ? now : nextAfter(r, now);
+      if (ran) save();
+    }
+    heap.push_back(idx);
+    std::push_heap(heap.begin(), heap.end(), Later(rules));
+  }
+
+private:
+  const char* path;
+  std::vector<Rule> rules;
+  std::vector<int> heap;
+  uint64_t lastTick = 0;
+  bool synced = false;
+  uint16_t nextId = 1;
+
+  struct Later {
+    const std::vector<Rule>& rules;
+    explicit Later(const std::vector<Rule>& rules) : rules(rules) {}
+    bool operator()(int a, int b) const { return rules[a].nextFire > rules[b].nextFire; }
+  };
+
+  // Первое срабатывание строго после t
+  uint64_t nextAfter(const Rule& r, uint64_t t) const {
+    if (r.kind == INTERVAL) {
+      uint64_t period = (uint64_t)r.intervalSec * 1000;
+      if (t < r.anchor) return r.anchor;
+      return r.anchor + ((t - r.anchor) / period + 1) * period;
+    }
+    if (!(r.days & 0x7F)) return NEVER;
+    time_t seconds = t / 1000;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    for (int i = 0; i < 8; i++) {
+      tm.tm_hour = r.hour;
+      tm.tm_min = r.minute;
+      tm.tm_sec = 0;
+      tm.tm_isdst = -1;
+      uint64_t candidate = (uint64_t)mktime(&tm) * 1000;
+      if (candidate > t && (r.days & (1 << tm.tm_wday))) return candidate;
+      tm.tm_mday++;
+    }
+    return NEVER;
+  }
+
+  // Пересчёт после загрузки или скачка часов: пропущенные за (lastRun, now]
+  // срабатывания обрабатываются по политике правила
+  void resync(uint64_t now) {
+    for (Rule& r : rules) {
+      uint8_t missed = 0;
+      if (r.lastRun < now) {
+        for (uint64_t f = nextAfter(r, r.lastRun); f <= now && missed <= MAX_CATCH_UP; f = nextAfter(r, f)) {
+          missed++;
+        }
+      }
+      if (r.missed == MISSED_ONCE) r.catchUp = missed ? 1 : 0;
+      else if (r.missed == MISSED_ALL) r.catchUp = missed < MAX_CATCH_UP ? missed : MAX_CATCH_UP;
+      else r.catchUp = 0;
+      r.retries = 0;
+      // После скачка назад не повторяем то, что уже выполнено
+      r.nextFire = r.catchUp ? now : nextAfter(r, now > r.lastRun ? now : r.lastRun);
+    }
+    rebuildHeap();
+  }
+
+  void rebuildHeap() {
+    heap.clear();
+    for (size_t i = 0; i < rules.size(); i++) heap.push_back(i);
+    std::make_heap(heap.begin(), heap.end(), Later(rules));
+  }
+};
+
+#endif
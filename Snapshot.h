@@ -0,0 +1,346 @@
+// Snapshot.h
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <Arduino.h>
+#include <Console.h>
+#include <LittleFS.h>
+#include <vector>
+#include <Motor.h>
+#include <RemoteDevice.h>
+
+// Двоичный снимок графа устройств и их состояния: /state.bin читается при загрузке
+// одним вызовом вместо разбора JSON и чтения уровня каждого бака из Preferences.
+// Пишется только при переходах (пуск, останов, смена фазы или положения клапана),
+// не чаще раза в MIN_INTERVAL_MS. У запусков хранится время старта по NTP, поэтому
+// прерванный перезагрузкой запуск досчитывается по часам до момента загрузки.
+//
+// Формат (little endian): "DSS", версия, хэш конфига u32, число устройств u16,
+// записи устройств, FNV-1a всего предыдущего u32.
+// Запись: тип u8, флаги u8 (бит 0 - активно, бит 1 - старт по NTP), длина имени u8, имя,
+// pin i8, btnPin i8,
+// далее TANK: capacity i32, level f32; VALVE: out1 i8, out2 i8;
+// MOTOR: msPerMl f32, inTank i8, outTank i8, inValve i8, outValve i8;
+// REMOTE: длина хоста u8, хост, длина удалённого имени u8, имя, порт u16;
+// у активных ещё старт UTC мс u64 и заданная длительность u32, у моторов - начало
+// ещё не зачтённого в баки потока UTC мс u64, его скорость мс/мл f32, цель дозирования
+// мл f32 (0 - запуск на время) и уже зачтённое в баки мл f32 (быстрая фаза).
+class Snapshot {
+public:
+  static const uint8_t VERSION = 4;
+  static const unsigned long MIN_INTERVAL_MS = 2000;
+
+  enum Flags : uint8_t { F_ACTIVE = 1, F_CLOCK = 2 };
+
+  struct Run {
+    Device* device;
+    bool clock;           // старт записан по часам NTP
+    uint64_t startMs;
+    uint32_t durationMs;
+    uint64_t flowStartMs; // уровень баков в снимке учитывает поток до этого момента
+    float flowMsPerMl;
+    float targetMl;       // дозирование: остаток продолжается по объёму, с фазами
+    float creditedMl;
+  };
+
+  static uint32_t hash(const uint8_t* data, size_t len, uint32_t h = 2166136261u) {
+    for (size_t i = 0; i < len; i++) {
+      h ^= data[i];
+      h *= 16777619u;
+    }
+    return h;
+  }
+  static uint32_t hash(const char* s) { return hash((const uint8_t*)s, strlen(s)); }
+
+  static bool save(const char* path, Device* const* devices, int count, uint32_t configHash) {
+    std::vector<uint8_t> out;
+    out.reserve(32 + count * 32);
+    out.push_back('D');
+    out.push_back('S');
+    out.push_back('S');
+    out.push_back((uint8_t)VERSION);
+    put(out, configHash);
+    put(out, (uint16_t)count);
+    for (int i = 0; i < count; i++) {
+      Device* d = devices[i];
+      DeviceType type = d->getDeviceType();
+      out.push_back((uint8_t)type);
+      uint8_t flags = 0;
+      if (d->isDeviceActive()) flags = F_ACTIVE | (Device::hasWallClock() ? F_CLOCK : 0);
+      out.push_back(flags);
+      putString(out, d->getName());
+      put(out, (int8_t)d->getPin());
+      put(out, (int8_t)d->getButtonPin());
+      if (type == DeviceType::TANK) {
+        Tank* tank = static_cast<Tank*>(d);
+        put(out, (int32_t)tank->getCapacity());
+        put(out, tank->getCurrentLevel());
+      } else if (type == DeviceType::VALVE) {
+        Valve* valve = static_cast<Valve*>(d);
+        put(out, indexOf(devices, count, valve->getOut1()));
+        put(out, indexOf(devices, count, valve->getOut2()));
+      } else if (type == DeviceType::MOTOR) {
+        Motor* motor = static_cast<Motor*>(d);
+        put(out, motor->getMillisecondsPerMl());
+        // Без клапана бак постоянный, с клапаном текущий выход восстановится из клапана
+        put(out, indexOf(devices, count, motor->getInValve() ? nullptr : motor->getInTank()));
+        put(out, indexOf(devices, count, motor->getOutValve() ? nullptr : motor->getOutTank()));
+        put(out, indexOf(devices, count, motor->getInValve()));
+        put(out, indexOf(devices, count, motor->getOutValve()));
+      } else if (type == DeviceType::REMOTE) {
+        RemoteDevice* remote = static_cast<RemoteDevice*>(d);
+        putString(out, remote->getHost());
+        putString(out, remote->getRemoteName());
+        put(out, remote->getPort());
+      }
+      if (d->isDeviceActive()) {
+        put(out, d->getTimeOnMs());
+        put(out, (uint32_t)d->getDurationMs());
+        if (type == DeviceType::MOTOR) {
+          Motor* motor = static_cast<Motor*>(d);
+          put(out, motor->getFlowStart());
+          put(out, motor->getFlowMsPerMl());
+          put(out, motor->getTargetMl());
+          put(out, motor->getCreditedMl());
+        }
+      }
+    }
+    put(out, hash(out.data(), out.size()));
+
+    // Через временный файл, чтобы обрыв питания не оставил половину снимка
+    String tmp = String(path) + ".tmp";
+    File file = LittleFS.open(tmp, FILE_WRITE);
+    if (!file) return false;
+    bool ok = file.write(out.data(), out.size()) == out.size();
+    file.close();
+    return ok && LittleFS.rename(tmp, path);
+  }
+
+  // Создаёт устройства из снимка. false - снимка нет, он повреждён или от другого конфига
+  static bool load(const char* path, uint32_t configHash, std::vector<Device*>& devices, std::vector<Run>& runs) {
+    std::vector<uint8_t> buf;
+    uint16_t count;
+    if (!open(path, configHash, buf, count)) return false;
+    Reader in{buf.data(), buf.size() - 4, HEADER, true};
+
+    for (int i = 0; i < count && in.ok; i++) {
+      DeviceType type = (DeviceType)in.get<uint8_t>();
+      uint8_t flags = in.get<uint8_t>();
+      String name = in.getString();
+      int pin = in.get<int8_t>();
+      int btnPin = in.get<int8_t>();
+      Device* device = nullptr;
+      if (type == DeviceType::TANK) {
+        int capacity = in.get<int32_t>();
+        float level = in.get<float>();
+        Tank* tank = new Tank(name, capacity);
+        tank->restoreLevel(level);
+        device = tank;
+      } else if (type == DeviceType::VALVE) {
+        Tank* out1 = tankAt(devices, in.get<int8_t>());
+        Tank* out2 = tankAt(devices, in.get<int8_t>());
+        device = new Valve(name, pin, out1, out2);
+      } else if (type == DeviceType::MOTOR) {
+        float msPerMl = in.get<float>();
+        Tank* inTank = tankAt(devices, in.get<int8_t>());
+        Tank* outTank = tankAt(devices, in.get<int8_t>());
+        Valve* inValve = valveAt(devices, in.get<int8_t>());
+        Valve* outValve = valveAt(devices, in.get<int8_t>());
+        device = new Motor(name, pin, msPerMl, btnPin, inTank, outTank, inValve, outValve);
+      } else if (type == DeviceType::REMOTE) {
+        String host = in.getString();
+        String remoteName = in.getString();
+        uint16_t port = in.get<uint16_t>();
+        device = new RemoteDevice(name, host, remoteName, port);
+      } else {
+        in.ok = false;
+        break;
+      }
+      devices.push_back(device);
+      if (flags & F_ACTIVE) readRun(in, device, flags, runs);
+    }
+    if (in.ok && in.pos == in.len) return true;
+    for (Device* d : devices) delete d;
+    devices.clear();
+    runs.clear();
+    return false;
+  }
+
+  // Установка уже создана (StaticPlant): из снимка берутся только уровни баков
+  // и прерванные запуски. Порядок, типы и имена должны совпасть
+  static bool restore(const char* path, uint32_t configHash, Device* const* devices, int count,
+                      std::vector<Run>& runs) {
+    std::vector<uint8_t> buf;
+    uint16_t saved;
+    if (!open(path, configHash, buf, saved) || saved != count) return false;
+    Reader in{buf.data(), buf.size() - 4, HEADER, true};
+    std::vector<float> levels(count, 0);
+    for (int i = 0; i < count && in.ok; i++) {
+      Device* device = devices[i];
+      DeviceType type = (DeviceType)in.get<uint8_t>();
+      uint8_t flags = in.get<uint8_t>();
+      if (type != device->getDeviceType() || in.getString() != device->getName()) return false;
+      in.get<int8_t>();
+      in.get<int8_t>();
+      if (type == DeviceType::TANK) {
+        in.get<int32_t>();
+        levels[i] = in.get<float>();
+      } else if (type == DeviceType::VALVE) {
+        in.get<int16_t>();
+      } else if (type == DeviceType::MOTOR) {
+        in.get<float>();
+        in.get<uint32_t>();
+      } else {
+        return false;
+      }
+      if (flags & F_ACTIVE) readRun(in, device, flags, runs);
+    }
+    if (!in.ok || in.pos != in.len) {
+      runs.clear();
+      return false;
+    }
+    for (int i = 0; i < count; i++) {
+      if (devices[i]->getDeviceType() == DeviceType::TANK) static_cast<Tank*>(devices[i])->restoreLevel(levels[i]);
+    }
+    return true;
+  }
+
+  // После begin() и синхронизации часов: клапаны возвращаются в прежнее положение,
+  // прокачанное до загрузки (bootUtc) зачитывается в баки, остаток продолжается:
+  // у дозирования - объёмом через dispense() (фазы планируются заново), иначе по времени.
+  // Без старта по NTP длительность до перезагрузки неизвестна - такой запуск не трогаем
+  static void resume(const std::vector<Run>& runs, uint64_t bootUtc) {
+    for (const Run& run : runs) {
+      if (run.device->getDeviceType() != DeviceType::VALVE) continue;
+      if (run.durationMs == 0) run.device->on(0);
+      else if (run.clock && remaining(run, bootUtc) > 0) run.device->on(remaining(run, bootUtc));
+    }
+    for (const Run& run : runs) {
+      if (run.device->getDeviceType() != DeviceType::MOTOR) continue;
+      Motor* motor = static_cast<Motor*>(run.device);
+      if (!run.clock) {
+        Console.at(ConsoleSink::L_WARN).printf("Warning: %s: run started before NTP sync, not resumed\n",
+                                               motor->getName().c_str());
+        continue;
+      }
+      uint64_t end = bootUtc;
+      if (run.durationMs > 0 && run.startMs + run.durationMs < end) end = run.startMs + run.durationMs;
+      float ml = end > run.flowStartMs && run.flowMsPerMl > 0
+                     ? roundf((end - run.flowStartMs) / run.flowMsPerMl * 100) / 100.0f
+                     : 0;
+      if (motor->getInTank()) motor->getInTank()->drain(ml);
+      if (motor->getOutTank()) motor->getOutTank()->fill(ml);
+      if (run.targetMl > 0) {
+        float leftMl = roundf((run.targetMl - run.creditedMl - ml) * 100) / 100.0f;
+        if (leftMl > 0) {
+          motor->dispense(leftMl);
+          Console.printf("%s: resumed after %.2f ml, %.2f ml left\n", motor->getName().c_str(),
+                        run.creditedMl + ml, leftMl);
+        } else {
+          Console.printf("%s: interrupted dispense reconciled, %.2f ml\n", motor->getName().c_str(),
+                        run.creditedMl + ml);
+        }
+        continue;
+      }
+      uint32_t left = remaining(run, bootUtc);
+      if (run.durationMs == 0 || left > 0) {
+        motor->on(left);
+        Console.printf("%s: resumed after %.2f ml, %lu ms left\n", motor->getName().c_str(), ml,
+                      (unsigned long)left);
+      } else {
+        Console.printf("%s: interrupted run reconciled, %.2f ml\n", motor->getName().c_str(), ml);
+      }
+    }
+  }
+
+private:
+  struct Reader {
+    const uint8_t* data;
+    size_t len;
+    size_t pos;
+    bool ok;
+    template <typename T>
+    T get() {
+      T v = T();
+      if (pos + sizeof(T) > len) {
+        ok = false;
+        return v;
+      }
+      memcpy(&v, data + pos, sizeof(T));
+      pos += sizeof(T);
+      return v;
+    }
+    String getString() {
+      uint8_t n = get<uint8_t>();
+      String s;
+      for (int c = 0; c < n && ok; c++) s += (char)get<uint8_t>();
+      return s;
+    }
+  };
+
+  static const size_t HEADER = 10;   // "DSS", версия, хэш, число устройств
+
+  // Файл целиком с проверкой суммы, сигнатуры, версии и хэша конфига
+  static bool open(const char* path, uint32_t configHash, std::vector<uint8_t>& buf, uint16_t& count) {
+    if (!LittleFS.exists(path)) return false;
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file) return false;
+    buf.resize(file.size());
+    size_t read = file.read(buf.data(), buf.size());
+    file.close();
+    if (read != buf.size() || buf.size() < HEADER + 4) return false;
+    uint32_t checksum;
+    memcpy(&checksum, buf.data() + buf.size() - 4, 4);
+    if (checksum != hash(buf.data(), buf.size() - 4)) return false;
+
+    Reader in{buf.data(), buf.size() - 4, 0, true};
+    if (in.get<uint8_t>() != 'D' || in.get<uint8_t>() != 'S' || in.get<uint8_t>() != 'S') return false;
+    if (in.get<uint8_t>() != VERSION || in.get<uint32_t>() != configHash) return false;
+    count = in.get<uint16_t>();
+    return count <= DeviceTable::SIZE;
+  }
+
+  template <typename T>
+  static void put(std::vector<uint8_t>& out, T v) {
+    const uint8_t* p = (const uint8_t*)&v;
+    out.insert(out.end(), p, p + sizeof(T));
+  }
+
+  static void putString(std::vector<uint8_t>& out, const String& s) {
+    out.push_back((uint8_t)s.length());
+    out.insert(out.end(), s.c_str(), s.c_str() + s.length());
+  }
+
+  static int8_t indexOf(Device* const* devices, int count, const Device* device) {
+    for (int i = 0; i < count; i++)
+      if (devices[i] == device) return i;
+    return -1;
+  }
+  static Tank* tankAt(const std::vector<Device*>& devices, int idx) {
+    if (idx < 0 || idx >= (int)devices.size() || devices[idx]->getDeviceType() != DeviceType::TANK) return nullptr;
+    return static_cast<Tank*>(devices[idx]);
+  }
+  static Valve* valveAt(const std::vector<Device*>& devices, int idx) {
+    if (idx < 0 || idx >= (int)devices.size() || devices[idx]->getDeviceType() != DeviceType::VALVE) return nullptr;
+    return static_cast<Valve*>(devices[idx]);
+  }
+  static uint32_t remaining(const Run& run, uint64_t bootUtc) {
+    uint64_t elapsed = bootUtc > run.startMs ? bootUtc - run.startMs : 0;
+    return run.durationMs > elapsed ? run.durationMs - (uint32_t)elapsed : 0;
+  }
+  static void readRun(Reader& in, Device* device, uint8_t flags, std::vector<Run>& runs) {
+    Run run = {device, (flags & F_CLOCK) != 0, 0, 0, 0, 0, 0, 0};
+    run.startMs = in.get<uint64_t>();
+    run.durationMs = in.get<uint32_t>();
+    run.flowStartMs = run.startMs;
+    if (device->getDeviceType() == DeviceType::MOTOR) {
+      run.flowStartMs = in.get<uint64_t>();
+      run.flowMsPerMl = in.get<float>();
+      run.targetMl = in.get<float>();
+      run.creditedMl = in.get<float>();
+    }
+    runs.push_back(run);
+  }
+};
+
+#endif
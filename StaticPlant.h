@@ -0,0 +1,229 @@
+// StaticPlant.h
+#ifndef STATIC_PLANT_H
+#define STATIC_PLANT_H
+
+#include <Arduino.h>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <Motor.h>
+
+// Установка, описанная в коде вместо JSON-конфига, - для постоянных установок:
+//
+//   struct Src : StaticTank<Src, 1000> { static constexpr const char* name() { return "src"; } };
+//   struct Dst : StaticTank<Dst, 500> { static constexpr const char* name() { return "dst"; } };
+//   struct Sel : StaticValve<Sel, 25, Src, Dst> { static constexpr const char* name() { return "sel"; } };
+//   struct Pump : StaticMotor<Pump, 26, NoDevice, NoDevice, NoDevice, Sel> {
+//     static constexpr const char* name() { return "pump"; }
+//     static constexpr float msPerMl = 120;
+//   };
+//   typedef StaticPlant<Src, Dst, Sel, Pump> Plant;
+//   DeviceManager manager(Plant::topology());
+//
+// Имена, пины и ссылки проверяются при компиляции: одинаковые имена или пины,
+// ссылка на устройство не того типа или объявленное позже - static_assert.
+// Устройства создаются в статической памяти без new и разбора JSON, имя ищется
+// развёрнутым сравнением, а тик вызывает update() каждого типа напрямую, без
+// виртуального вызова. Команды, JSON для клиентов и снимок - те же, что у конфига.
+
+// Пустая ссылка: нет бака/клапана
+struct NoDevice {
+  static constexpr DeviceType kind = DeviceType::OTHER;
+  static constexpr int pin = -1;
+  static constexpr int buttonPin = -1;
+};
+
+template <typename Link, DeviceType Kind>
+struct StaticLinkOk : std::integral_constant<bool, std::is_same<Link, NoDevice>::value || Link::kind == Kind> {};
+
+template <typename Self, int Capacity>
+struct StaticTank {
+  typedef Tank Type;
+  typedef NoDevice Link1;
+  typedef NoDevice Link2;
+  typedef NoDevice Link3;
+  typedef NoDevice Link4;
+  static constexpr DeviceType kind = DeviceType::TANK;
+  static constexpr int pin = -1;
+  static constexpr int buttonPin = -1;
+  static_assert(Capacity >= 0, "Tank capacity must not be negative");
+  static Tank* construct(void* at) { return new (at) Tank(Self::name(), Capacity); }
+};
+
+template <typename Spec>
+struct StaticStorage;
+
+template <typename Self, int Pin, typename Out1, typename Out2>
+struct StaticValve {
+  typedef Valve Type;
+  typedef Out1 Link1;
+  typedef Out2 Link2;
+  typedef NoDevice Link3;
+  typedef NoDevice Link4;
+  static constexpr DeviceType kind = DeviceType::VALVE;
+  static constexpr int pin = Pin;
+  static constexpr int buttonPin = -1;
+  static_assert(Pin > 0, "Valve needs an output pin");
+  static_assert(Out1::kind == DeviceType::TANK && Out2::kind == DeviceType::TANK, "Valve outputs must be tanks");
+  static Valve* construct(void* at) {
+    return new (at) Valve(Self::name(), Pin, StaticStorage<Out1>::get(), StaticStorage<Out2>::get());
+  }
+};
+
+// msPerMl задаёт наследник: static constexpr float msPerMl = ...;
+template <typename Self, int Pin, typename InTank, typename OutTank, typename InValve = NoDevice,
+          typename OutValve = NoDevice, int ButtonPin = -1>
+struct StaticMotor {
+  typedef Motor Type;
+  typedef InTank Link1;
+  typedef OutTank Link2;
+  typedef InValve Link3;
+  typedef OutValve Link4;
+  static constexpr DeviceType kind = DeviceType::MOTOR;
+  static constexpr int pin = Pin;
+  static constexpr int buttonPin = ButtonPin;
+  static_assert(Pin > 0, "Motor needs an output pin");
+  static_assert(StaticLinkOk<InTank, DeviceType::TANK>::value && StaticLinkOk<OutTank, DeviceType::TANK>::value,
+                "Motor inTank/outTank must be tanks");
+  static_assert(StaticLinkOk<InValve, DeviceType::VALVE>::value && StaticLinkOk<OutValve, DeviceType::VALVE>::value,
+                "Motor inValve/outValve must be valves");
+  static Motor* construct(void* at) {
+    static_assert(Self::msPerMl > 0, "Motor msPerMl must be positive");
+    return new (at) Motor(Self::name(), Pin, Self::msPerMl, ButtonPin, StaticStorage<InTank>::get(),
+                          StaticStorage<OutTank>::get(), StaticStorage<InValve>::get(),
+                          StaticStorage<OutValve>::get());
+  }
+};
+
+// Память устройства - статическая, по одной на описание
+template <typename Spec>
+struct StaticStorage {
+  typedef typename Spec::Type Type;
+  static typename std::aligned_storage<sizeof(Type), alignof(Type)>::type raw;
+  static bool built;
+  static Type* get() { return built ? reinterpret_cast<Type*>(&raw) : nullptr; }
+  static Type* build() {
+    if (!built) Spec::construct(&raw);
+    built = true;
+    return get();
+  }
+};
+template <typename Spec>
+typename std::aligned_storage<sizeof(typename Spec::Type), alignof(typename Spec::Type)>::type StaticStorage<Spec>::raw;
+template <typename Spec>
+bool StaticStorage<Spec>::built = false;
+
+template <>
+struct StaticStorage<NoDevice> {
+  static std::nullptr_t get() { return nullptr; }
+};
+
+// То, что DeviceManager берёт у установки; сами функции развёрнуты по типам
+struct StaticTopology {
+  void (*create)(std::vector<Device*>& devices);
+  Device* (*find)(const char* name);
+  void (*update)();
+};
+
+// Проверки при компиляции
+constexpr bool staticNameEq(const char* a, const char* b) {
+  return *a == *b && (*a == '\0' || staticNameEq(a + 1, b + 1));
+}
+
+template <typename... T>
+struct StaticList {};
+
+template <typename T, typename List>
+struct StaticHas;
+template <typename T>
+struct StaticHas<T, StaticList<>> : std::is_same<T, NoDevice> {};
+template <typename T, typename H, typename... R>
+struct StaticHas<T, StaticList<H, R...>>
+    : std::integral_constant<bool, std::is_same<T, H>::value || StaticHas<T, StaticList<R...>>::value> {};
+
+// Ссылки каждого устройства - только на объявленные раньше
+template <typename Before, typename... Specs>
+struct StaticOrdered;
+template <typename... B>
+struct StaticOrdered<StaticList<B...>> : std::true_type {};
+template <typename... B, typename S, typename... R>
+struct StaticOrdered<StaticList<B...>, S, R...>
+    : std::integral_constant<bool, StaticHas<typename S::Link1, StaticList<B...>>::value &&
+                                       StaticHas<typename S::Link2, StaticList<B...>>::value &&
+                                       StaticHas<typename S::Link3, StaticList<B...>>::value &&
+                                       StaticHas<typename S::Link4, StaticList<B...>>::value &&
+                                       StaticOrdered<StaticList<B..., S>, R...>::value> {};
+
+template <int Pin, typename... Specs>
+struct StaticPinFree : std::true_type {};
+template <int Pin, typename S, typename... R>
+struct StaticPinFree<Pin, S, R...>
+    : std::integral_constant<bool, (Pin < 0 || (S::pin != Pin && S::buttonPin != Pin)) &&
+                                       StaticPinFree<Pin, R...>::value> {};
+
+template <typename... Specs>
+struct StaticPinsUnique : std::true_type {};
+template <typename S, typename... R>
+struct StaticPinsUnique<S, R...>
+    : std::integral_constant<bool, (S::pin < 0 || S::pin != S::buttonPin) && StaticPinFree<S::pin, R...>::value &&
+                                       StaticPinFree<S::buttonPin, R...>::value &&
+                                       StaticPinsUnique<R...>::value> {};
+
+template <typename S, typename... Specs>
+struct StaticNameFree : std::true_type {};
+template <typename S, typename H, typename... R>
+struct StaticNameFree<S, H, R...>
+    : std::integral_constant<bool, !staticNameEq(S::name(), H::name()) && StaticNameFree<S, R...>::value> {};
+
+template <typename... Specs>
+struct StaticNamesUnique : std::true_type {};
+template <typename S, typename... R>
+struct StaticNamesUnique<S, R...>
+    : std::integral_constant<bool, StaticNameFree<S, R...>::value && StaticNamesUnique<R...>::value> {};
+
+// Развёрнутые по списку описаний операции
+template <typename... Specs>
+struct StaticEach {
+  static void create(std::vector<Device*>&) {}
+  static Device* find(const char*) { return nullptr; }
+  static void update() {}
+};
+template <typename S, typename... R>
+struct StaticEach<S, R...> {
+  static void create(std::vector<Device*>& devices) {
+    devices.push_back(StaticStorage<S>::build());
+    StaticEach<R...>::create(devices);
+  }
+  static Device* find(const char* name) {
+    return strcmp(S::name(), name) == 0 ? StaticStorage<S>::get() : StaticEach<R...>::find(name);
+  }
+  static void update() {
+    typedef typename S::Type Type;
+    // Квалифицированный вызов - без таблицы виртуальных функций
+    StaticStorage<S>::get()->Type::update();
+    StaticEach<R...>::update();
+  }
+};
+
+template <typename... Specs>
+class StaticPlant {
+  static_assert(sizeof...(Specs) <= DeviceTable::SIZE, "Too many devices for DEVICE_TABLE_SIZE");
+  static_assert(StaticNamesUnique<Specs...>::value, "Device names must be unique");
+  static_assert(StaticPinsUnique<Specs...>::value, "Pin is used by more than one device");
+  static_assert(StaticOrdered<StaticList<>, Specs...>::value,
+                "Linked tanks and valves must be listed in the plant before the devices using them");
+
+public:
+  static const StaticTopology& topology() {
+    static const StaticTopology t = {&StaticEach<Specs...>::create, &StaticEach<Specs...>::find,
+                                     &StaticEach<Specs...>::update};
+    return t;
+  }
+
+  template <typename Spec>
+  static typename Spec::Type* get() {
+    return StaticStorage<Spec>::get();
+  }
+};
+
+#endif
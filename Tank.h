@@ -3,26 +3,60 @@
 
 #include <Device.h>
 #include <Preferences.h>
+#include <EventBus.h>
 
 extern Preferences prefs;
 
 class Tank : public Device {
 protected:
-  int capacity;
-  float currentLevel;
-  uint64_t lastSaveTime = 0;      // Время последней записи
-  float lastSavedLevel = -1;  // -1 означает, что ничего ещё не сохранено
+  int tankIdx; // номер бака в DeviceTable
+  int& capacity;
+  float& currentLevel;
+  uint64_t& lastSaveTime;      // Время последней записи
+  float& lastSavedLevel;  // -1 означает, что ничего ещё не сохранено
   float millisecondsPerMl = 0;
   int in = 0;
+  bool levelRestored = false; // уровень уже взят из снимка
+
+  // Поток одного мотора через бак; несколько моторов могут лить и сливать одновременно
+  struct Flow {
+    int motorSlot;
+    float msPerMl;
+    bool filling;
+    uint64_t start;
+  };
+  static const int MAX_FLOWS = 4;
+  Flow flows[MAX_FLOWS];
+  int flowCount = 0;
+  // Когда при текущих потоках бак станет полным (limitFull) или пустым; 0 - никогда
+  uint64_t limitAt = 0;
+  bool limitFull = false;
+
+  static float flowMl(const Flow& f, uint64_t now) {
+    if (now <= f.start || f.msPerMl <= 0) return 0;
+    float ml = (now - f.start) / f.msPerMl;
+    return roundf(ml * 100) / 100.0f;
+  }
 public:
-  Tank(String deviceName, int tankCapacity) : Device(deviceName, -1), capacity(tankCapacity), currentLevel(0) {}
+  Tank(String deviceName, int tankCapacity)
+      : Device(deviceName, -1), tankIdx(DeviceTable::addTank(slot)),
+        capacity(DeviceTable::capacity[tankIdx]), currentLevel(DeviceTable::level[tankIdx]),
+        lastSaveTime(DeviceTable::lastSaveTime[tankIdx]), lastSavedLevel(DeviceTable::lastSavedLevel[tankIdx]) {
+    capacity = tankCapacity;
+    DeviceTable::type[slot] = DeviceType::TANK;
+  }
+  ~Tank() { DeviceTable::releaseTank(tankIdx); }
   void begin() override {
-    currentLevel = prefs.getFloat((getName() + "_level").c_str(), 0);
+    if (!levelRestored) currentLevel = prefs.getFloat((getName() + "_level").c_str(), 0);
     lastSavedLevel = currentLevel;
     lastSaveTime = Device::getCurrentUtcMillis();
     Device::begin();
   }
   DeviceType getDeviceType() const override { return DeviceType::TANK; }
+  void restoreLevel(float ml) {
+    currentLevel = ml;
+    levelRestored = true;
+  }
   void setIn(bool in_t) {
     in = in_t ? 1 : 0;
   }
@@ -35,15 +69,105 @@ public:
       log("Error", "Invalid msPerMl: " + String(msPerMl));
     }
   }
+  // Сколько ещё не учтено в уровне: сумма текущих потоков, слив со знаком минус
   float getActiveDurationMl() const {
-    if (!isActive) return 0;
-    unsigned long duration_ms = getActiveDuration();
-    float ml = duration_ms / millisecondsPerMl;
-    if(in){
-      ml = -ml;
+    if (flowCount == 0) return 0;
+    uint64_t now = getCurrentUtcMillis();
+    float ml = 0;
+    for (int i = 0; i < flowCount; i++) {
+      float part = flowMl(flows[i], now);
+      ml += flows[i].filling ? part : -part;
     }
     return roundf(ml * 100) / 100.0f;
   }
+  int getFlowCount() const { return flowCount; }
+
+  void beginFlow(int motorSlot, float msPerMl, bool filling, uint64_t start) {
+    for (int i = 0; i < flowCount; i++) {
+      if (flows[i].motorSlot == motorSlot) {
+        flows[i] = {motorSlot, msPerMl, filling, start};
+        updateLimit();
+        return;
+      }
+    }
+    if (flowCount >= MAX_FLOWS) {
+      log("Error", "Too many flows");
+      return;
+    }
+    flows[flowCount++] = {motorSlot, msPerMl, filling, start};
+    if (flowCount == 1) on();
+    updateLimit();
+  }
+
+  // Закрыть поток мотора и зачесть его объём в уровень; возвращает объём
+  float endFlow(int motorSlot, uint64_t now) {
+    for (int i = 0; i < flowCount; i++) {
+      if (flows[i].motorSlot != motorSlot) continue;
+      Flow f = flows[i];
+      flows[i] = flows[--flowCount];
+      float ml = flowMl(f, now);
+      if (f.filling) fill(ml);
+      else drain(ml);
+      if (flowCount == 0) off();
+      updateLimit();
+      refreshStop(motorSlot);
+      return ml;
+    }
+    return 0;
+  }
+  // Сменить скорость потока мотора без его закрытия: прокачанное зачитывается,
+  // бак остаётся включённым (без лишних Off/On и запусков в статистике)
+  void changeFlowRate(int motorSlot, float msPerMl, uint64_t now) {
+    for (int i = 0; i < flowCount; i++) {
+      Flow& f = flows[i];
+      if (f.motorSlot != motorSlot) continue;
+      float ml = flowMl(f, now);
+      f.msPerMl = msPerMl;
+      f.start = now;
+      if (f.filling) fill(ml);
+      else drain(ml);
+      updateLimit();
+      return;
+    }
+  }
+  // Пересчёт момента переполнения/опустошения при смене потоков, уровня или ёмкости.
+  // Бак без ёмкости не ограничивает. Срок ставится моторам, которые ведут к пределу
+  void updateLimit() {
+    limitAt = 0;
+    if (capacity > 0 && flowCount > 0) {
+      float rate = 0; // мл/мс, слив со знаком минус
+      for (int i = 0; i < flowCount; i++) {
+        if (flows[i].msPerMl > 0) rate += (flows[i].filling ? 1 : -1) / flows[i].msPerMl;
+      }
+      if (rate != 0) {
+        float level = currentLevel + getActiveDurationMl();
+        float room = rate > 0 ? capacity - level : level;
+        limitFull = rate > 0;
+        limitAt = getCurrentUtcMillis() + (room > 0 ? (uint64_t)(room / fabsf(rate)) : 0);
+      }
+    }
+    for (int i = 0; i < flowCount; i++) refreshStop(flows[i].motorSlot);
+  }
+
+  // Жёсткий срок мотора - ближайший из пределов баков, к которым ведёт его поток
+  static void refreshStop(int motorSlot) {
+    uint64_t stop = 0;
+    for (int t = 0; t < DeviceTable::tankSize; t++) {
+      int tankSlot = DeviceTable::tankSlot[t];
+      if (tankSlot < 0 || tankSlot >= DeviceTable::SIZE || !DeviceTable::owner[tankSlot]) continue;
+      const Tank* tank = static_cast<const Tank*>(DeviceTable::owner[tankSlot]);
+      if (!tank->limitAt) continue;
+      for (int i = 0; i < tank->flowCount; i++) {
+        const Flow& f = tank->flows[i];
+        if (f.motorSlot == motorSlot && f.filling == tank->limitFull && (!stop || tank->limitAt < stop)) {
+          stop = tank->limitAt;
+        }
+      }
+    }
+    if (motorSlot >= 0 && motorSlot <= DeviceTable::SIZE) DeviceTable::hardStop[motorSlot] = stop;
+  }
+  uint64_t getLimitAt() const { return limitAt; }
+
   float getDurationMl() const {
     if (!isActive) return 0;
     unsigned long duration_ms = getDurationMs();
@@ -55,6 +179,8 @@ public:
   int getCapacity() const { return capacity; }
   void setCapacity(int c) {
     capacity = c;
+    EventBus::publish(slot, CHANGE_LEVEL);
+    updateLimit();
     //StaticJsonDocument<64> extra;
     //extra["ml"] = capacity;
     //fileLog("debug", "set capacity", extra.as<JsonObject>(), true); 
@@ -65,6 +191,8 @@ public:
   void setCurrentLevel(float ml) { 
     if (ml != currentLevel) {
       currentLevel = ml;
+      EventBus::publish(slot, CHANGE_LEVEL);
+      updateLimit();
       prefs.putFloat((getName() + "_level").c_str(), currentLevel);
       lastSavedLevel = currentLevel;
       lastSaveTime = getCurrentUtcMillis();
@@ -78,6 +206,10 @@ public:
       return;
     }
     currentLevel += amount;
+    EventBus::publish(slot, CHANGE_LEVEL);
+    updateLimit();
+    stats.recordFlow(amount);
+    statsDirty = true;
     //StaticJsonDocument<64> extra;
     //extra["ml"] = amount;
     //extra["currentLevel"] = currentLevel;
@@ -89,6 +221,10 @@ public:
       return;
     }
     currentLevel -= amount;
+    EventBus::publish(slot, CHANGE_LEVEL);
+    updateLimit();
+    stats.recordFlow(-amount);
+    statsDirty = true;
     if (currentLevel < 0) {
       //currentLevel = 0;
     }
@@ -118,19 +254,17 @@ public:
   }
 
   void update() override {
-    
     Device::update();
-    uint64_t now = getCurrentUtcMillis();
-    
-    if (currentLevel != lastSavedLevel && now - lastSaveTime >= SAVE_INTERVAL_MS) {
-      prefs.putInt((getName() + "_level").c_str(), currentLevel);
-      lastSavedLevel = currentLevel;
-      lastSaveTime = now;
-      log("Level saved", "currentLevel=" + String(currentLevel));
-    }
+    DeviceTable::updateTank(tankIdx, getCurrentUtcMillis());
+  }
+  void saveLevel(uint64_t now) {
+    prefs.putFloat((getName() + "_level").c_str(), currentLevel);
+    lastSavedLevel = currentLevel;
+    lastSaveTime = now;
+    log("Level saved", "currentLevel=" + String(currentLevel));
   }
-  void on(unsigned long duration = 0) override {
-    Device::on(duration);
+  bool on(unsigned long duration = 0) override {
+    return Device::on(duration);
   }
   void off() override{
     isActive = false;
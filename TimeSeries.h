@@ -0,0 +1,265 @@
+// TimeSeries.h
+#ifndef TIME_SERIES_H
+#define TIME_SERIES_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+#include <vector>
+#include <Console.h>
+#include <Snapshot.h>
+
+extern Preferences prefs;
+
+// Временные ряды уровней баков и загрузки моторов на флеше.
+// Раз в интервал (TS_INTERVAL, по умолчанию DEFAULT_INTERVAL_S) берётся отсчёт:
+// уровень бака в мл и доля времени работы мотора 0..1. В памяти копятся агрегаты
+// min/max/avg за минуту, час и сутки; закрытый агрегат пишется записью
+// фиксированного размера в кольцевой файл своего разрешения (/ts_1m.bin ...).
+// Запрос читает только файл нужного разрешения, от новых записей к старым.
+//
+// Файл: "TSR", версия u8, ёмкость u16, резерв u16, всего записано u32,
+// затем ёмкость * Record. Ряд определяется хэшем имени, а не слотом.
+class TimeSeries {
+public:
+  static const uint8_t VERSION = 1;
+  static const int TIERS = 3;
+  static const int HEADER = 12;
+  static const int DEFAULT_INTERVAL_S = 10;
+
+  struct Record {
+    uint32_t time;      // UTC, секунды, начало интервала
+    uint16_t series;
+    uint16_t samples;
+    float min;
+    float max;
+    float avg;
+  };
+
+  struct Tier {
+    const char* name;
+    const char* path;
+    uint32_t seconds;
+    uint16_t capacity;
+  };
+
+  static const Tier& tier(int i) {
+    static const Tier tiers[TIERS] = {
+        {"1m", "/ts_1m.bin", 60, 2048},
+        {"1h", "/ts_1h.bin", 3600, 2048},
+        {"1d", "/ts_1d.bin", 86400, 1024},
+    };
+    return tiers[i];
+  }
+
+  static uint16_t seriesId(const String& name) { return (uint16_t)Snapshot::hash(name.c_str()); }
+
+  void begin() {
+    intervalS = prefs.getInt("ts_interval", DEFAULT_INTERVAL_S);
+    if (intervalS <= 0) intervalS = DEFAULT_INTERVAL_S;
+  }
+
+  bool setInterval(int seconds) {
+    if (seconds <= 0 || seconds > 3600) return false;
+    intervalS = seconds;
+    prefs.putInt("ts_interval", seconds);
+    return true;
+  }
+  int getInterval() const { return intervalS; }
+
+  void update(Device* const* devices, int count) {
+    if (!Device::hasWallClock()) return;
+    uint64_t now = Device::getCurrentUtcMillis();
+    if (lastSample && now - lastSample < (uint64_t)intervalS * 1000) return;
+    uint64_t elapsed = lastSample ? now - lastSample : 0;
+    lastSample = now;
+    uint32_t seconds = now / 1000;
+
+    // Граница минуты (часа, суток) - закрываем агрегаты до нового отсчёта
+    for (int t = 0; t < TIERS; t++) {
+      uint32_t bucket = seconds / tier(t).seconds;
+      if (bucket == current[t]) break;
+      if (current[t]) close(t);
+      current[t] = bucket;
+    }
+
+    for (int i = 0; i < count; i++) {
+      Device* d = devices[i];
+      int slot = d->getSlot();
+      if (slot >= DeviceTable::SIZE) continue;
+      float value;
+      DeviceType type = d->getDeviceType();
+      if (type == DeviceType::TANK) {
+        value = static_cast<Tank*>(d)->getCurrentLevel();
+      } else if (type == DeviceType::MOTOR) {
+        uint64_t onMs = d->getStats().onMs + (d->isDeviceActive() ? d->getActiveDuration() : 0);
+        uint64_t prev = prevOnMs[slot];
+        prevOnMs[slot] = onMs;
+        if (!elapsed || onMs < prev) continue; // первый отсчёт или счётчик сброшен
+        value = (float)(onMs - prev) / elapsed;
+        if (value > 1) value = 1;
+      } else {
+        continue;
+      }
+      add(acc[0][slot], seriesId(d->getName()), value, 1);
+    }
+  }
+
+  // Окно и разрешение: "6h,1m", "7d,1h", "90d,1d"
+  bool query(const String& name, const String& spec, Print& out, String& error) const {
+    int comma = spec.indexOf(',');
+    uint32_t window = parseDuration(comma < 0 ? spec : spec.substring(0, comma));
+    String res = comma < 0 ? String("1m") : spec.substring(comma + 1);
+    int t = 0;
+    while (t < TIERS && res != tier(t).name) t++;
+    if (!window || t == TIERS) {
+      error = "Expected <window>,<1m|1h|1d>, e.g. 6h,1m";
+      return false;
+    }
+    if (!Device::hasWallClock()) {
+      error = "Wall clock is not synced yet";
+      return false;
+    }
+    uint32_t now = Device::getCurrentUtcMillis() / 1000;
+    uint32_t from = now > window ? now - window : 0;
+    uint16_t series = seriesId(name);
+
+    File file = LittleFS.open(tier(t).path, FILE_READ);
+    uint16_t capacity;
+    uint32_t written;
+    out.println("[");
+    if (readHeader(file, t, capacity, written)) {
+      // Записи одного разрешения идут по времени: сначала с конца ищем начало окна,
+      // потом печатаем вперёд по записи в строке, без буфера под результат
+      uint32_t oldest = written > capacity ? written - capacity : 0;
+      uint32_t first = written;
+      uint32_t time;
+      while (first > oldest) {
+        file.seek(HEADER + ((first - 1) % capacity) * sizeof(Record));
+        if (file.read((uint8_t*)&time, sizeof(time)) != sizeof(time) || time < from) break;
+        first--;
+      }
+      Record r;
+      bool any = false;
+      for (uint32_t i = first; i < written; i++) {
+        file.seek(HEADER + (i % capacity) * sizeof(Record));
+        if (file.read((uint8_t*)&r, sizeof(r)) != sizeof(r)) break;
+        if (r.series != series) continue;
+        char buf[80];
+        snprintf(buf, sizeof(buf), "%s[%lu,%.2f,%.2f,%.2f]", any ? "," : "", (unsigned long)r.time, r.min, r.max,
+                 r.avg);
+        out.println(buf);
+        any = true;
+      }
+    }
+    file.close();
+    out.println("]");
+    return true;
+  }
+
+private:
+  struct Acc {
+    uint16_t series;
+    uint32_t samples;
+    float min;
+    float max;
+    float sum;
+  };
+
+  int intervalS = DEFAULT_INTERVAL_S;
+  uint64_t lastSample = 0;
+  uint32_t current[TIERS] = {0};
+  Acc acc[TIERS][DeviceTable::SIZE] = {};
+  uint64_t prevOnMs[DeviceTable::SIZE] = {0};
+
+  static void add(Acc& a, uint16_t series, float value, uint32_t samples, float lo, float hi) {
+    // Слот занят другим устройством (переконфигурация) - начинаем заново
+    if (a.series != series) a.samples = 0;
+    if (a.samples == 0) {
+      a.series = series;
+      a.min = lo;
+      a.max = hi;
+      a.sum = 0;
+    }
+    if (lo < a.min) a.min = lo;
+    if (hi > a.max) a.max = hi;
+    a.sum += value * samples;
+    a.samples += samples;
+  }
+  static void add(Acc& a, uint16_t series, float value, uint32_t samples) { add(a, series, value, samples, value, value); }
+
+  // Пишет закрытые агрегаты разрешения t одной серией записей и сворачивает их в следующее
+  void close(int t) {
+    std::vector<Record> records;
+    for (int slot = 0; slot < DeviceTable::SIZE; slot++) {
+      Acc& a = acc[t][slot];
+      if (!a.samples) continue;
+      Record r;
+      r.time = current[t] * tier(t).seconds;
+      r.series = a.series;
+      r.samples = a.samples > 0xFFFF ? 0xFFFF : a.samples;
+      r.min = a.min;
+      r.max = a.max;
+      r.avg = a.sum / a.samples;
+      records.push_back(r);
+      if (t + 1 < TIERS) add(acc[t + 1][slot], a.series, r.avg, a.samples, a.min, a.max);
+      a.samples = 0;
+    }
+    if (!records.empty()) append(t, records);
+  }
+
+  bool readHeader(File& file, int t, uint16_t& capacity, uint32_t& written) const {
+    uint8_t h[HEADER];
+    if (!file || file.read(h, HEADER) != (size_t)HEADER) return false;
+    if (h[0] != 'T' || h[1] != 'S' || h[2] != 'R' || h[3] != VERSION) return false;
+    memcpy(&capacity, h + 4, 2);
+    memcpy(&written, h + 8, 4);
+    return capacity == tier(t).capacity;
+  }
+
+  void append(int t, const std::vector<Record>& records) {
+    const Tier& info = tier(t);
+    uint16_t capacity;
+    uint32_t written = 0;
+    File file = LittleFS.open(info.path, "r+");
+    if (!readHeader(file, t, capacity, written)) {
+      // Нет файла или другая ёмкость - создаём кольцо целиком, дальше только перезапись
+      file.close();
+      file = LittleFS.open(info.path, FILE_WRITE);
+      if (!file) {
+        Console.at(ConsoleSink::L_ERROR).printf("Error: Cannot create %s\n", info.path);
+        return;
+      }
+      uint8_t zeros[128] = {0};
+      size_t total = HEADER + (size_t)info.capacity * sizeof(Record);
+      for (size_t n = 0; n < total; n += sizeof(zeros)) {
+        file.write(zeros, total - n < sizeof(zeros) ? total - n : sizeof(zeros));
+      }
+      written = 0;
+    }
+    for (const Record& r : records) {
+      file.seek(HEADER + (written % info.capacity) * sizeof(Record));
+      file.write((const uint8_t*)&r, sizeof(r));
+      written++;
+    }
+    uint8_t h[HEADER] = {'T', 'S', 'R', VERSION};
+    memcpy(h + 4, &info.capacity, 2);
+    memcpy(h + 8, &written, 4);
+    file.seek(0);
+    file.write(h, HEADER);
+    file.close();
+  }
+
+  static uint32_t parseDuration(const String& s) {
+    if (s.length() < 2) return 0;
+    uint32_t n = s.substring(0, s.length() - 1).toInt();
+    switch (s[s.length() - 1]) {
+      case 'm': return n * 60;
+      case 'h': return n * 3600;
+      case 'd': return n * 86400;
+    }
+    return 0;
+  }
+};
+
+#endif
@@ -0,0 +1,75 @@
+// Trace.cpp
+#include "Trace.h"
+#include "Device.h"
+
+File Trace::file;
+bool Trace::active = false;
+unsigned long Trace::lastEventMs = 0;
+unsigned long Trace::lastFlushMs = 0;
+
+bool Trace::start(const char* path) {
+  stop();
+  file = LittleFS.open(path, FILE_WRITE);
+  if (!file) return false;
+  const uint8_t header[4] = {'T', 'R', 'C', VERSION};
+  file.write(header, sizeof(header));
+  LogCodec::writeVarint(file, Device::getCurrentUtcMillis());
+  active = true;
+  lastEventMs = millis();
+  lastFlushMs = lastEventMs;
+  return true;
+}
+
+void Trace::stop() {
+  if (!active) return;
+  active = false;
+  file.close();
+}
+
+void Trace::update(unsigned long nowMs) {
+  if (active && nowMs - lastFlushMs >= FLUSH_MS) {
+    file.flush();
+    lastFlushMs = nowMs;
+  }
+}
+
+void Trace::begin(Kind kind) {
+  unsigned long now = millis();
+  file.write((uint8_t)kind);
+  LogCodec::writeVarint(file, now - lastEventMs);
+  lastEventMs = now;
+}
+
+// Служебные и диагностические команды - не нагрузка: TRACE replay в трейсе
+// зациклил бы воспроизведение, BENCH и C_APPLY пересоздают устройства
+bool Trace::isMeta(const char* line) {
+  static const char* const meta[] = {"TRACE",     "BENCH",    "C_APPLY",  "D_STATS",   "D_ALLOC",
+                                     "PIN_TRACE", "WS_STATS", "R_STATS",  "LOG_LEVEL", "LOG_ARENA"};
+  while (*line == ' ') line++;
+  size_t len = strcspn(line, " \r\n");
+  for (const char* m : meta) {
+    if (strlen(m) == len && strncmp(line, m, len) == 0) return true;
+  }
+  return false;
+}
+
+void Trace::command(Kind source, const String& line) {
+  if (!active || isMeta(line.c_str())) return;
+  size_t len = line.length() > 64 ? 64 : line.length();
+  begin(source);
+  file.write((uint8_t)len);
+  file.write((const uint8_t*)line.c_str(), len);
+}
+
+void Trace::button(int slot, bool pressed) {
+  if (!active) return;
+  begin(BUTTON);
+  file.write((uint8_t)slot);
+  file.write((uint8_t)(pressed ? 1 : 0));
+}
+
+void Trace::ntp(time_t seconds) {
+  if (!active) return;
+  begin(NTP);
+  LogCodec::writeVarint(file, (uint64_t)seconds);
+}
@@ -0,0 +1,210 @@
+// Trace.h
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include <LogCodec.h>
+
+// Запись входных событий для воспроизведения нагрузки на стенде:
+// команды (Serial/WebSocket), нажатия кнопок и обновления NTP.
+// Служебные и диагностические команды (isMeta) не пишутся и не воспроизводятся.
+// Файл: "TRC", версия, UTC начала записи (varint), далее записи
+// [вид u8][мс от предыдущей varint][данные]:
+// команда - длина u8 и текст, кнопка - слот u8 и нажата u8, NTP - секунды varint.
+class Trace {
+public:
+  static const uint8_t VERSION = 1;
+  static const unsigned long FLUSH_MS = 1000;
+  enum Kind : uint8_t { CMD_SERIAL = 1, CMD_WS = 2, BUTTON = 3, NTP = 4 };
+
+  struct Event {
+    Kind kind;
+    uint32_t atMs;      // от начала записи
+    char text[65];
+    uint8_t slot;
+    bool pressed;
+    uint32_t seconds;
+  };
+
+  static bool start(const char* path = "/trace.bin");
+  static void stop();
+  static bool recording() { return active; }
+  static void update(unsigned long nowMs);
+
+  static void command(Kind source, const String& line);
+  static bool isMeta(const char* line);
+  static void button(int slot, bool pressed);
+  static void ntp(time_t seconds);
+
+private:
+  static File file;
+  static bool active;
+  static unsigned long lastEventMs;
+  static unsigned long lastFlushMs;
+  static void begin(Kind kind);
+};
+
+// Последовательное чтение записанного файла
+class TraceReader {
+public:
+  bool open(const char* path) {
+    file = LittleFS.open(path, FILE_READ);
+    if (!file) return false;
+    uint8_t header[4];
+    uint64_t start;
+    if (file.read(header, 4) != 4 || header[0] != 'T' || header[1] != 'R' || header[2] != 'C' ||
+        header[3] != Trace::VERSION || !LogCodec::readVarint(file, start)) {
+      file.close();
+      return false;
+    }
+    startUtc = start;
+    atMs = 0;
+    return true;
+  }
+  void close() { file.close(); }
+
+  bool next(Trace::Event& e) {
+    int kind = file.read();
+    uint64_t dt;
+    if (kind < 0 || !LogCodec::readVarint(file, dt)) return false;
+    atMs += dt;
+    e.kind = (Trace::Kind)kind;
+    e.atMs = atMs;
+    if (e.kind == Trace::CMD_SERIAL || e.kind == Trace::CMD_WS) {
+      int len = file.read();
+      if (len < 0 || len > 64 || file.read((uint8_t*)e.text, len) != (size_t)len) return false;
+      e.text[len] = '\0';
+    } else if (e.kind == Trace::BUTTON) {
+      int slot = file.read();
+      int pressed = file.read();
+      if (slot < 0 || pressed < 0) return false;
+      e.slot = slot;
+      e.pressed = pressed;
+    } else if (e.kind == Trace::NTP) {
+      uint64_t seconds;
+      if (!LogCodec::readVarint(file, seconds)) return false;
+      e.seconds = seconds;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  uint64_t startUtc = 0;
+
+private:
+  File file;
+  uint32_t atMs = 0;
+};
+
+// Воспроизведение: speed 0 - как можно быстрее, иначе во сколько раз быстрее записи.
+// Задержка (насколько позже плана выполнено событие) и время обработки команды
+// собираются в выборку для перцентилей.
+class TracePlayer {
+public:
+  static const int MAX_SAMPLES = 512;
+  static const unsigned long TICK_BUDGET_MS = 20; // в режиме ASAP не держим цикл дольше
+
+  bool start(const char* path, float speed, int scale) {
+    stop();
+    if (!reader.open(path)) return false;
+    this->speed = speed;
+    this->scale = scale < 1 ? 1 : scale;
+    startMs = millis();
+    events = 0;
+    commands = 0;
+    serviceUs.clear();
+    lagMs.clear();
+    hasPending = reader.next(pending);
+    running = hasPending;
+    if (!running) reader.close();
+    return true;
+  }
+  void stop() {
+    if (running) reader.close();
+    running = false;
+  }
+  bool isRunning() const { return running; }
+  int getScale() const { return scale; }
+  uint64_t traceStartUtc() const { return reader.startUtc; }
+  unsigned long elapsed(unsigned long nowMs) const { return nowMs - startMs; }
+
+  // Следующее событие, которое пора выполнить; lag - опоздание в мс
+  bool due(unsigned long nowMs, unsigned long tickStartMs, Trace::Event& e, uint32_t& lag) {
+    if (!running) return false;
+    if (speed <= 0) {
+      if (nowMs - tickStartMs >= TICK_BUDGET_MS) return false;
+      lag = 0;
+    } else {
+      unsigned long at = startMs + (unsigned long)(pending.atMs / speed);
+      if ((long)(nowMs - at) < 0) return false;
+      lag = nowMs - at;
+    }
+    e = pending;
+    events++;
+    hasPending = reader.next(pending);
+    if (!hasPending) {
+      reader.close();
+      running = false;
+      finishedMs = nowMs;
+    }
+    return true;
+  }
+
+  void sample(uint32_t us, uint32_t lag) {
+    commands++;
+    add(serviceUs, us);
+    add(lagMs, lag);
+  }
+
+  void report(Print& out) {
+    unsigned long elapsed = (running ? millis() : finishedMs) - startMs;
+    char buf[160];
+    snprintf(buf, sizeof(buf), "Replay %s: %lu events, %lu commands in %lu ms, %.1f cmd/s",
+             running ? "running" : "done", (unsigned long)events, (unsigned long)commands, elapsed,
+             elapsed ? commands * 1000.0f / elapsed : 0.0f);
+    out.println(buf);
+    printPercentiles(out, "service us", serviceUs);
+    printPercentiles(out, "lag ms", lagMs);
+  }
+
+private:
+  TraceReader reader;
+  Trace::Event pending;
+  bool hasPending = false;
+  bool running = false;
+  float speed = 1;
+  int scale = 1;
+  unsigned long startMs = 0;
+  unsigned long finishedMs = 0;
+  uint32_t events = 0;
+  uint32_t commands = 0;
+  std::vector<uint32_t> serviceUs;
+  std::vector<uint32_t> lagMs;
+
+  // Резервуарная выборка, чтобы длинный трейс не съел память
+  void add(std::vector<uint32_t>& samples, uint32_t v) {
+    if (samples.size() < (size_t)MAX_SAMPLES) {
+      samples.push_back(v);
+      return;
+    }
+    uint32_t i = random(commands);
+    if (i < (uint32_t)MAX_SAMPLES) samples[i] = v;
+  }
+
+  static void printPercentiles(Print& out, const char* label, std::vector<uint32_t> samples) {
+    if (samples.empty()) return;
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    char buf[128];
+    snprintf(buf, sizeof(buf), "  %s: p50=%lu p90=%lu p99=%lu max=%lu", label, (unsigned long)samples[n / 2],
+             (unsigned long)samples[n * 9 / 10], (unsigned long)samples[n * 99 / 100], (unsigned long)samples[n - 1]);
+    out.println(buf);
+  }
+};
+
+#endif
@@ -3,6 +3,8 @@
 
 #include <Device.h>
 #include <Tank.h>
+#include <EventBus.h>
+#include <Reservations.h>
 
 
 
@@ -14,9 +16,11 @@ protected:
 public:
     Valve(String deviceName, int pin, Tank* out1 = nullptr, Tank* out2 = nullptr)
         : Device(deviceName, pin, -1, true), out1(out1), out2(out2){
+          DeviceTable::type[slot] = DeviceType::VALVE;
           activeTank = out1;
     }
     String motor_name = ""; 
+    int motorSlot = -1; // слот мотора в DeviceTable
     bool in = false;
     void begin() override {
       Device::begin();
@@ -40,34 +44,37 @@ public:
         //extra["out2"] = tank ? tank->getName() : "";
         //fileLog("debug", "Установлен out2", extra.as<JsonObject>(), true);
     }
+    // Новые выходы после переконфигурации, положение клапана сохраняется
+    void link(Tank* tank1, Tank* tank2) {
+        out1 = tank1;
+        out2 = tank2;
+        setActiveTank(isActive ? out2 : out1);
+    }
     void setActiveTank(Tank* tank) {
+        if (activeTank != tank) {
+          EventBus::publish(slot, CHANGE_ROUTE);
+          EventBus::publish(motorSlot, CHANGE_ROUTE);
+        }
         activeTank = tank;
     }
-    void on(unsigned long duration = 0) override {
+    bool on(unsigned long duration = 0) override {
+      // Пока мотор качает через другое положение, переключение ждёт в очереди
+      if (!Reservations::canSwitchValve(slot, true)) {
+        deferOp(true, duration);
+        return true;
+      }
       setActiveTank(getOut2());
-      Device::on(duration);
+      return Device::on(duration);
     }
 
     void off() override {
+      if (!Reservations::canSwitchValve(slot, false)) {
+        deferOp(false, 0);
+        return;
+      }
       setActiveTank(getOut1());
       Device::off();
-
-      StaticJsonDocument<4096> doc;
-      JsonArray arr = doc.to<JsonArray>();
-      JsonObject vd = arr.createNestedObject();
-      vd["n"] = name;
-      vd["t"] = "VALVE";
-      vd["at"] = getActiveTank() ? getActiveTank()->getName() : "";
-      vd["o1"] = getOut1() ? getOut1()->getName() : "";
-      vd["o2"] = getOut2() ? getOut2()->getName() : "";
-      JsonObject vm = arr.createNestedObject();
-      vm["n"] = motor_name;
-      vm["t"] = "MOTOR";
-      vm[(in ? "it" : "ot")] = getActiveTank() ? getActiveTank()->getName() : "";
-
-      String socketStr;
-      serializeJson(doc, socketStr);
-      webSocket.sendTXT(clientNum, socketStr);
+      // Клапан и его мотор уходят клиентам через EventBus в конце тика
 
         //digitalWrite(pin, LOW); // Выключение клапана (out1 активен)
         //StaticJsonDocument<4096> doc;
@@ -98,6 +105,8 @@ public:
             on(milliseconds);
             return true;
         } else if (cmd == "V_OFF") {
+            // Отложенное включение после явного выключения не выполняется
+            Reservations::cancel(slot, true);
             off();
             return true;
         } else if (cmd == "V_STATUS") {